@@ -25,13 +25,13 @@ namespace ch_frb_io {
 
 
 // This helper function's purpose in life is to compute
-//   nt_coarse = constants::nt_per_assembled_chunk / nt_per_packet
+//   nt_coarse = nt_per_chunk / nt_per_packet
 // in a way which throws a C++ exception (rather than a hardware exception)
 // if nt_per_packet == 0.
 
-static int _nt_c(int nt_per_packet)
+static int _nt_c(int nt_per_packet, int nt_per_chunk)
 {
-    int nt_f = constants::nt_per_assembled_chunk;
+    int nt_f = nt_per_chunk;
 
     if (nt_per_packet <= 0)
 	throw runtime_error("ch_frb_io: assembled_chunk constructor expects nt_per_packet > 0");
@@ -41,7 +41,42 @@ static int _nt_c(int nt_per_packet)
 }
 
 
+coarse_freq_map::coarse_freq_map(const vector<int> &coarse_freq_ids_) :
+    coarse_freq_ids(coarse_freq_ids_),
+    local_index(constants::nfreq_coarse_tot, -1)
+{
+    if (coarse_freq_ids.size() == 0)
+	throw runtime_error("ch_frb_io: coarse_freq_map constructor: 'coarse_freq_ids' is empty");
+
+    for (unsigned int i = 0; i < coarse_freq_ids.size(); i++) {
+	int id = coarse_freq_ids[i];
+	if ((id < 0) || (id >= constants::nfreq_coarse_tot))
+	    throw runtime_error("ch_frb_io: coarse_freq_map constructor: coarse_freq_id=" + to_string(id) + " is out of range");
+	if ((i > 0) && (id <= coarse_freq_ids[i-1]))
+	    throw runtime_error("ch_frb_io: coarse_freq_map constructor: 'coarse_freq_ids' must be strictly increasing");
+	local_index[id] = i;
+    }
+}
+
+
+// Static member function
+shared_ptr<const coarse_freq_map> coarse_freq_map::make(const vector<int> &coarse_freq_ids)
+{
+    if (coarse_freq_ids.size() == 0)
+	return shared_ptr<const coarse_freq_map> ();
+    return make_shared<const coarse_freq_map> (coarse_freq_ids);
+}
+
+
+static int _nfreq_c(const shared_ptr<const coarse_freq_map> &freq_map)
+{
+    return freq_map ? freq_map->nfreq_coarse() : constants::nfreq_coarse_tot;
+}
+
+
 // A helper class describing the layout of assembled_chunk::memory_slab.
+// Scratch space for downsampling is not part of the slab (see get_downsampling_workspace()),
+// and the RFI mask only takes up space if nrfifreq > 0.
 struct memory_slab_layout {
     const int nfreq_c;
     const int nfreq_f;
@@ -53,42 +88,30 @@ struct memory_slab_layout {
     const int nb_scales;
     const int nb_offsets;
     const int nb_rfimask;
-    const int nb_ds_data;
-    const int nb_ds_mask;
-    const int nb_ds_w2;
 
     // All ib_* fields are array offsets within the memory_slab, in bytes
     const int ib_data;
     const int ib_scales;
     const int ib_offsets;
     const int ib_rfimask;
-    const int ib_ds_data;
-    const int ib_ds_mask;
-    const int ib_ds_w2;
     const int slab_size;
 
     static int align(int nbytes) { return ((nbytes+63)/64) * 64; }
 
-    memory_slab_layout(int nupfreq, int nt_per_packet, int nrfifreq) :
-	nfreq_c(constants::nfreq_coarse_tot),
-	nfreq_f(constants::nfreq_coarse_tot * nupfreq),
-	nt_f(constants::nt_per_assembled_chunk),
-	nt_c(_nt_c(nt_per_packet)),
+    memory_slab_layout(int nupfreq, int nt_per_packet, int nrfifreq, int nt_per_chunk, int nfreq_coarse) :
+	nfreq_c(nfreq_coarse),
+	nfreq_f(nfreq_coarse * nupfreq),
+	nt_f(nt_per_chunk),
+	nt_c(_nt_c(nt_per_packet, nt_per_chunk)),
 	nb_data(nfreq_f * nt_f),
 	nb_scales(nfreq_c * nt_c * sizeof(float)),
 	nb_offsets(nfreq_c * nt_c * sizeof(float)),
         nb_rfimask(nrfifreq * nt_f / 8 * sizeof(uint8_t)),
-	nb_ds_data(nupfreq * (nt_f/2) * sizeof(float)),
-	nb_ds_mask(nupfreq * (nt_f/2) * sizeof(int)),
-	nb_ds_w2((nt_c/2) * sizeof(float)),
 	ib_data(0),
 	ib_scales(align(ib_data + nb_data)),
 	ib_offsets(align(ib_scales + nb_scales)),
         ib_rfimask(align(ib_offsets + nb_offsets)),
-	ib_ds_data(align(ib_rfimask + nb_rfimask)),
-	ib_ds_mask(align(ib_ds_data + nb_ds_data)),
-	ib_ds_w2(align(ib_ds_mask + nb_ds_mask)),
-	slab_size(align(ib_ds_w2 + nb_ds_w2))
+	slab_size(align(ib_rfimask + nb_rfimask))
     { }
 };
 
@@ -98,18 +121,21 @@ assembled_chunk::assembled_chunk(const assembled_chunk::initializer &ini_params)
     nupfreq(ini_params.nupfreq),
     nrfifreq(ini_params.nrfifreq),
     nt_per_packet(ini_params.nt_per_packet),
+    nt_per_chunk(ini_params.nt_per_chunk),
     fpga_counts_per_sample(ini_params.fpga_counts_per_sample), 
     binning(ini_params.binning),
     stream_id(ini_params.stream_id),
     ichunk(ini_params.ichunk),
     frame0_nano(ini_params.frame0_nano),
-    nt_coarse(_nt_c(nt_per_packet)),
-    nscales(constants::nfreq_coarse_tot * nt_coarse),
-    ndata(constants::nfreq_coarse_tot * nupfreq * constants::nt_per_assembled_chunk),
-    nrfimaskbytes(nrfifreq * constants::nt_per_assembled_chunk / 8),
-    isample(ichunk * constants::nt_per_assembled_chunk),
-    fpga_begin(ichunk * constants::nt_per_assembled_chunk * fpga_counts_per_sample),
-    fpga_end((ichunk+binning) * constants::nt_per_assembled_chunk * fpga_counts_per_sample),
+    freq_map(ini_params.freq_map),
+    nfreq_coarse(_nfreq_c(freq_map)),
+    nt_coarse(_nt_c(nt_per_packet, nt_per_chunk)),
+    nscales(nfreq_coarse * nt_coarse),
+    ndata(nfreq_coarse * nupfreq * nt_per_chunk),
+    nrfimaskbytes(nrfifreq * nt_per_chunk / 8),
+    isample(ichunk * nt_per_chunk),
+    fpga_begin(ichunk * nt_per_chunk * fpga_counts_per_sample),
+    fpga_end((ichunk+binning) * nt_per_chunk * fpga_counts_per_sample),
     has_rfi_mask(false),
     packets_received(0)
 {
@@ -119,22 +145,24 @@ assembled_chunk::assembled_chunk(const assembled_chunk::initializer &ini_params)
 	throw runtime_error("assembled_chunk constructor: bad 'nupfreq' argument");
     if (nrfifreq < 0)
 	throw runtime_error("assembled_chunk constructor: bad 'nrfifreq' argument");
-    if ((nrfifreq > 0) && ((constants::nfreq_coarse_tot * nupfreq) % nrfifreq))
+    if ((nrfifreq > 0) && ((nfreq_coarse * nupfreq) % nrfifreq))
 	throw runtime_error("assembled_chunk constructor: bad 'nrfifreq' argument");
-    if ((nt_per_packet <= 0) || !is_power_of_two(nt_per_packet) || (nt_per_packet > constants::nt_per_assembled_chunk))
+    if ((nt_per_chunk <= 0) || !is_power_of_two(nt_per_chunk) || (nt_per_chunk > constants::max_allowed_nt_per_chunk))
+	throw runtime_error("assembled_chunk constructor: bad 'nt_per_chunk' argument");
+    if ((nt_per_packet <= 0) || !is_power_of_two(nt_per_packet) || (nt_per_packet > nt_per_chunk))
 	throw runtime_error("assembled_chunk constructor: bad 'nt_per_packet' argument");
     if ((fpga_counts_per_sample <= 0) || (fpga_counts_per_sample > constants::max_allowed_fpga_counts_per_sample))
 	throw runtime_error("assembled_chunk constructor: bad 'fpga_counts_per_sample' argument");
-    if ((binning <= 0) || !is_power_of_two(binning) || (binning > 8))
+    if ((binning <= 0) || !is_power_of_two(binning) || (binning > constants::max_allowed_binning))
 	throw runtime_error("assembled_chunk constructor: bad 'binning' argument");
     if ((stream_id < 0) || (stream_id > 9))
 	throw runtime_error("assembled_chunk constructor: bad 'stream_id' argument");
 
-    uint64_t ichunk_max = UINT64_MAX / uint64_t(constants::nt_per_assembled_chunk * fpga_counts_per_sample);
+    uint64_t ichunk_max = UINT64_MAX / uint64_t(nt_per_chunk * fpga_counts_per_sample);
     if (ichunk > ichunk_max)
 	throw runtime_error("assembled_chunk constructor: bad 'ichunk' argument");
 
-    memory_slab_layout mc(nupfreq, nt_per_packet, nrfifreq);
+    memory_slab_layout mc(nupfreq, nt_per_packet, nrfifreq, nt_per_chunk, nfreq_coarse);
 
     if (ini_params.pool) {
 	if (!ini_params.slab)
@@ -149,6 +177,7 @@ assembled_chunk::assembled_chunk(const assembled_chunk::initializer &ini_params)
 
 	this->memory_pool = ini_params.pool;
 	this->memory_slab.swap(ini_params.slab);
+	this->memory_slab_nbytes = ini_params.pool->nbytes_per_mapping;
     }
     else {
 	if (ini_params.slab)
@@ -156,21 +185,54 @@ assembled_chunk::assembled_chunk(const assembled_chunk::initializer &ini_params)
 
 	uint8_t *p = aligned_alloc<uint8_t> (mc.slab_size);
 	this->memory_slab = memory_slab_t(p);
+	this->memory_slab_nbytes = mc.slab_size;
+
+	// The caller has already reserved 'memory_slab_nbytes' in *heap_nbytes (see initializer::heap_nbytes).
+	this->heap_nbytes = ini_params.heap_nbytes;
     }
 
     this->data = memory_slab.get() + mc.ib_data;
     this->scales = reinterpret_cast<float *> (memory_slab.get() + mc.ib_scales);
     this->offsets = reinterpret_cast<float *> (memory_slab.get() + mc.ib_offsets);
     this->rfi_mask = nrfifreq ? reinterpret_cast<uint8_t *> (memory_slab.get() + mc.ib_rfimask) : nullptr;
-    this->ds_data = reinterpret_cast<float *> (memory_slab.get() + mc.ib_ds_data);
-    this->ds_mask = reinterpret_cast<int *> (memory_slab.get() + mc.ib_ds_mask);
-    this->ds_w2 = reinterpret_cast<float *> (memory_slab.get() + mc.ib_ds_w2);
+}
+
+
+// Both chunk classes have the same size (fast_assembled_chunk only overrides virtuals), so in
+// practice all chunks come from the same free list.
+void *assembled_chunk::operator new(size_t nbytes)
+{
+    if (nbytes == sizeof(assembled_chunk))
+	return block_free_list<sizeof(assembled_chunk)>::allocate();
+    return ::operator new(nbytes);
+}
+
+
+void assembled_chunk::operator delete(void *p, size_t nbytes)
+{
+    if (nbytes == sizeof(assembled_chunk))
+	block_free_list<sizeof(assembled_chunk)>::deallocate(p);
+    else
+	::operator delete(p);
+}
+
+
+// Total size of the compressed data held by all chunks (see assembled_chunk::compress()).
+static std::atomic<int64_t> total_compressed_nbytes(0);
+
+int64_t assembled_chunk::get_total_compressed_nbytes()
+{
+    return total_compressed_nbytes;
 }
 
 
 assembled_chunk::~assembled_chunk()
 {
     this->_deallocate();
+    total_compressed_nbytes -= compressed_nbytes;
+
+    if (compressed_budget)
+	compressed_budget->_release(compressed_nbytes);
 }
 
 
@@ -181,31 +243,37 @@ void assembled_chunk::_deallocate()
 	memory_pool->put_slab(memory_slab);
 	memory_pool = shared_ptr<memory_slab_pool> ();
     }
+
+    if (heap_nbytes) {
+	*heap_nbytes -= memory_slab_nbytes;
+	heap_nbytes = shared_ptr<std::atomic<int64_t>> ();
+    }
     
     // Shouldn't be necessary, but guards against accidental pointer reuse after free().
     this->scales = nullptr;
     this->offsets = nullptr;
     this->data = nullptr;
     this->rfi_mask = nullptr;
-    this->ds_w2 = nullptr;
-    this->ds_data = nullptr;
-    this->ds_mask = nullptr;
 }
 
     
 // Static member function
-ssize_t assembled_chunk::get_memory_slab_size(int nupfreq, int nt_per_packet, int nrfifreq)
+ssize_t assembled_chunk::get_memory_slab_size(int nupfreq, int nt_per_packet, int nrfifreq, int nt_per_chunk, int nfreq_coarse)
 {
+    if ((nfreq_coarse <= 0) || (nfreq_coarse > constants::nfreq_coarse_tot))
+	throw runtime_error("assembled_chunk::get_memory_slab_size(): bad 'nfreq_coarse' argument");
     if ((nupfreq <= 0) || (nupfreq > constants::max_allowed_nupfreq))
 	throw runtime_error("assembled_chunk::get_memory_slab_size(): bad 'nupfreq' argument");
-    if ((nt_per_packet <= 0) || !is_power_of_two(nt_per_packet) || (nt_per_packet > constants::nt_per_assembled_chunk))
+    if ((nt_per_chunk <= 0) || !is_power_of_two(nt_per_chunk) || (nt_per_chunk > constants::max_allowed_nt_per_chunk))
+	throw runtime_error("assembled_chunk::get_memory_slab_size(): bad 'nt_per_chunk' argument");
+    if ((nt_per_packet <= 0) || !is_power_of_two(nt_per_packet) || (nt_per_packet > nt_per_chunk))
 	throw runtime_error("assembled_chunk::get_memory_slab_size(): bad 'nt_per_packet' argument");
     if (nrfifreq < 0)
 	throw runtime_error("assembled_chunk::get_memory_slab_size(): bad 'nrfifreq' argument");
-    if ((nrfifreq > 0) && ((constants::nfreq_coarse_tot * nupfreq) % nrfifreq))
+    if ((nrfifreq > 0) && ((nfreq_coarse * nupfreq) % nrfifreq))
 	throw runtime_error("assembled_chunk::get_memory_slab_size(): bad 'nrfifreq' argument");
 
-    memory_slab_layout mc(nupfreq, nt_per_packet, nrfifreq);
+    memory_slab_layout mc(nupfreq, nt_per_packet, nrfifreq, nt_per_chunk, nfreq_coarse);
     return mc.slab_size;
 }
 
@@ -262,14 +330,20 @@ string assembled_chunk::format_filename(const string &pattern) const {
     //   (CHUNK)   -> %08i ichunk
     //   (NCHUNK)  -> %02i  size in chunks
     //   (BINNING) -> %02i  size in chunks
+    //   (LEVEL)   -> %02i  level in telescoping ring buffer (log2 of binning)
     //   (FPGA0)   -> %012i start FPGA-counts
     //   (FPGAN)   -> %08i  FPGA-counts size
+    int level = 0;
+    while ((1 << level) < binning)
+	level++;
+
     string s = pattern;
     s = replaceAll(s, "(STREAM)",  stringprintf("%01i",        stream_id));
     s = replaceAll(s, "(BEAM)",    stringprintf("%04i",        beam_id));
     s = replaceAll(s, "(CHUNK)",   stringprintf("%08"  PRIu64, ichunk));
     s = replaceAll(s, "(NCHUNK)",  stringprintf("%02i",        binning));
     s = replaceAll(s, "(BINNING)", stringprintf("%02i",        binning));
+    s = replaceAll(s, "(LEVEL)",   stringprintf("%02i",        level));
     s = replaceAll(s, "(FPGA0)",   stringprintf("%012" PRIu64, fpga_begin));
     s = replaceAll(s, "(FPGAN)",   stringprintf("%08"  PRIu64, fpga_end - fpga_begin));
     return s;
@@ -279,10 +353,12 @@ void assembled_chunk::fill_with_copy(const shared_ptr<assembled_chunk> &x)
 {
     if (!x)
 	throw runtime_error("assembled_chunk::fill_with_copy() called with empty pointer");
-    if ((this->nupfreq != x->nupfreq) || (this->nt_per_packet != x->nt_per_packet))
+    if ((this->nupfreq != x->nupfreq) || (this->nt_per_packet != x->nt_per_packet) || (this->nt_per_chunk != x->nt_per_chunk) || !this->_same_coarse_freqs(x.get()))
 	throw runtime_error("assembled_chunk::fill_with_copy() called on non-conformable chunks");
     if (this->nrfifreq != x->nrfifreq)
 	throw runtime_error("assembled_chunk::fill_with_copy() called on non-conformable chunks (nrfifreq)");
+    if (this->is_compressed() || x->is_compressed())
+	throw runtime_error("ch_frb_io: assembled_chunk::fill_with_copy() called on compressed chunk");
 
     if (x.get() == this)
 	return;
@@ -337,19 +413,24 @@ void assembled_chunk::add_packet(const intensity_packet &packet)
 		(packet.fpga_count % (fpga_counts_per_sample * nt_per_packet)) ||
 		(packet.beam_ids[0] != this->beam_id) ||
 		(packet_t0 < isample) ||
-		(packet_t0 + nt_per_packet > isample + constants::nt_per_assembled_chunk));
+		(packet_t0 + nt_per_packet > isample + nt_per_chunk));
 
     if (_unlikely(bad))
 	throw runtime_error("ch_frb_io: internal error in assembled_chunk::add_packet()");
+    if (_unlikely(this->is_compressed()))
+	throw runtime_error("ch_frb_io: assembled_chunk::add_packet() called on compressed chunk");
 
     for (int f = 0; f < packet.nfreq_coarse; f++) {
-	int coarse_freq_id = packet.coarse_freq_ids[f];
+	// Local channel index (coarse channels outside the chunk's subset are dropped).
+	int ic = freq_map ? freq_map->local_index[packet.coarse_freq_ids[f]] : packet.coarse_freq_ids[f];
+	if (ic < 0)
+	    continue;
 
-	this->scales[coarse_freq_id*nt_coarse + (t0/nt_per_packet)] = packet.scales[f];
-	this->offsets[coarse_freq_id*nt_coarse + (t0/nt_per_packet)] = packet.offsets[f];
+	this->scales[ic*nt_coarse + (t0/nt_per_packet)] = packet.scales[f];
+	this->offsets[ic*nt_coarse + (t0/nt_per_packet)] = packet.offsets[f];
 
 	for (int u = 0; u < nupfreq; u++) {
-	    memcpy(data + (coarse_freq_id*nupfreq + u) * constants::nt_per_assembled_chunk + t0, 
+	    memcpy(data + (ic*nupfreq + u) * nt_per_chunk + t0, 
 		   packet.data + (f*nupfreq + u) * nt_per_packet,
 		   nt_per_packet);
 	}
@@ -365,17 +446,22 @@ void assembled_chunk::decode(float *intensity, float *weights, int istride, int
 {
     if (!intensity || !weights)
 	throw runtime_error("ch_frb_io: null pointer passed to assembled_chunk::decode()");	
-    if (istride < constants::nt_per_assembled_chunk)
+    if (istride < nt_per_chunk)
 	throw runtime_error("ch_frb_io: bad istride passed to assembled_chunk::decode()");
-    if (wstride < constants::nt_per_assembled_chunk)
+    if (wstride < nt_per_chunk)
 	throw runtime_error("ch_frb_io: bad wstride passed to assembled_chunk::decode()");
 
-    for (int if_coarse = 0; if_coarse < constants::nfreq_coarse_tot; if_coarse++) {
+    if (this->is_compressed()) {
+	this->make_decompressed()->decode(intensity, weights, istride, wstride, prescale);
+	return;
+    }
+
+    for (int if_coarse = 0; if_coarse < nfreq_coarse; if_coarse++) {
 	const float *scales_f = this->scales + if_coarse * nt_coarse;
 	const float *offsets_f = this->offsets + if_coarse * nt_coarse;
 	
 	for (int if_fine = if_coarse*nupfreq; if_fine < (if_coarse+1)*nupfreq; if_fine++) {
-	    const uint8_t *src_f = this->data + if_fine * constants::nt_per_assembled_chunk;
+	    const uint8_t *src_f = this->data + if_fine * nt_per_chunk;
 	    float *int_f = intensity + if_fine * istride;
 	    float *wt_f = weights + if_fine * wstride;
 
@@ -401,15 +487,20 @@ void assembled_chunk::decode_subset(float *intensity, float *weights, int t0, in
 	throw runtime_error("ch_frb_io: bad istride passed to assembled_chunk::decode_subset()");
     if (wstride < NT)
 	throw runtime_error("ch_frb_io: bad wstride passed to assembled_chunk::decode_subset()");
-    if ((t0 < 0) || (NT < 0) || (t0 + NT > constants::nt_per_assembled_chunk))
+    if ((t0 < 0) || (NT < 0) || (t0 + NT > nt_per_chunk))
 	throw runtime_error("ch_frb_io: bad (t0,NT) passed to assembled_chunk::decode_subset()");
 
-    for (int if_coarse = 0; if_coarse < constants::nfreq_coarse_tot; if_coarse++) {
+    if (this->is_compressed()) {
+	this->make_decompressed()->decode_subset(intensity, weights, t0, NT, istride, wstride);
+	return;
+    }
+
+    for (int if_coarse = 0; if_coarse < nfreq_coarse; if_coarse++) {
 	const float * scales_f = this->scales  + if_coarse * nt_coarse;
 	const float *offsets_f = this->offsets + if_coarse * nt_coarse;
 
 	for (int if_fine = if_coarse*nupfreq; if_fine < (if_coarse+1)*nupfreq; if_fine++) {
-	    const uint8_t *src_f = this->data + if_fine * constants::nt_per_assembled_chunk;
+	    const uint8_t *src_f = this->data + if_fine * nt_per_chunk;
 	    float *int_f = intensity + if_fine * istride;
 	    float * wt_f = weights   + if_fine * wstride;
 
@@ -429,6 +520,103 @@ void assembled_chunk::decode_subset(float *intensity, float *weights, int t0, in
 }
 
 
+void assembled_chunk::get_subchunk(assembled_subchunk &out, int it0, int nt) const
+{
+    if ((it0 < 0) || (nt <= 0) || (it0 + nt > nt_per_chunk) || (it0 % nt_per_packet) || (nt % nt_per_packet))
+	throw runtime_error("ch_frb_io: bad (it0,nt) passed to assembled_chunk::get_subchunk()");
+    if (!data)
+	throw runtime_error("ch_frb_io: assembled_chunk::get_subchunk() called on compressed chunk");
+
+    int nfreq = nfreq_coarse * nupfreq;
+    int ic0 = it0 / nt_per_packet;
+    int nc = nt / nt_per_packet;
+
+    out.beam_id = beam_id;
+    out.nupfreq = nupfreq;
+    out.nt_per_packet = nt_per_packet;
+    out.fpga_counts_per_sample = fpga_counts_per_sample;
+    out.ichunk = ichunk;
+    out.it0 = it0;
+    out.nt = nt;
+    out.fpga_begin = fpga_begin + uint64_t(it0) * fpga_counts_per_sample * binning;
+    out.fpga_end = out.fpga_begin + uint64_t(nt) * fpga_counts_per_sample * binning;
+    out.nfreq_coarse = nfreq_coarse;
+    out.freq_map = freq_map;
+
+    out.data.resize(nfreq * nt);
+    out.scales.resize(nfreq_coarse * nc);
+    out.offsets.resize(nfreq_coarse * nc);
+
+    for (int ifreq = 0; ifreq < nfreq; ifreq++)
+	memcpy(&out.data[ifreq * nt], this->data + ifreq * nt_per_chunk + it0, nt);
+
+    for (int if_coarse = 0; if_coarse < nfreq_coarse; if_coarse++) {
+	memcpy(&out.scales[if_coarse * nc], this->scales + if_coarse * nt_coarse + ic0, nc * sizeof(float));
+	memcpy(&out.offsets[if_coarse * nc], this->offsets + if_coarse * nt_coarse + ic0, nc * sizeof(float));
+    }
+}
+
+
+void assembled_subchunk::decode(float *intensity, float *weights, int istride, int wstride, float prescale) const
+{
+    if (!intensity || !weights)
+	throw runtime_error("ch_frb_io: null pointer passed to assembled_subchunk::decode()");
+    if (istride < nt)
+	throw runtime_error("ch_frb_io: bad istride passed to assembled_subchunk::decode()");
+    if (wstride < nt)
+	throw runtime_error("ch_frb_io: bad wstride passed to assembled_subchunk::decode()");
+
+    int nc = nt / nt_per_packet;
+
+    for (int if_coarse = 0; if_coarse < nfreq_coarse; if_coarse++) {
+	const float *scales_f = &scales[if_coarse * nc];
+	const float *offsets_f = &offsets[if_coarse * nc];
+
+	for (int if_fine = if_coarse*nupfreq; if_fine < (if_coarse+1)*nupfreq; if_fine++) {
+	    const uint8_t *src_f = &data[if_fine * nt];
+	    float *int_f = intensity + if_fine * istride;
+	    float *wt_f = weights + if_fine * wstride;
+
+	    for (int it_coarse = 0; it_coarse < nc; it_coarse++) {
+		float scale = scales_f[it_coarse] * prescale;
+		float offset = offsets_f[it_coarse] * prescale;
+
+		for (int it_fine = it_coarse*nt_per_packet; it_fine < (it_coarse+1)*nt_per_packet; it_fine++) {
+		    float x = float(src_f[it_fine]);
+		    int_f[it_fine] = scale*x + offset;
+		    wt_f[it_fine] = ((x==0) || (x==255)) ? 0.0 : 1.0;
+		}
+	    }
+	}
+    }
+}
+
+
+downsampling_workspace get_downsampling_workspace(int nupfreq, int nt_per_chunk, int nt_coarse)
+{
+    // The three arrays are packed into one 64-byte aligned buffer per thread.
+    static thread_local unique_ptr<uint8_t[]> buf;
+    static thread_local ssize_t buf_nbytes = 0;
+
+    ssize_t nb_data = ((nupfreq * (nt_per_chunk/2) * sizeof(float) + 63) / 64) * 64;
+    ssize_t nb_mask = ((nupfreq * (nt_per_chunk/2) * sizeof(int) + 63) / 64) * 64;
+    ssize_t nb_w2 = (((nt_coarse/2) * sizeof(float) + 63) / 64) * 64;
+    ssize_t nbytes = nb_data + nb_mask + nb_w2;
+
+    if (nbytes > buf_nbytes) {
+	buf.reset();
+	buf = aligned_unique_ptr<uint8_t> (nbytes);
+	buf_nbytes = nbytes;
+    }
+
+    downsampling_workspace ret;
+    ret.ds_data = reinterpret_cast<float *> (buf.get());
+    ret.ds_mask = reinterpret_cast<int *> (buf.get() + nb_data);
+    ret.ds_w2 = reinterpret_cast<float *> (buf.get() + nb_data + nb_mask);
+    return ret;
+}
+
+
 static void ds_slow_kernel(uint8_t *out_data, float *out_offsets, float *out_scales, const uint8_t *in_data, 
 			   const float *in_offsets, const float *in_scales, float *tmp_data, int *tmp_mask, 
 			   float *tmp_scales, int nupfreq, int nt_per_chunk, int nt_per_packet)
@@ -466,6 +654,8 @@ void assembled_chunk::_check_downsample(const assembled_chunk *src1, const assem
 {
     if (!src1 || !src2)
 	throw runtime_error("ch_frb_io: null pointer passed to assembled_chunk::downsample()");
+    if (this->is_compressed() || src1->is_compressed() || src2->is_compressed())
+	throw runtime_error("ch_frb_io: assembled_chunk::downsample() called on compressed chunk");
     if (this->has_rfi_mask)
 	throw runtime_error("ch_frb_io: assembled_chunk::downsample() called, and has_rfi_mask=true in destination chunk");
 
@@ -487,6 +677,10 @@ void assembled_chunk::_check_downsample(const assembled_chunk *src1, const assem
         throw runtime_error("ch_frb_io: assembled_chunk::downsample(): mismatched nrfifreq");
     if (!equal3(this->nt_per_packet, src1->nt_per_packet, src2->nt_per_packet))
         throw runtime_error("ch_frb_io: assembled_chunk::downsample(): mismatched nt_per_packet");
+    if (!equal3(this->nt_per_chunk, src1->nt_per_chunk, src2->nt_per_chunk))
+        throw runtime_error("ch_frb_io: assembled_chunk::downsample(): mismatched nt_per_chunk");
+    if (!this->_same_coarse_freqs(src1) || !this->_same_coarse_freqs(src2))
+        throw runtime_error("ch_frb_io: assembled_chunk::downsample(): mismatched coarse frequency subsets");
 
     if ((nrfifreq > 0) && (!src1->rfi_mask || !src2->rfi_mask || !src1->has_rfi_mask || !src2->has_rfi_mask))
         throw runtime_error("ch_frb_io: assembled_chunk::downsample(): RFI masks were not initialized as expected, maybe your ring buffer is too small?");
@@ -501,9 +695,10 @@ void assembled_chunk::downsample(const assembled_chunk *src1, const assembled_ch
 {
     this->_check_downsample(src1, src2);
 
-    int nfreq_c = constants::nfreq_coarse_tot;
-    int nt_f = constants::nt_per_assembled_chunk;
+    int nfreq_c = nfreq_coarse;
+    int nt_f = nt_per_chunk;
     int nt_c = nt_f / nt_per_packet;
+    downsampling_workspace ws = get_downsampling_workspace(nupfreq, nt_f, nt_c);
  
     for (int ifreq_c = 0; ifreq_c < nfreq_c; ifreq_c++) {
 	int ifreq_f = ifreq_c * nupfreq;
@@ -514,7 +709,7 @@ void assembled_chunk::downsample(const assembled_chunk *src1, const assembled_ch
 		       src1->data + ifreq_f * nt_f,
 		       src1->offsets + ifreq_c * nt_c,
 		       src1->scales + ifreq_c * nt_c,
-		       this->ds_data, this->ds_mask, this->ds_w2,
+		       ws.ds_data, ws.ds_mask, ws.ds_w2,
 		       nupfreq, nt_f, nt_per_packet);
 
 	ds_slow_kernel(this->data + (ifreq_f * nt_f) + (nt_f/2),
@@ -523,7 +718,7 @@ void assembled_chunk::downsample(const assembled_chunk *src1, const assembled_ch
 		       src2->data + ifreq_f * nt_f,
 		       src2->offsets + ifreq_c * nt_c,
 		       src2->scales + ifreq_c * nt_c,
-		       this->ds_data, this->ds_mask, this->ds_w2,
+		       ws.ds_data, ws.ds_mask, ws.ds_w2,
 		       nupfreq, nt_f, nt_per_packet);
     }
 
@@ -548,14 +743,219 @@ void assembled_chunk::downsample(const assembled_chunk *src1, const assembled_ch
 }
 
 
+// Checks validity of call to assembled_chunk::downsample_freq().
+void assembled_chunk::_check_downsample_freq(const assembled_chunk *src)
+{
+    if (!src)
+	throw runtime_error("ch_frb_io: null pointer passed to assembled_chunk::downsample_freq()");
+    if (this->is_compressed() || src->is_compressed())
+	throw runtime_error("ch_frb_io: assembled_chunk::downsample_freq() called on compressed chunk");
+    if (this->has_rfi_mask)
+	throw runtime_error("ch_frb_io: assembled_chunk::downsample_freq() called, and has_rfi_mask=true in destination chunk");
+
+    if ((this->nupfreq <= 0) || (src->nupfreq % this->nupfreq))
+        throw runtime_error("ch_frb_io: assembled_chunk::downsample_freq(): source nupfreq is not a multiple of destination nupfreq");
+    if (this->binning != src->binning)
+        throw runtime_error("ch_frb_io: assembled_chunk::downsample_freq(): mismatched binning");
+    if (this->ichunk != src->ichunk)
+	throw runtime_error("ch_frb_io: assembled_chunk::downsample_freq(): mismatched ichunk");
+    if (this->beam_id != src->beam_id)
+	throw runtime_error("ch_frb_io: assembled_chunk::downsample_freq(): mismatched beam_id");
+    if (this->nrfifreq != src->nrfifreq)
+        throw runtime_error("ch_frb_io: assembled_chunk::downsample_freq(): mismatched nrfifreq");
+    if (this->nt_per_packet != src->nt_per_packet)
+        throw runtime_error("ch_frb_io: assembled_chunk::downsample_freq(): mismatched nt_per_packet");
+    if (this->nt_per_chunk != src->nt_per_chunk)
+        throw runtime_error("ch_frb_io: assembled_chunk::downsample_freq(): mismatched nt_per_chunk");
+    if (!this->_same_coarse_freqs(src))
+        throw runtime_error("ch_frb_io: assembled_chunk::downsample_freq(): mismatched coarse frequency subsets");
+}
+
+// Returns true if 'x' stores the same coarse frequency channels as 'this'.
+bool assembled_chunk::_same_coarse_freqs(const assembled_chunk *x) const
+{
+    if (this->freq_map == x->freq_map)
+	return true;
+    if (!this->freq_map || !x->freq_map)
+	return false;
+    return this->freq_map->coarse_freq_ids == x->freq_map->coarse_freq_ids;
+}
+
+// Helper for downsample_freq(): scales, offsets and RFI mask are independent of nupfreq, so they are just copied.
+void assembled_chunk::_copy_freq_downsampled_metadata(const assembled_chunk *src)
+{
+    memcpy(this->scales, src->scales, nscales * sizeof(float));
+    memcpy(this->offsets, src->offsets, nscales * sizeof(float));
+
+    if ((nrfifreq > 0) && src->has_rfi_mask) {
+	memcpy(this->rfi_mask, src->rfi_mask, nrfimaskbytes);
+	this->has_rfi_mask = true;
+    }
+}
+
+// This is the slow, reference version of assembled_chunk::downsample_freq().
+// In production, it is overridden by fast_assembled_chunk::downsample_freq().  (See avx2_kernels.cpp)
+
+void assembled_chunk::downsample_freq(const assembled_chunk *src)
+{
+    this->_check_downsample_freq(src);
+
+    int fbinning = src->nupfreq / this->nupfreq;
+    int nrows_out = nfreq_coarse * this->nupfreq;
+
+    ds_slow_kernel_freq(this->data, src->data, nrows_out, fbinning, nt_per_chunk);
+    this->_copy_freq_downsampled_metadata(src);
+}
+
+
+bool assembled_chunk::compress(int nbits, bool lz4)
+{
+    if (this->is_compressed())
+	throw runtime_error("ch_frb_io: assembled_chunk::compress() called on chunk which is already compressed");
+    if ((nbits != 8) && (nbits != 4))
+	throw runtime_error("ch_frb_io: assembled_chunk::compress(): 'nbits' must be 8 or 4");
+    if ((nbits == 4) && (nt_per_packet % 2))
+	throw runtime_error("ch_frb_io: assembled_chunk::compress(): 4-bit requantization requires even nt_per_packet");
+
+    ssize_t nb_scales = nscales * sizeof(float);
+    ssize_t nhdr = 2*nb_scales + nrfimaskbytes;
+    ssize_t nd = (nbits == 8) ? ndata : (ndata/2);
+    ssize_t nz = lz4 ? bshuf_compress_lz4_bound(nd, 1, 0) : 0;
+
+    // Per-thread scratch buffer, containing header (scales, offsets, RFI mask), 4-bit data (if nbits=4),
+    // and LZ4 output.  It grows to the largest chunk compressed by the thread, and is then reused.
+    static thread_local unique_ptr<uint8_t[]> scratch;
+    static thread_local ssize_t scratch_nbytes = 0;
+
+    if (nhdr + nd + nz > scratch_nbytes) {
+	scratch.reset();
+	scratch = aligned_unique_ptr<uint8_t> (nhdr + nd + nz);
+	scratch_nbytes = nhdr + nd + nz;
+    }
+
+    uint8_t *tmp = scratch.get();
+    float *hdr_scales = reinterpret_cast<float *> (tmp);
+    float *hdr_offsets = reinterpret_cast<float *> (tmp + nb_scales);
+    const uint8_t *raw = this->data;
+
+    if (nbits == 4) {
+	requantize_4bit(tmp + nhdr, hdr_scales, hdr_offsets, this->data, this->scales, this->offsets,
+			nupfreq, nt_per_chunk, nt_per_packet, nfreq_coarse);
+	raw = tmp + nhdr;
+    }
+    else {
+	memcpy(hdr_scales, this->scales, nb_scales);
+	memcpy(hdr_offsets, this->offsets, nb_scales);
+    }
+
+    if (nrfimaskbytes > 0)
+	memcpy(tmp + 2*nb_scales, this->rfi_mask, nrfimaskbytes);
+
+    int64_t n = lz4 ? bshuf_compress_lz4(raw, tmp + nhdr + nd, nd, 1, 0) : 0;
+    bool use_lz4 = (n > 0) && (n < nd);
+
+    if (!use_lz4)
+	n = nd;
+
+    // Charge the compressed size to the pool's budget (if any).  If the budget is exhausted, the chunk
+    // stays uncompressed (in its slab, which is already charged).
+    shared_ptr<memory_slab_budget> budget = memory_pool ? memory_pool->budget : shared_ptr<memory_slab_budget> ();
+
+    if (budget && !budget->_try_charge(nullptr, nhdr + n))
+	return false;
+
+    // Copy to a buffer of just the right size.
+    this->compressed_budget = budget;
+    this->compressed_nbits = nbits;
+    this->compressed_lz4 = use_lz4;
+    this->compressed_nbytes = nhdr + n;
+    this->compressed_buf.reset(new uint8_t[compressed_nbytes]);
+    memcpy(compressed_buf.get(), tmp, nhdr);
+    memcpy(compressed_buf.get() + nhdr, compressed_lz4 ? (tmp + nhdr + nd) : raw, n);
+    total_compressed_nbytes += compressed_nbytes;
+
+    // Return memory slab to pool (or free it, if there is no pool).
+    this->_deallocate();
+    this->memory_slab.reset();
+    return true;
+}
+
+
+void assembled_chunk::decompress(assembled_chunk *dst) const
+{
+    if (!this->is_compressed())
+	throw runtime_error("ch_frb_io: assembled_chunk::decompress() called on chunk which is not compressed");
+    if (!dst || dst->is_compressed())
+	throw runtime_error("ch_frb_io: assembled_chunk::decompress(): bad destination chunk");
+
+    if ((dst->beam_id != beam_id) || (dst->nupfreq != nupfreq) || (dst->nrfifreq != nrfifreq) || (dst->nt_per_packet != nt_per_packet) || (dst->nt_per_chunk != nt_per_chunk)
+	|| (dst->fpga_counts_per_sample != fpga_counts_per_sample) || (dst->binning != binning) || (dst->ichunk != ichunk) || !dst->_same_coarse_freqs(this))
+	throw runtime_error("ch_frb_io: assembled_chunk::decompress(): destination chunk has different parameters");
+
+    ssize_t nb_scales = nscales * sizeof(float);
+    ssize_t nhdr = 2*nb_scales + nrfimaskbytes;
+    ssize_t nd = (compressed_nbits == 8) ? ndata : (ndata/2);
+    const uint8_t *src = compressed_buf.get();
+    const float *src_scales = reinterpret_cast<const float *> (src);
+    const float *src_offsets = reinterpret_cast<const float *> (src + nb_scales);
+
+    // 4-bit data is placed in the second half of dst->data, and expanded in place.
+    uint8_t *dst_raw = (compressed_nbits == 8) ? dst->data : (dst->data + ndata/2);
+
+    if (!compressed_lz4)
+	memcpy(dst_raw, src + nhdr, nd);
+    else if (bshuf_decompress_lz4(src + nhdr, dst_raw, nd, 1, 0) != compressed_nbytes - nhdr)
+	throw runtime_error("ch_frb_io: assembled_chunk::decompress(): bitshuffle decompression failed");
+
+    if (compressed_nbits == 4) {
+	expand_4bit(dst->data, dst->scales, dst->offsets, dst_raw, src_scales, src_offsets,
+		    nupfreq, nt_per_chunk, nt_per_packet, nfreq_coarse);
+    }
+    else {
+	memcpy(dst->scales, src_scales, nb_scales);
+	memcpy(dst->offsets, src_offsets, nb_scales);
+    }
+
+    if (nrfimaskbytes > 0)
+	memcpy(dst->rfi_mask, src + 2*nb_scales, nrfimaskbytes);
+
+    dst->has_rfi_mask = bool(this->has_rfi_mask);
+    dst->packets_received = int(this->packets_received);
+}
+
+
+unique_ptr<assembled_chunk> assembled_chunk::make_decompressed() const
+{
+    if (!this->is_compressed())
+	throw runtime_error("ch_frb_io: assembled_chunk::make_decompressed() called on chunk which is not compressed");
+
+    initializer ini_params;
+    ini_params.beam_id = beam_id;
+    ini_params.nupfreq = nupfreq;
+    ini_params.nrfifreq = nrfifreq;
+    ini_params.nt_per_packet = nt_per_packet;
+    ini_params.nt_per_chunk = nt_per_chunk;
+    ini_params.fpga_counts_per_sample = fpga_counts_per_sample;
+    ini_params.binning = binning;
+    ini_params.stream_id = stream_id;
+    ini_params.ichunk = ichunk;
+    ini_params.freq_map = freq_map;
+    ini_params.frame0_nano = frame0_nano;
+
+    unique_ptr<assembled_chunk> ret = assembled_chunk::make(ini_params);
+    this->decompress(ret.get());
+    return ret;
+}
+
+
 unique_ptr<assembled_chunk> assembled_chunk::make(const assembled_chunk::initializer &ini_params)
 {
-    bool fast_kernel_exists = (ini_params.nt_per_packet == 16) && (ini_params.nupfreq % 2 == 0);
+    bool fast_kernel_exists = (ini_params.nt_per_packet == 16) && (ini_params.nupfreq % 2 == 0) && (ini_params.nt_per_chunk % 256 == 0);
 
     if (ini_params.force_reference && ini_params.force_fast)
         throw runtime_error("ch_frb_io: assembled_chunk::make(): both force_reference and force_fast flags were set");
     if (ini_params.force_fast && !fast_kernel_exists)
-	throw runtime_error("ch_frb_io: assembled_chunk::make(): force_fast flag was set, but conditions for a fast kernel (nt_per_packet=16 and nupfreq even) were not met");
+	throw runtime_error("ch_frb_io: assembled_chunk::make(): force_fast flag was set, but conditions for a fast kernel (nt_per_packet=16, nupfreq even, nt_per_chunk a multiple of 256) were not met");
 
 #ifdef __AVX2__
     if (fast_kernel_exists && !ini_params.force_reference)
@@ -571,6 +971,11 @@ unique_ptr<assembled_chunk> assembled_chunk::make(const assembled_chunk::initial
 
 void assembled_chunk::write_hdf5_file(const string &filename)
 {
+    if (this->is_compressed()) {
+	this->make_decompressed()->write_hdf5_file(filename);
+	return;
+    }
+
     if (this->rfi_mask != nullptr)
 	throw runtime_error("ch_frb_io: assembled_chunk hdf5 format does not implement RFI mask yet");
     
@@ -589,13 +994,15 @@ void assembled_chunk::write_hdf5_file(const string &filename)
     g_chunk.write_attribute("nt_per_packet", this->nt_per_packet);
     g_chunk.write_attribute("fpga_counts_per_sample", this->fpga_counts_per_sample);
     g_chunk.write_attribute("nt_coarse", this->nt_coarse);
+    g_chunk.write_attribute("nt_per_chunk", this->nt_per_chunk);
+    g_chunk.write_attribute("nfreq_coarse", this->nfreq_coarse);
     g_chunk.write_attribute("nscales", this->nscales);
     g_chunk.write_attribute("ndata", this->ndata);
     g_chunk.write_attribute("ichunk", this->ichunk);
     g_chunk.write_attribute("isample", this->isample);
 
     // Offset & scale vectors
-    vector<hsize_t> scaleshape = { (hsize_t)constants::nfreq_coarse_tot,
+    vector<hsize_t> scaleshape = { (hsize_t)this->nfreq_coarse,
                                    (hsize_t)this->nt_coarse };
     g_chunk.write_dataset("scales",  this->scales,  scaleshape);
     g_chunk.write_dataset("offsets", this->offsets, scaleshape);
@@ -603,9 +1010,9 @@ void assembled_chunk::write_hdf5_file(const string &filename)
     // Raw data
     int bitshuffle = 0;
     vector<hsize_t> datashape = {
-        (hsize_t)constants::nfreq_coarse_tot,
+        (hsize_t)this->nfreq_coarse,
         (hsize_t)nupfreq,
-        (hsize_t)constants::nt_per_assembled_chunk };
+        (hsize_t)nt_per_chunk };
     unique_ptr<hdf5_extendable_dataset<uint8_t> > data_dataset =
         make_unique<hdf5_extendable_dataset<uint8_t> >(g_chunk, "data", datashape, 2, bitshuffle);
     data_dataset->write(this->data, datashape);
@@ -615,6 +1022,12 @@ void assembled_chunk::write_hdf5_file(const string &filename)
 
 void assembled_chunk::write_msgpack_file(const string &filename, bool compress, uint8_t *buffer)
 {
+    // Compressed chunks (e.g. from get_ringbuf_snapshots()) are written via a temporary decompressed copy.
+    if (this->is_compressed()) {
+	this->make_decompressed()->write_msgpack_file(filename, compress, buffer);
+	return;
+    }
+
     if ((this->rfi_mask != nullptr) && (!this->has_rfi_mask))
 	throw runtime_error("ch_frb_io::assembled_chunk::write_msgpack_file() called on chunk whose RFI mask has not been initialized yet");
     
@@ -864,4 +1277,123 @@ void ds_slow_kernel3(uint8_t *out, const float *data, const int *mask, const flo
 }
 
 
+// ds_slow_kernel_freq(): slow frequency-downsampling kernel.
+//
+// Reads (nrows_out * fbinning, nt) data values (uint8_t)
+// Writes (nrows_out, nt) data values (uint8_t).
+//
+// Each output value is the rounded mean of 'fbinning' input values from consecutive rows.
+// Since all rows within a coarse channel share the same scale and offset, no rescaling is needed.
+
+void ds_slow_kernel_freq(uint8_t *out, const uint8_t *in, int nrows_out, int fbinning, int nt)
+{
+    ch_assert(nrows_out > 0);
+    ch_assert(fbinning > 0);
+    ch_assert(nt > 0);
+
+    for (int i = 0; i < nrows_out; i++) {
+	for (int j = 0; j < nt; j++) {
+	    int sum = 0;
+	    bool masked = false;
+
+	    for (int k = 0; k < fbinning; k++) {
+		uint8_t x = in[(i*fbinning + k)*nt + j];
+		masked = masked || (x == 0) || (x == 0xff);
+		sum += x;
+	    }
+
+	    out[i*nt + j] = masked ? 0 : uint8_t((sum + fbinning/2) / fbinning);
+	}
+    }
+}
+
+
+// requantize_4bit(), expand_4bit(): see comments in ch_frb_io_internals.hpp.
+//
+// When expanding to 8 bits, the 4-bit value q is represented by the 8-bit value 1 + 19*(q-1), so the
+// 4-bit values 1..14 map to 8-bit values 1..248 (and 0x0, 0xf map to the masked value 0x00).
+
+void requantize_4bit(uint8_t *out, float *out_scales, float *out_offsets, const uint8_t *in, const float *in_scales, 
+		     const float *in_offsets, int nupfreq, int nt_per_chunk, int nt_per_packet, int nfreq_coarse)
+{
+    ch_assert(nupfreq > 0);
+    ch_assert(nt_per_packet > 0);
+    ch_assert(nt_per_packet % 2 == 0);
+    ch_assert(nt_per_chunk % nt_per_packet == 0);
+
+    int nfreq_c = nfreq_coarse;
+    int nt_c = nt_per_chunk / nt_per_packet;
+
+    for (int ifreq_c = 0; ifreq_c < nfreq_c; ifreq_c++) {
+	for (int p = 0; p < nt_c; p++) {
+	    // Range of unmasked 8-bit values in this (coarse freq, t_coarse) block.
+	    int lo = 0xff;
+	    int hi = 0;
+
+	    for (int iupfreq = 0; iupfreq < nupfreq; iupfreq++) {
+		const uint8_t *in_row = in + (ifreq_c*nupfreq + iupfreq) * nt_per_chunk;
+
+		for (int it = p*nt_per_packet; it < (p+1)*nt_per_packet; it++) {
+		    int x = in_row[it];
+		    if ((x == 0) || (x == 0xff))
+			continue;
+		    lo = min(lo, x);
+		    hi = max(hi, x);
+		}
+	    }
+
+	    // Map [lo,hi] onto 4-bit values [1,14].
+	    float step = (hi > lo) ? (float(hi-lo) / 13.0f) : 1.0f;
+	    int s = ifreq_c*nt_c + p;
+
+	    out_scales[s] = in_scales[s] * step;
+	    out_offsets[s] = in_offsets[s] + in_scales[s] * (lo - step);
+
+	    for (int iupfreq = 0; iupfreq < nupfreq; iupfreq++) {
+		int irow = (ifreq_c*nupfreq + iupfreq) * nt_per_chunk;
+
+		for (int it = p*nt_per_packet; it < (p+1)*nt_per_packet; it += 2) {
+		    int q[2];
+
+		    for (int j = 0; j < 2; j++) {
+			int x = in[irow + it + j];
+			q[j] = ((x == 0) || (x == 0xff)) ? 0 : min(1 + int(roundf((x-lo) / step)), 14);
+		    }
+
+		    out[(irow+it)/2] = uint8_t(q[0] | (q[1] << 4));
+		}
+	    }
+	}
+    }
+}
+
+
+void expand_4bit(uint8_t *out, float *out_scales, float *out_offsets, const uint8_t *in, const float *in_scales, 
+		 const float *in_offsets, int nupfreq, int nt_per_chunk, int nt_per_packet, int nfreq_coarse)
+{
+    ch_assert(nupfreq > 0);
+    ch_assert(nt_per_packet > 0);
+    ch_assert(nt_per_chunk % nt_per_packet == 0);
+
+    int nscales = nfreq_coarse * (nt_per_chunk / nt_per_packet);
+    ssize_t ndata = ssize_t(nfreq_coarse) * nupfreq * nt_per_chunk;
+
+    for (int s = 0; s < nscales; s++) {
+	out_scales[s] = in_scales[s] / 19.0f;
+	out_offsets[s] = in_offsets[s] + in_scales[s] * (18.0f / 19.0f);
+    }
+
+    uint8_t lut[16];
+    for (int q = 0; q < 16; q++)
+	lut[q] = ((q == 0) || (q == 15)) ? 0 : (1 + 19*(q-1));
+
+    // Note: in-place expansion (in == out + ndata/2) works, since in[i] is read before out[2*i+1] is written.
+    for (ssize_t i = 0; i < ndata/2; i++) {
+	uint8_t b = in[i];
+	out[2*i] = lut[b & 0xf];
+	out[2*i+1] = lut[b >> 4];
+    }
+}
+
+
 }  // namespace ch_frb_io
@@ -28,11 +28,17 @@ void pack_assembled_chunk(msgpack::packer<Stream>& o,
                           std::shared_ptr<ch_frb_io::assembled_chunk> const& ch,
                           bool compress=false,
                           uint8_t* buffer=NULL) {
+    // Compressed chunks (e.g. from a ring buffer snapshot) are packed via a decompressed temporary.
+    if (ch->is_compressed()) {
+        std::shared_ptr<ch_frb_io::assembled_chunk> tmp(ch->make_decompressed());
+        pack_assembled_chunk(o, tmp, compress, buffer);
+        return;
+    }
     // pack member variables as an array.
     //std::cout << "Pack shared_ptr<assembled-chunk> into msgpack object..." << std::endl;
-    uint8_t version = 2;
+    uint8_t version = 4;
     // We are going to pack N items as a msgpack array (with mixed types)
-    o.pack_array(21);
+    o.pack_array(23);
     // Item 0: header string
     o.pack("assembled_chunk in msgpack format");
     // Item 1: version number
@@ -124,6 +130,13 @@ void pack_assembled_chunk(msgpack::packer<Stream>& o,
         // Item[20]
         o.pack_bin(0);
     }
+    // Item[21] (version 3)
+    o.pack(ch->nt_per_chunk);
+    // Item[22] (version 4): coarse frequency subset, empty if the chunk has the full band.
+    if (ch->freq_map)
+        o.pack(ch->freq_map->coarse_freq_ids);
+    else
+        o.pack(std::vector<int>());
 }
 
 namespace msgpack {
@@ -150,8 +163,14 @@ struct convert<std::shared_ptr<ch_frb_io::assembled_chunk> > {
         } else if (version == 2) {
             if (o.via.array.size != 21)
                 throw std::runtime_error("ch_frb_io: assembled_chunk msgpack version 2: expected 21 items, got " + std::to_string(o.via.array.size));
+        } else if (version == 3) {
+            if (o.via.array.size != 22)
+                throw std::runtime_error("ch_frb_io: assembled_chunk msgpack version 3: expected 22 items, got " + std::to_string(o.via.array.size));
+        } else if (version == 4) {
+            if (o.via.array.size != 23)
+                throw std::runtime_error("ch_frb_io: assembled_chunk msgpack version 4: expected 23 items, got " + std::to_string(o.via.array.size));
         } else {
-            throw std::runtime_error("ch_frb_io: assembled_chunk msgpack: expected version = 1 or 2, got " + std::to_string(version));
+            throw std::runtime_error("ch_frb_io: assembled_chunk msgpack: expected version = 1, 2, 3 or 4, got " + std::to_string(version));
         }
 
         enum compression_type comp = (enum compression_type)arr[2].as<uint8_t>();
@@ -170,11 +189,16 @@ struct convert<std::shared_ptr<ch_frb_io::assembled_chunk> > {
         int binning                = arr[13].as<int>();
         int iarr = 14;
 
+        // Versions 1 and 2 predate runtime-configurable chunk lengths.
+        int nt_per_chunk = ch_frb_io::constants::nt_per_assembled_chunk;
+        if (version >= 3)
+            nt_per_chunk = arr[21].as<int>();
+
         uint64_t isample = fpga0 / (uint64_t)fpga_counts_per_sample;
-        uint64_t ichunk = isample / ch_frb_io::constants::nt_per_assembled_chunk;
+        uint64_t ichunk = isample / nt_per_chunk;
 
         uint64_t frame0_nano = 0;
-        if (version == 2)
+        if (version >= 2)
             frame0_nano = arr[17].as<uint64_t>();
 
 	ch_frb_io::assembled_chunk::initializer ini_params;
@@ -184,9 +208,12 @@ struct convert<std::shared_ptr<ch_frb_io::assembled_chunk> > {
 	ini_params.fpga_counts_per_sample = fpga_counts_per_sample;
 	ini_params.binning = binning;
 	ini_params.ichunk = ichunk;
+	ini_params.nt_per_chunk = nt_per_chunk;
+        if (version >= 4)
+            ini_params.freq_map = ch_frb_io::coarse_freq_map::make(arr[22].as<std::vector<int> >());
         ini_params.frame0_nano = frame0_nano;
 
-        if (version == 2)
+        if (version >= 2)
             ini_params.nrfifreq = arr[18].as<int>();
 
         ch = ch_frb_io::assembled_chunk::make(ini_params);
@@ -224,7 +251,7 @@ struct convert<std::shared_ptr<ch_frb_io::assembled_chunk> > {
                 throw std::runtime_error("ch_frb_io: assembled_chunk msgpack bitshuffle decompression failure, code " + std::to_string(n));
         }
 
-        if (version == 2) {
+        if (version >= 2) {
             ch->has_rfi_mask = arr[19].as<bool>();
             if (ch->has_rfi_mask) {
                 uint nb = ch->nrfimaskbytes;
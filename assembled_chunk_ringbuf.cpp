@@ -1,4 +1,5 @@
 #include <iostream>
+#include <algorithm>
 #include "ch_frb_io_internals.hpp"
 #include "chlog.hpp"
 
@@ -10,6 +11,51 @@ namespace ch_frb_io {
 #endif
 
 
+// A fixed set of up to 'nmax' assembled_subchunks, which are handed out by the assembler thread and
+// returned by the processing threads, so that slices can be delivered without allocating memory.
+// Shared by the slices, so that they can outlive the assembled_chunk_ringbuf.
+struct assembled_chunk_ringbuf::subchunk_free_list {
+    std::mutex lock;
+    std::vector<assembled_subchunk *> free;
+    int nallocated = 0;
+    const int nmax;
+
+    subchunk_free_list(int nmax_) : nmax(nmax_) { free.reserve(nmax); }
+
+    ~subchunk_free_list()
+    {
+	for (assembled_subchunk *p: free)
+	    delete p;
+    }
+
+    // Returns a null pointer if all 'nmax' slices are in use.
+    static shared_ptr<assembled_subchunk> get(const shared_ptr<subchunk_free_list> &fl)
+    {
+	assembled_subchunk *p = nullptr;
+	unique_lock<std::mutex> ulock(fl->lock);
+
+	if (fl->free.size() > 0) {
+	    p = fl->free.back();
+	    fl->free.pop_back();
+	}
+	else if (fl->nallocated < fl->nmax) {
+	    fl->nallocated++;
+	    ulock.unlock();
+	    p = new assembled_subchunk();
+	}
+	else
+	    return shared_ptr<assembled_subchunk> ();
+
+	auto deleter = [fl](assembled_subchunk *q) {
+	    lock_guard<std::mutex> lg(fl->lock);
+	    fl->free.push_back(q);
+	};
+
+	return shared_ptr<assembled_subchunk> (p, deleter, recycling_allocator<assembled_subchunk> ());
+    }
+};
+
+
 assembled_chunk_ringbuf::assembled_chunk_ringbuf(const intensity_network_stream::initializer &ini_params_, int beam_id_, int stream_id_) :
     max_fpga_flushed(0),
     max_fpga_retrieved(0),
@@ -17,6 +63,8 @@ assembled_chunk_ringbuf::assembled_chunk_ringbuf(const intensity_network_stream:
     ini_params(ini_params_),
     beam_id(beam_id_),
     stream_id(stream_id_),
+    freq_map(coarse_freq_map::make(ini_params_.coarse_freq_ids)),
+    nfreq_coarse(freq_map ? freq_map->nfreq_coarse() : constants::nfreq_coarse_tot),
     frame0_nano(0),
     output_devices(ini_params.output_devices)
 {
@@ -26,14 +74,62 @@ assembled_chunk_ringbuf::assembled_chunk_ringbuf(const intensity_network_stream:
     if (ini_params.assembled_ringbuf_capacity <= 0)
 	throw runtime_error("ch_frb_io: assembled_chunk_ringbuf constructor: assembled_ringbuf_capacity must be > 0");
 
-    if ((ini_params.nt_align < 0) || (ini_params.nt_align % constants::nt_per_assembled_chunk))
-	throw runtime_error("ch_frb_io: 'nt_align' must be a multiple of nt_per_assembled_chunk(=" + to_string(constants::nt_per_assembled_chunk) + ")");
+    // The downsampling kernels need an even number of packets per chunk, and at least 16 samples (for the RFI mask).
+    if ((ini_params.nt_per_chunk < 16) || !is_power_of_two(ini_params.nt_per_chunk) || (ini_params.nt_per_chunk > constants::max_allowed_nt_per_chunk))
+	throw runtime_error("ch_frb_io: assembled_chunk_ringbuf constructor: nt_per_chunk must be a power of two, between 16 and " + to_string(constants::max_allowed_nt_per_chunk));
+    if ((ini_params.nt_per_packet > 0) && (ini_params.nt_per_chunk % (2 * ini_params.nt_per_packet)))
+	throw runtime_error("ch_frb_io: assembled_chunk_ringbuf constructor: nt_per_chunk must be a multiple of 2*nt_per_packet");
+
+    if ((ini_params.nt_align < 0) || (ini_params.nt_align % ini_params.nt_per_chunk))
+	throw runtime_error("ch_frb_io: 'nt_align' must be a multiple of nt_per_chunk(=" + to_string(ini_params.nt_per_chunk) + ")");
+
+    if (ini_params.telescoping_ringbuf_capacity.size() > (unsigned) constants::max_telescoping_levels)
+	throw runtime_error("ch_frb_io: assembled_chunk_ringbuf constructor: number of telescoping_ringbuf_capacities must be <= " + to_string(constants::max_telescoping_levels));
 
     for (int n: ini_params.telescoping_ringbuf_capacity) {
 	if (n < 2)
 	    throw runtime_error("ch_frb_io: assembled_chunk_ringbuf constructor: all telescoping_ringbuf_capacities must be >= 2");
     }
 
+    const vector<int> &fb = ini_params.telescoping_freq_binning;
+
+    if (fb.size() && (fb.size() != ini_params.telescoping_ringbuf_capacity.size()))
+	throw runtime_error("ch_frb_io: assembled_chunk_ringbuf constructor: telescoping_freq_binning must be either empty, or the same length as telescoping_ringbuf_capacity");
+    if (fb.size() && (fb[0] != 1))
+	throw runtime_error("ch_frb_io: assembled_chunk_ringbuf constructor: telescoping_freq_binning[0] must be 1");
+
+    for (unsigned int i = 1; i < fb.size(); i++) {
+	if ((fb[i] < fb[i-1]) || (fb[i] % fb[i-1]) || (ini_params.nupfreq % fb[i]))
+	    throw runtime_error("ch_frb_io: assembled_chunk_ringbuf constructor: each element of telescoping_freq_binning must be a multiple of the previous one, and divide nupfreq");
+	if ((ini_params.nrfifreq > 0) && ((nfreq_coarse * (ini_params.nupfreq / fb[i])) % ini_params.nrfifreq))
+	    throw runtime_error("ch_frb_io: assembled_chunk_ringbuf constructor: telescoping_freq_binning is incompatible with nrfifreq");
+    }
+
+    if ((ini_params.telescoping_compression_level < 0) || (ini_params.telescoping_compression_level >= max(int(ini_params.telescoping_ringbuf_capacity.size()), 1)))
+	throw runtime_error("ch_frb_io: assembled_chunk_ringbuf constructor: telescoping_compression_level must be either zero, or a valid level of the telescoping ring buffer");
+
+    if ((ini_params.telescoping_requantize_level < 0) || (ini_params.telescoping_requantize_level >= max(int(ini_params.telescoping_ringbuf_capacity.size()), 1)))
+	throw runtime_error("ch_frb_io: assembled_chunk_ringbuf constructor: telescoping_requantize_level must be either zero, or a valid level of the telescoping ring buffer");
+    if ((ini_params.telescoping_requantize_level > 0) && (ini_params.nt_per_packet % 2))
+	throw runtime_error("ch_frb_io: assembled_chunk_ringbuf constructor: telescoping_requantize_level requires even nt_per_packet");
+
+    if (ini_params.subchunk_nt != 0) {
+	if ((ini_params.subchunk_nt < 0) || (ini_params.nt_per_chunk % ini_params.subchunk_nt) || (ini_params.nt_per_packet <= 0) || (ini_params.subchunk_nt % ini_params.nt_per_packet))
+	    throw runtime_error("ch_frb_io: assembled_chunk_ringbuf constructor: subchunk_nt must divide nt_per_chunk(=" + to_string(ini_params.nt_per_chunk) + "), and be a multiple of nt_per_packet");
+	if (ini_params.subchunk_lateness_nt < 0)
+	    throw runtime_error("ch_frb_io: assembled_chunk_ringbuf constructor: subchunk_lateness_nt must be >= 0");
+	if (ini_params.subchunk_ringbuf_capacity <= 0)
+	    throw runtime_error("ch_frb_io: assembled_chunk_ringbuf constructor: subchunk_ringbuf_capacity must be > 0");
+    }
+
+    for (const auto &p: ini_params.small_memory_pools) {
+	if (!p)
+	    throw runtime_error("ch_frb_io: assembled_chunk_ringbuf constructor: null pointer in small_memory_pools");
+    }
+
+    if (ini_params.max_pool_fallbacks < 0)
+	throw runtime_error("ch_frb_io: assembled_chunk_ringbuf constructor: max_pool_fallbacks must be >= 0");
+
 #ifndef __AVX2__
     if (ini_params.force_fast_kernels)
 	throw runtime_error("ch_frb_io: the 'force_fast_kernels' flag was set, but this machine does not have the AVX2 instruction set");
@@ -41,12 +137,18 @@ assembled_chunk_ringbuf::assembled_chunk_ringbuf(const intensity_network_stream:
 
     pthread_mutex_init(&this->lock, NULL);
     pthread_cond_init(&this->cond_assembled_chunks_added, NULL);
+    pthread_cond_init(&this->cond_downsampling_done, NULL);
+    pthread_cond_init(&this->cond_subchunks_added, NULL);
 
     this->num_downsampling_levels = max(ini_params.telescoping_ringbuf_capacity.size(), 1UL);
     this->ringbuf_pos.resize(num_downsampling_levels, 0);
     this->ringbuf_size.resize(num_downsampling_levels, 0);
     this->ringbuf_capacity.resize(num_downsampling_levels, 0);
     this->ringbuf.resize(num_downsampling_levels);
+    this->asm_pushlist.resize(num_downsampling_levels);
+    this->asm_poplist.resize(2 * num_downsampling_levels);
+    this->ds_pushlist.resize(num_downsampling_levels);
+    this->ds_poplist.resize(2 * num_downsampling_levels);
 
     // Note that ringbuf_capacity[0] is the sum of 'ini_params.assembled_ringbuf_capacity'
     // and 'ini_params.telescoping_ringbuf_capacity[0]'.
@@ -55,11 +157,67 @@ assembled_chunk_ringbuf::assembled_chunk_ringbuf(const intensity_network_stream:
     for (unsigned int i = 0; i < ini_params.telescoping_ringbuf_capacity.size(); i++)
 	this->ringbuf_capacity[i] += ini_params.telescoping_ringbuf_capacity[i];
 
+    this->level_nupfreq.resize(num_downsampling_levels, ini_params.nupfreq);
+    for (unsigned int i = 0; i < fb.size(); i++)
+	this->level_nupfreq[i] = ini_params.nupfreq / fb[i];
+
+    if (ini_params.memory_pool)
+	this->memory_pools.push_back(ini_params.memory_pool);
+    for (const auto &p: ini_params.small_memory_pools)
+	this->memory_pools.push_back(p);
+
+    std::stable_sort(memory_pools.begin(), memory_pools.end(),
+		     [](const shared_ptr<memory_slab_pool> &a, const shared_ptr<memory_slab_pool> &b) { return a->nbytes_per_slab < b->nbytes_per_slab; });
+
+    // Register with the memory pools.  Under pressure, the reclaim callback schedules early eviction from
+    // the last level of the telescoping ring buffer (see _prepare_downsampling()).  This is only possible
+    // if there is more than one level, since level 0 holds chunks which haven't been processed yet.
+    this->reclaim_request = make_shared<std::atomic<ssize_t>> (0);
+    this->fallback_nbytes = make_shared<std::atomic<int64_t>> (0);
+    this->max_fallback_nbytes = ini_params.max_pool_fallbacks * assembled_chunk::get_memory_slab_size(ini_params.nupfreq, ini_params.nt_per_packet, ini_params.nrfifreq, ini_params.nt_per_chunk, nfreq_coarse);
+
+    std::shared_ptr<std::atomic<ssize_t>> r = this->reclaim_request;
+    ssize_t nevictable = (num_downsampling_levels > 1) ? ringbuf_capacity[num_downsampling_levels-1] : 0;
+
+    // A beam may be registered with several pools, whose callbacks can run concurrently,
+    // so the counter is updated with a compare-exchange loop (so that it never exceeds 'nevictable').
+    auto reclaim_callback = [r, nevictable](ssize_t n) -> ssize_t {
+	ssize_t r0 = r->load();
+	ssize_t m = 0;
+
+	do {
+	    m = max(min(n, nevictable - r0), ssize_t(0));
+	} while ((m > 0) && !r->compare_exchange_weak(r0, r0 + m));
+
+	return m;
+    };
+
+    for (const auto &p: memory_pools) {
+	p->set_group_limits(stream_id, ini_params.memory_pool_reserved_slabs_per_stream, ini_params.memory_pool_quota_per_stream);
+	this->pool_clients.push_back(p->add_client(stream_id, ini_params.memory_pool_reserved_slabs_per_beam, ini_params.memory_pool_quota_per_beam, reclaim_callback));
+    }
+
+    this->async_downsampling = ini_params.downsampling_pool && (num_downsampling_levels > 1);
+
     for (int ids = 0; ids < num_downsampling_levels; ids++)
 	this->ringbuf[ids].resize(ringbuf_capacity[ids]);
 
+    if (async_downsampling)
+	this->ringbuf[0].resize(ringbuf_capacity[0] + 2);
+
     this->downstream_pos = 0;
     this->downstream_bufsize = ini_params.assembled_ringbuf_capacity;
+
+    if (ini_params.subchunk_nt > 0) {
+	this->subchunks_per_chunk = ini_params.nt_per_chunk / ini_params.subchunk_nt;
+	this->subchunk_nexpected = nfreq_coarse * (ini_params.subchunk_nt / ini_params.nt_per_packet);
+	this->subchunk_counts.resize(2 * subchunks_per_chunk, 0);
+	this->subchunk_free = make_shared<subchunk_free_list> (ini_params.subchunk_ringbuf_capacity + 2);
+    }
+
+    shared_ptr<ringbuf_state> state = make_shared<ringbuf_state> ();
+    state->levels.resize(num_downsampling_levels, make_shared<const ringbuf_state::chunk_list> ());
+    std::atomic_store(&this->published_state, shared_ptr<const ringbuf_state> (state));
     
     this->_check_invariants();
 }
@@ -67,6 +225,14 @@ assembled_chunk_ringbuf::assembled_chunk_ringbuf(const intensity_network_stream:
 
 assembled_chunk_ringbuf::~assembled_chunk_ringbuf()
 {
+    // Note: a downsampling task in flight holds a shared_ptr to 'this' (see _update_ringbuf()),
+    // so the destructor can't run until the task has finished.  (It may run in the worker thread.)
+
+    for (unsigned int i = 0; i < memory_pools.size(); i++)
+	memory_pools[i]->remove_client(pool_clients[i]);
+
+    pthread_cond_destroy(&this->cond_downsampling_done);
+    pthread_cond_destroy(&this->cond_subchunks_added);
     pthread_cond_destroy(&this->cond_assembled_chunks_added);
     pthread_mutex_destroy(&this->lock);
 }
@@ -86,10 +252,13 @@ void assembled_chunk_ringbuf::print_state()
     for (int ipos = downstream_pos; ipos < ringbuf_pos[0] + ringbuf_size[0]; ipos++)
 	cout << " " << this->ringbuf_entry(0,ipos)->ichunk;
     cout << " ]\n";
+
+    if (subchunks_per_chunk > 0)
+	cout << "  subchunks: " << subchunks.size() << " ready, " << num_subchunks_dropped << " dropped\n";
     
     for (int ids = 0; ids < num_downsampling_levels; ids++) {
 	int i0 = ringbuf_pos[ids];
-	int i1 = (ids > 0) ? (ringbuf_pos[ids] + ringbuf_size[ids]) : downstream_pos;
+	int i1 = (ids > 0) ? (ringbuf_pos[ids] + ringbuf_size[ids]) : int(downstream_pos);
 	
 	cout << "  binning " << ids << ": [";
 	for (int ipos = i0; ipos < i1; ipos++)
@@ -100,62 +269,185 @@ void assembled_chunk_ringbuf::print_state()
     pthread_mutex_unlock(&this->lock);
 }
 
+int ringbuf_state::find(int ids, uint64_t ichunk) const
+{
+    const chunk_list &level = this->level(ids);
+
+    if (level.size() == 0)
+	return -1;
+
+    uint64_t ichunk0 = level[0]->ichunk;
+
+    if (ichunk < ichunk0)
+	return -1;
+
+    // Fast path: no gaps in the level.
+    uint64_t n = (ichunk - ichunk0) >> ids;
+    if ((n < level.size()) && (level[n]->ichunk == ichunk))
+	return int(n);
+
+    // Levels >= 1 can contain gaps (see _prepare_downsampling()), so fall back to binary search.
+    auto it = std::lower_bound(level.begin(), level.end(), ichunk,
+			       [](const shared_ptr<assembled_chunk> &c, uint64_t i) { return c->ichunk < i; });
+
+    return ((it != level.end()) && ((*it)->ichunk == ichunk)) ? int(it - level.begin()) : -1;
+}
+
+void ringbuf_state::get_range(int ids, uint64_t min_fpga_counts, uint64_t max_fpga_counts, uint64_t fpga_per_ichunk, int &n0, int &n1) const
+{
+    const chunk_list &level = this->level(ids);
+
+    n0 = n1 = 0;
+
+    if (level.size() == 0)
+	return;
+
+    // Chunk n in this level spans ichunks [level[n]->ichunk, level[n]->ichunk + binning).
+    // Chunks are in time order (but can have gaps in levels >= 1), so we use binary search.
+    uint64_t binning = uint64_t(1) << ids;
+    auto i0 = level.begin();
+    auto i1 = level.end();
+
+    if (min_fpga_counts) {
+	// Overlap requires fpga_end > min_fpga_counts, i.e. (ichunk + binning) > min_fpga_counts / fpga_per_ichunk.
+	uint64_t q = min_fpga_counts / fpga_per_ichunk;
+	i0 = std::lower_bound(i0, i1, q, [binning](const shared_ptr<assembled_chunk> &c, uint64_t q) { return c->ichunk + binning <= q; });
+    }
+
+    if (max_fpga_counts) {
+	// Overlap requires fpga_begin <= max_fpga_counts, i.e. ichunk <= max_fpga_counts / fpga_per_ichunk.
+	uint64_t q = max_fpga_counts / fpga_per_ichunk;
+	i1 = std::upper_bound(i0, i1, q, [](uint64_t q, const shared_ptr<assembled_chunk> &c) { return q < c->ichunk; });
+    }
+
+    if (i0 < i1) {
+	n0 = i0 - level.begin();
+	n1 = i1 - level.begin();
+    }
+}
+
+
 shared_ptr<assembled_chunk>
 assembled_chunk_ringbuf::find_assembled_chunk(uint64_t fpga_counts, bool top_level_only)
 {
-    pthread_mutex_lock(&this->lock);
+    uint64_t fpga_per_ichunk = uint64_t(ini_params.nt_per_chunk) * ini_params.fpga_counts_per_sample;
+    uint64_t ichunk = fpga_counts / fpga_per_ichunk;
+    bool aligned = ((fpga_counts % fpga_per_ichunk) == 0);
+
+    // Lock-free: uses the most recently published ringbuf_state.
+    shared_ptr<const ringbuf_state> state = std::atomic_load(&this->published_state);
 
     // Return an empty pointer iff stream has ended, and chunk is requested past end-of-stream.
     // (If anything else goes wrong, an exception will be thrown.)
-    if (this->doneflag && (fpga_counts >= this->final_fpga)) {
-	pthread_mutex_unlock(&this->lock);
+    if (state->doneflag && (fpga_counts >= state->final_fpga))
 	return shared_ptr<assembled_chunk> ();
-    }
     
-    // Scan telescoping ring buffer
+    // Look up chunk in each level of the telescoping ring buffer, using the time index.
     int start_level = (top_level_only ? 0 : num_downsampling_levels-1);
-    for (int lev = start_level; lev >= 0; lev--) {
-	for (int ipos = ringbuf_pos[lev]; ipos < ringbuf_pos[lev] + ringbuf_size[lev]; ipos++) {
-	    auto ch = this->ringbuf_entry(lev, ipos);
-	    if (ch->fpga_begin == fpga_counts) {
-		pthread_mutex_unlock(&this->lock);
-		return ch;
-            }
+    for (int lev = aligned ? start_level : -1; lev >= 0; lev--) {
+	int n = state->find(lev, ichunk);
+	if (n >= 0) {
+	    const shared_ptr<assembled_chunk> &chunk = state->level(lev)[n];
+	    return chunk->is_compressed() ? shared_ptr<assembled_chunk> (chunk->make_decompressed()) : chunk;
 	}
     }
 
-    pthread_mutex_unlock(&this->lock);
+    // Fall through to the spill file.
+    chunk_spill_file::record rec;
+    shared_ptr<assembled_chunk> queued;
+
+    if (aligned && !top_level_only && ini_params.spill_file && ini_params.spill_file->find_chunk(beam_id, fpga_counts, rec, queued)) {
+	if (queued)
+	    return queued->is_compressed() ? shared_ptr<assembled_chunk> (queued->make_decompressed()) : queued;
+
+	shared_ptr<assembled_chunk> chunk = this->_read_spilled(rec);
+	if (chunk)
+	    return chunk;
+    }
+
     throw runtime_error("ch_frb_io::assembled_chunk::find_assembled_chunk(): couldn't find chunk, maybe your ring buffer is too small?");
 }
 
-vector<pair<shared_ptr<assembled_chunk>, uint64_t>>
-assembled_chunk_ringbuf::get_ringbuf_snapshot(uint64_t min_fpga_counts, uint64_t max_fpga_counts)
+void assembled_chunk_ringbuf::visit_ringbuf(uint64_t min_fpga_counts, uint64_t max_fpga_counts, const ringbuf_visitor_t &visitor)
 {
-    // Preallocate vector, before acquiring lock.
-    vector<pair<shared_ptr<assembled_chunk>, uint64_t>> ret;
-    ret.reserve(sum(ringbuf_capacity));
+    this->_visit_ringbuf(min_fpga_counts, max_fpga_counts, visitor, true);
+}
 
-    pthread_mutex_lock(&this->lock);
+// Helper for visit_ringbuf() and get_ringbuf_snapshot().  If 'decompress' is true, compressed chunks
+// are decompressed one at a time, and the copy is dropped when the visitor returns.
+void assembled_chunk_ringbuf::_visit_ringbuf(uint64_t min_fpga_counts, uint64_t max_fpga_counts, const ringbuf_visitor_t &visitor, bool decompress)
+{
+    uint64_t fpga_per_ichunk = uint64_t(ini_params.nt_per_chunk) * ini_params.fpga_counts_per_sample;
 
-    // Scan telescoping ring buffer, in a time-ordered way.
-    for (int ids = num_downsampling_levels-1; ids >= 0; ids--) {
-	for (int ipos = ringbuf_pos[ids]; ipos < ringbuf_pos[ids] + ringbuf_size[ids]; ipos++) {
-	    auto chunk = this->ringbuf_entry(ids, ipos);
+    // Lock-free: uses the most recently published ringbuf_state.
+    shared_ptr<const ringbuf_state> state = std::atomic_load(&this->published_state);
+    int dpos = this->downstream_pos;
+
+    // Visit spill file first (since its chunks are older than anything in the ring buffer).
+    // Only for bounded ranges, since each spilled chunk is read from disk.
+    if (ini_params.spill_file && min_fpga_counts && max_fpga_counts) {
+	uint64_t fpga_cutoff = UINT64_MAX;
+	for (const auto &level: state->levels) {
+	    if (level->size() > 0)
+		fpga_cutoff = min(fpga_cutoff, (*level)[0]->fpga_begin);
+	}
+
+	vector<chunk_spill_file::record> recs;
+	vector<shared_ptr<assembled_chunk>> queued;
+	ini_params.spill_file->find_chunks(beam_id, min_fpga_counts, max_fpga_counts, fpga_cutoff, recs, queued);
+
+	for (const auto &rec: recs) {
+	    shared_ptr<assembled_chunk> chunk = this->_read_spilled(rec);
+	    if (chunk)
+		visitor(chunk, l1_ringbuf_level::L1RB_SPILL);
+	}
+
+	// Chunks which are still waiting for the spill file's writer thread.
+	for (const auto &chunk: queued) {
+	    if (decompress && chunk->is_compressed())
+		visitor(shared_ptr<assembled_chunk> (chunk->make_decompressed()), l1_ringbuf_level::L1RB_SPILL);
+	    else
+		visitor(chunk, l1_ringbuf_level::L1RB_SPILL);
+	}
+    }
 
-	    if (min_fpga_counts && (chunk->fpga_end <= min_fpga_counts))
-		continue;   // no overlap
-	    if (max_fpga_counts && (chunk->fpga_begin > max_fpga_counts))
-		continue;   // no overlap
+    // Visit telescoping ring buffer, in a time-ordered way.
+    for (int ids = num_downsampling_levels-1; ids >= 0; ids--) {
+	int n0, n1;
+	state->get_range(ids, min_fpga_counts, max_fpga_counts, fpga_per_ichunk, n0, n1);
 
-	    uint64_t where = 1 << (ids+1);   // Note: works since l1_ringbuf_level::L1RB_LEVELn == 2^n.
-	    if ((ids == 0) && (ipos >= downstream_pos))
+	for (int n = n0; n < n1; n++) {
+	    uint64_t where = l1_ringbuf_level_bit(ids+1);
+	    if ((ids == 0) && (state->pos0 + n >= dpos))
 		where = l1_ringbuf_level::L1RB_DOWNSTREAM;
 
-	    ret.push_back({ chunk, where });
+	    const shared_ptr<assembled_chunk> &chunk = state->level(ids)[n];
+
+	    if (decompress && chunk->is_compressed())
+		visitor(shared_ptr<assembled_chunk> (chunk->make_decompressed()), where);
+	    else
+		visitor(chunk, where);
 	}
     }
+}
 
-    pthread_mutex_unlock(&this->lock);
+void assembled_chunk_ringbuf::get_ringbuf_snapshot(vector<pair<shared_ptr<assembled_chunk>, uint64_t>> &out, uint64_t min_fpga_counts, uint64_t max_fpga_counts)
+{
+    // Preallocate vector.  (A no-op if the caller is reusing 'out'.)
+    out.clear();
+    out.reserve(sum(ringbuf_capacity));
+
+    // Compressed chunks are not decompressed here, since the snapshot would hold all of the copies at once.
+    this->_visit_ringbuf(min_fpga_counts, max_fpga_counts,
+			 [&out](const shared_ptr<assembled_chunk> &chunk, uint64_t where) { out.push_back({ chunk, where }); },
+			 false);
+}
+
+vector<pair<shared_ptr<assembled_chunk>, uint64_t>>
+assembled_chunk_ringbuf::get_ringbuf_snapshot(uint64_t min_fpga_counts, uint64_t max_fpga_counts)
+{
+    vector<pair<shared_ptr<assembled_chunk>, uint64_t>> ret;
+    this->get_ringbuf_snapshot(ret, min_fpga_counts, max_fpga_counts);
     return ret;
 }
 
@@ -169,26 +461,35 @@ void assembled_chunk_ringbuf::get_ringbuf_size(uint64_t *ringbuf_fpga_next,
                                                uint64_t *ringbuf_fpga_max,
                                                int level) 
 {
-    pthread_mutex_lock(&this->lock);
+    // Lock-free: uses the most recently published ringbuf_state.
+    // Note that 'ringbuf_capacity' is constant after construction.
+    shared_ptr<const ringbuf_state> state = std::atomic_load(&this->published_state);
+    const ringbuf_state::chunk_list &level0 = state->level(0);
+
+    // Position of downstream thread, relative to level0[0].  Since 'downstream_pos' is read
+    // separately from 'state', it may be slightly out of sync, so we clamp it.
+    int dn = this->downstream_pos - state->pos0;
+    dn = max(dn, 0);
+    dn = min(dn, int(level0.size()));
 
     if (ringbuf_fpga_next && (level == 0)) {
 	*ringbuf_fpga_next = 0;
 
-	if (downstream_pos < ringbuf_pos[0] + ringbuf_size[0]) {
+	if (dn < int(level0.size())) {
 	    // Use initial FPGA count of first chunk which has been assembled,
 	    // but not yet processed by "downstream" thread.
-	    *ringbuf_fpga_next = this->ringbuf_entry(0, downstream_pos)->fpga_begin;
+	    *ringbuf_fpga_next = level0[dn]->fpga_begin;
 	}
-	else if (ringbuf_size[0] > 0) {
+	else if (level0.size() > 0) {
 	    // All chunks have been processed by "downstream" thread.
 	    // Use final FPGA count of last chunk in buffer.
-	    *ringbuf_fpga_next = this->ringbuf_entry(0, ringbuf_pos[0] + ringbuf_size[0] - 1)->fpga_end;
+	    *ringbuf_fpga_next = level0.back()->fpga_end;
 	}
     }
 
     if (ringbuf_n_ready && (level == 0)) {
 	// Number of chunks which have been assembled, but not yet processed by "downstream" thread.
-        *ringbuf_n_ready = ringbuf_pos[0] + ringbuf_size[0] - downstream_pos;
+        *ringbuf_n_ready = level0.size() - dn;
     }
 
     if (ringbuf_total_capacity) {
@@ -202,12 +503,12 @@ void assembled_chunk_ringbuf::get_ringbuf_size(uint64_t *ringbuf_fpga_next,
     }
     
     if (ringbuf_nelements) {
+	*ringbuf_nelements = 0;
         if (level == 0) {
-            *ringbuf_nelements = sum(ringbuf_size);
-        } else if (level > num_downsampling_levels) {
-            *ringbuf_nelements = 0;
-        } else {
-            *ringbuf_nelements = ringbuf_size[level-1];
+	    for (const auto &l: state->levels)
+		*ringbuf_nelements += l->size();
+        } else if (level <= num_downsampling_levels) {
+            *ringbuf_nelements = state->level(level-1).size();
         }
     }
 
@@ -215,17 +516,14 @@ void assembled_chunk_ringbuf::get_ringbuf_size(uint64_t *ringbuf_fpga_next,
 	*ringbuf_fpga_min = 0;
         if (level == 0) {
             for (int lev = num_downsampling_levels-1; lev >= 0; lev--) {
-                if (ringbuf_size[lev] > 0) {
-                    int ipos = ringbuf_pos[lev];
-                    *ringbuf_fpga_min = this->ringbuf_entry(lev,ipos)->fpga_begin;
+                if (state->level(lev).size() > 0) {
+                    *ringbuf_fpga_min = state->level(lev).front()->fpga_begin;
                     break;
                 }
             }
         } else if (level <= num_downsampling_levels) {
-            if (ringbuf_size[level-1] > 0) {
-                int ipos = ringbuf_pos[level-1];
-                *ringbuf_fpga_min = this->ringbuf_entry(level-1,ipos)->fpga_begin;
-            }
+            if (state->level(level-1).size() > 0)
+                *ringbuf_fpga_min = state->level(level-1).front()->fpga_begin;
         }
     }
 
@@ -233,21 +531,16 @@ void assembled_chunk_ringbuf::get_ringbuf_size(uint64_t *ringbuf_fpga_next,
 	*ringbuf_fpga_max = 0;
         if (level == 0) {
             for (int ids = 0; ids < num_downsampling_levels; ids++) {
-                if (ringbuf_size[ids] > 0) {
-                    int ipos = ringbuf_pos[ids] + ringbuf_size[ids] - 1;
-                    *ringbuf_fpga_max = this->ringbuf_entry(ids,ipos)->fpga_end;
+                if (state->level(ids).size() > 0) {
+                    *ringbuf_fpga_max = state->level(ids).back()->fpga_end;
                     break;
                 }
             }
         } else if (level <= num_downsampling_levels) {
-            if (ringbuf_size[level-1] > 0) {
-                int ipos = ringbuf_pos[level-1];
-                *ringbuf_fpga_max = this->ringbuf_entry(level-1,ipos)->fpga_end;
-            }
+            if (state->level(level-1).size() > 0)
+                *ringbuf_fpga_max = state->level(level-1).front()->fpga_end;
         }
     }
-
-    pthread_mutex_unlock(&this->lock);
 }
 
 
@@ -271,15 +564,17 @@ void assembled_chunk_ringbuf::stream_to_files(const string &filename_pattern, in
 void assembled_chunk_ringbuf::put_unassembled_packet(const intensity_packet &packet, int64_t *event_counts)
 {
     uint64_t packet_t0 = packet.fpga_count / packet.fpga_counts_per_sample;
-    uint64_t packet_ichunk = packet_t0 / constants::nt_per_assembled_chunk;
+    uint64_t packet_ichunk = packet_t0 / ini_params.nt_per_chunk;
 
     if (!first_packet_received) {
 	uint64_t first_ichunk = packet_ichunk;
 
 	if (ini_params.nt_align > 0) {
-	    uint64_t chunk_align = ini_params.nt_align / constants::nt_per_assembled_chunk;
+	    uint64_t chunk_align = ini_params.nt_align / ini_params.nt_per_chunk;
 	    first_ichunk = ((first_ichunk + chunk_align - 1) / chunk_align) * chunk_align;
 	}
+
+	this->numa_node = get_current_numa_node();
 	
 	this->active_chunk0 = this->_make_assembled_chunk(first_ichunk, 1);
 	this->active_chunk1 = this->_make_assembled_chunk(first_ichunk+1, 1);
@@ -290,7 +585,8 @@ void assembled_chunk_ringbuf::put_unassembled_packet(const intensity_packet &pac
 	// This makes sense because 'first_fpgacount' is used to convert between FPGA counts and
 	// time sample indices in rf_pipelines/bonsai.
 	
-        this->first_fpgacount = first_ichunk * constants::nt_per_assembled_chunk * ini_params.fpga_counts_per_sample;
+        this->first_fpgacount = first_ichunk * ini_params.nt_per_chunk * ini_params.fpga_counts_per_sample;
+	this->next_subchunk = first_ichunk * subchunks_per_chunk;
     }
 
     // We test these pointers instead of 'doneflag' so that we don't need to acquire the lock in every call.
@@ -308,6 +604,13 @@ void assembled_chunk_ringbuf::put_unassembled_packet(const intensity_packet &pac
 	// timestamp.  This is to avoid a situation where a single rogue packet timestamped
 	// in the far future effectively kills the L1 node.
 	//
+	if (subchunks_per_chunk > 0) {
+	    // Deliver any remaining slices of active_chunk0, and shift the slice counts.
+	    this->_put_subchunks((active_chunk0->ichunk + 1) * subchunks_per_chunk);
+	    std::copy(subchunk_counts.begin() + subchunks_per_chunk, subchunk_counts.end(), subchunk_counts.begin());
+	    std::fill(subchunk_counts.begin() + subchunks_per_chunk, subchunk_counts.end(), 0);
+	}
+
 	this->_put_assembled_chunk(active_chunk0, event_counts);
 
         // After _put_assembled_chunk(), active_chunk0 has been reset to a null pointer.
@@ -320,10 +623,14 @@ void assembled_chunk_ringbuf::put_unassembled_packet(const intensity_packet &pac
     if (packet_ichunk == active_chunk0->ichunk) {
 	event_counts[intensity_network_stream::event_type::assembler_hit]++;
 	active_chunk0->add_packet(packet);
+	if (subchunks_per_chunk > 0)
+	    this->_count_subchunk_packet(packet, 0, packet_t0);
     }
     else if (packet_ichunk == active_chunk1->ichunk) {
 	event_counts[intensity_network_stream::event_type::assembler_hit]++;
 	active_chunk1->add_packet(packet);
+	if (subchunks_per_chunk > 0)
+	    this->_count_subchunk_packet(packet, 1, packet_t0);
     }
     else {
 	event_counts[intensity_network_stream::event_type::assembler_miss]++;
@@ -332,6 +639,128 @@ void assembled_chunk_ringbuf::put_unassembled_packet(const intensity_packet &pac
     }
 }
 
+// Sub-chunk streaming delivery.  Called by the assembler thread after 'packet' has been added to
+// active_chunk0 (iactive=0) or active_chunk1 (iactive=1).  Slices are delivered in order, when they
+// are complete, or when a packet has arrived more than 'subchunk_lateness_nt' samples past their end.
+void assembled_chunk_ringbuf::_count_subchunk_packet(const intensity_packet &packet, int iactive, uint64_t packet_t0)
+{
+    uint64_t ichunk0 = active_chunk0->ichunk;
+    int j = iactive * subchunks_per_chunk + (packet_t0 % ini_params.nt_per_chunk) / ini_params.subchunk_nt;
+
+    if (!freq_map)
+	subchunk_counts[j] += packet.nfreq_coarse;
+    else {
+	for (int f = 0; f < packet.nfreq_coarse; f++)
+	    if (freq_map->local_index[packet.coarse_freq_ids[f]] >= 0)
+		subchunk_counts[j]++;
+    }
+    subchunk_max_t = max(subchunk_max_t, packet_t0 + packet.ntsamp);
+
+    // (Can only happen if inject_assembled_chunk() was called.)
+    next_subchunk = max(next_subchunk, ichunk0 * subchunks_per_chunk);
+
+    uint64_t end = next_subchunk;
+    uint64_t max_end = (ichunk0 + 2) * subchunks_per_chunk;
+
+    while (end < max_end) {
+	int k = end - ichunk0 * subchunks_per_chunk;
+	uint64_t t_end = (end + 1) * ini_params.subchunk_nt;
+
+	if ((subchunk_counts[k] < subchunk_nexpected) && (t_end + ini_params.subchunk_lateness_nt > subchunk_max_t))
+	    break;
+	end++;
+    }
+
+    this->_put_subchunks(end);
+}
+
+
+// Delivers all slices before 'end' (see _count_subchunk_packet()).  Called by the assembler thread.
+void assembled_chunk_ringbuf::_put_subchunks(uint64_t end)
+{
+    if (next_subchunk >= end)
+	return;
+
+    // Copy the slices without the lock held.
+    vector<shared_ptr<assembled_subchunk>> sc;
+
+    for ( ; next_subchunk < end; next_subchunk++) {
+	uint64_t ichunk = next_subchunk / subchunks_per_chunk;
+	int it0 = (next_subchunk % subchunks_per_chunk) * ini_params.subchunk_nt;
+
+	const assembled_chunk *chunk = nullptr;
+	if (ichunk == active_chunk0->ichunk)
+	    chunk = active_chunk0.get();
+	else if (ichunk == active_chunk1->ichunk)
+	    chunk = active_chunk1.get();
+	else
+	    continue;
+
+	// If the fixed set of slices is exhausted, reuse the oldest buffered slice (which would be
+	// dropped below anyway).  If the processing threads hold all the slices, drop this one.
+	shared_ptr<assembled_subchunk> s = subchunk_free_list::get(subchunk_free);
+
+	if (!s) {
+	    pthread_mutex_lock(&this->lock);
+	    if (!subchunks.empty()) {
+		s = std::move(subchunks.front());
+		subchunks.pop_front();
+	    }
+	    num_subchunks_dropped++;
+	    pthread_mutex_unlock(&this->lock);
+	}
+
+	if (!s)
+	    continue;
+
+	// The vectors in a recycled slice already have the right size, so this doesn't allocate.
+	chunk->get_subchunk(*s, it0, ini_params.subchunk_nt);
+	sc.push_back(std::move(s));
+    }
+
+    pthread_mutex_lock(&this->lock);
+
+    for (auto &p: sc) {
+	subchunks.push_back(p);
+	p.reset();
+    }
+
+    // Drop the oldest slices if the processing thread is running slow.  The destructors
+    // are called below, without the lock held.
+    while ((int)subchunks.size() > ini_params.subchunk_ringbuf_capacity) {
+	sc.push_back(subchunks.front());
+	subchunks.pop_front();
+	num_subchunks_dropped++;
+    }
+
+    pthread_cond_broadcast(&this->cond_subchunks_added);
+    pthread_mutex_unlock(&this->lock);
+}
+
+
+shared_ptr<assembled_subchunk> assembled_chunk_ringbuf::get_assembled_subchunk(bool wait)
+{
+    shared_ptr<assembled_subchunk> ret;
+    pthread_mutex_lock(&this->lock);
+
+    for (;;) {
+	if (!subchunks.empty()) {
+	    ret = subchunks.front();
+	    subchunks.pop_front();
+	    break;
+	}
+
+	if (!wait || this->doneflag)
+	    break;
+
+	pthread_cond_wait(&this->cond_subchunks_added, &this->lock);
+    }
+
+    pthread_mutex_unlock(&this->lock);
+    return ret;
+}
+
+
 struct streaming_write_chunk_request : public write_chunk_request {
     weak_ptr<assembled_chunk_ringbuf> assembler;
     int udelay;
@@ -378,6 +807,52 @@ void assembled_chunk_ringbuf::get_streamed_chunks(int &achunks, size_t &abytes)
     pthread_mutex_unlock(&this->lock);
 }
 
+void assembled_chunk_ringbuf::get_memory_pressure_counts(int64_t &nfallbacks, int64_t &nreclaimed, int64_t &ndropped, int64_t &nbytes_fallback) {
+    nfallbacks = num_pool_fallbacks;
+    nreclaimed = num_reclaimed;
+    ndropped = num_pool_drops;
+    nbytes_fallback = fallback_nbytes->load();
+}
+
+void assembled_chunk_ringbuf::get_memory_residency(vector<int64_t> &level_nchunks, vector<int64_t> &level_nbytes, int64_t &nslabs)
+{
+    shared_ptr<const ringbuf_state> state = std::atomic_load(&this->published_state);
+    int nds = state->levels.size();
+
+    level_nchunks.assign(nds, 0);
+    level_nbytes.assign(nds, 0);
+    nslabs = 0;
+
+    for (int ids = 0; ids < nds; ids++) {
+	for (const auto &chunk: state->level(ids)) {
+	    level_nchunks[ids]++;
+	    level_nbytes[ids] += chunk->get_memory_nbytes();
+	    if (chunk->has_pool_slab())
+		nslabs++;
+	}
+    }
+}
+
+
+// Drops the references in a scratch pushlist/poplist (see assembled_chunk_ringbuf::asm_pushlist)
+// when it goes out of scope, so that popped chunks are freed as soon as they're no longer needed.
+struct scratch_list_guard {
+    vector<shared_ptr<assembled_chunk>> &pushlist;
+    vector<shared_ptr<assembled_chunk>> &poplist;
+
+    scratch_list_guard(vector<shared_ptr<assembled_chunk>> &pushlist_, vector<shared_ptr<assembled_chunk>> &poplist_) :
+	pushlist(pushlist_), poplist(poplist_) { }
+
+    ~scratch_list_guard()
+    {
+	for (auto &p: pushlist)
+	    p.reset();
+	for (auto &p: poplist)
+	    p.reset();
+    }
+};
+
+
 // Helper function called assembler thread, to add a new assembled_chunk to the ring buffer.
 // Resets 'chunk' to a null pointer.
 // Warning: only safe to call from assembler thread.
@@ -388,31 +863,102 @@ bool assembled_chunk_ringbuf::_put_assembled_chunk(unique_ptr<assembled_chunk> &
     if (chunk->has_rfi_mask)
 	throw runtime_error("ch_frb_io: internal error: chunk passed to assembled_chunk_ringbuf::_put_unassembled_packet() has rfi_mask flag set");
 
-    // Step 1: prepare all data needed to modify the ring buffer.  In this step, we do all of our
-    // buffer allocation and downsampling, without the lock held.  In step 2, we will acquire the
-    // lock and modify the ring buffer (without expensive operations like allocation/downsampling).
-    //
-    // It is very important to note that we can read (but not modify) the ring buffer without 
-    // acquiring the lock!  This is because _put_assembled_chunk() is called from the assembler
-    // thread, and only the assembler thread modifies the ring buffer ("single-producer").  
-
-    int nds = this->num_downsampling_levels;
-
     // List of chunks to be pushed and popped at each level of the ring buffer (in step 2!)
-    vector<shared_ptr<assembled_chunk>> pushlist(nds);
-    vector<shared_ptr<assembled_chunk>> poplist(2*nds);
+    vector<shared_ptr<assembled_chunk>> &pushlist = this->asm_pushlist;
+    vector<shared_ptr<assembled_chunk>> &poplist = this->asm_poplist;
+    scratch_list_guard guard(pushlist, poplist);
 
     uint64_t chunk_fpga_end = chunk->fpga_end;
     
     // Converts unique_ptr -> shared_ptr, and resets 'chunk' to a null pointer.
-    pushlist[0] = shared_ptr<assembled_chunk> (chunk.release());
+    pushlist[0] = recycled_shared_ptr(std::move(chunk));
+
+    // Step 1: prepare all data needed to modify the ring buffer, without the lock held.
+    //
+    // If there is a downsampling_thread_pool, then the downsampling is done later by
+    // _downsampling_task(), and we just push the chunk to level 0.  (Level 0 has two extra
+    // slots, so that we can do this while a downsampling task is in flight.  In the unlikely
+    // event that the workers fall this far behind, we wait.)
+
+    if (this->async_downsampling)
+	this->_wait_for_downsampling(false);
+    else
+	this->_prepare_downsampling(pushlist, poplist, ringbuf_size[0]);
+
+    // Step 2: acquire lock and modify the ring buffer.
+    int num_assembled_chunks_dropped = this->_update_ringbuf(pushlist, poplist);
+
+    // Make thread-local copies with lock held.
+    pthread_mutex_lock(&this->lock);
+    string loc_stream_pattern = this->stream_pattern;
+    int loc_stream_priority = this->stream_priority;
+    bool loc_stream_rfi_mask = this->stream_rfi_mask;
+    pthread_mutex_unlock(&this->lock);
+
+    // Stream new chunk to disk (if 'stream_pattern' is a nonempty string).
+    // It's better to do this processing without the lock held, we just need to use
+    // 'loc_stream_pattern' and 'loc_stream_priority' here, for thread-safety.
+
+    if (loc_stream_pattern.size() > 0) {
+	shared_ptr<streaming_write_chunk_request> wreq = allocate_shared<streaming_write_chunk_request> (recycling_allocator<streaming_write_chunk_request> ());
+	wreq->filename = pushlist[0]->format_filename(loc_stream_pattern);
+	wreq->priority = loc_stream_priority;
+        wreq->need_rfi_mask = loc_stream_rfi_mask;
+	// DEBUG
+	if (wreq->priority == -1000)
+            wreq->udelay = 1000000;
+	wreq->chunk = pushlist[0];	
+        wreq->assembler = shared_from_this();
+        
+	// return value from enqueue_write_request() is ignored.
+	output_devices.enqueue_write_request(wreq);
+    }
+
+    // This call to _check_invariants() is a good test during debugging, but
+    // shouldn't be enabled in production.
+    //
+    // FIXME!!  Make sure this line gets commented out eventually.
+    this->_check_invariants();
+
+    // For even more debugging, uncomment this line!
+    // this->print_state();
+
+    if (event_counts) {
+	event_counts[intensity_network_stream::event_type::assembled_chunk_queued]++;
+	event_counts[intensity_network_stream::event_type::assembled_chunk_dropped] += num_assembled_chunks_dropped;
+    }
+
+    assert(chunk_fpga_end > this->max_fpga_flushed);
+    this->max_fpga_flushed = chunk_fpga_end;
+
+    if (ini_params.emit_warning_on_buffer_drop && (num_assembled_chunks_dropped > 0))
+	cout << "ch_frb_io: warning: processing thread is running too slow, dropping assembled_chunk" << endl;
+    if (ini_params.throw_exception_on_buffer_drop && (num_assembled_chunks_dropped > 0))
+	throw runtime_error("ch_frb_io: assembled_chunk was dropped and stream was constructed with 'throw_exception_on_buffer_drop' flag");
+
+    // Note: when this function returns, stray references in poplist[*] are dropped (by 'guard'), and assembled_chunk destructors get called.
+    return true;
+}
+
+
+// Step 1 of modifying the ring buffer: fills pushlist[1:] and poplist[:], downsampling pairs of
+// chunks which cascade to the next level.  The 'size0' argument is the number of chunks in level 0,
+// not counting the chunk in pushlist[0] (or the most recent chunk, when called from _downsampling_task()).
+//
+// Called without the lock held.  This is OK since the levels being popped are only modified by
+// the caller (either the assembler thread, or the single in-flight downsampling task).
+
+void assembled_chunk_ringbuf::_prepare_downsampling(vector<shared_ptr<assembled_chunk>> &pushlist, vector<shared_ptr<assembled_chunk>> &poplist, int size0)
+{
+    int nds = this->num_downsampling_levels;
 
-    // Without lock held...
     for (int ids = 0; ids < nds; ids++) {
 	// At top of loop, we want to add the chunk pushlist[ids] at level 'ids' of
 	// the telescoping ring buffer.  Is there space available...?
 
-	if (ringbuf_size[ids] < ringbuf_capacity[ids])
+	int size = (ids > 0) ? ringbuf_size[ids] : size0;
+
+	if (size < ringbuf_capacity[ids])
 	    break;  // ... Yes, no problem.
 
 	// ... No space available!  Need to pop chunks.
@@ -421,6 +967,9 @@ bool assembled_chunk_ringbuf::_put_assembled_chunk(unique_ptr<assembled_chunk> &
 	if (ids == nds-1) {
 	    poplist[2*ids] = this->ringbuf_entry(ids, ringbuf_pos[ids]);
 
+	    if (ini_params.spill_file)
+		this->_spill(poplist[2*ids]);
+
 	    // This assert and its counterpart below ensure that a chunk never leaves the telescoping
 	    // ring buffer before its RFI mask is filled.  (If this could happen, we might hang on to
 	    // the reference forever in output_device::_awaiting_rfi and get a memory leak.)
@@ -440,23 +989,93 @@ bool assembled_chunk_ringbuf::_put_assembled_chunk(unique_ptr<assembled_chunk> &
 	if ((ini_params.nrfifreq > 0) && (!poplist[2*ids]->has_rfi_mask || !poplist[2*ids+1]->has_rfi_mask))
 	    throw runtime_error("ch_frb_io: _put_assembled_chunk(): rfimask not initialized as expected, maybe your ring buffer is too small?");
 
-	pushlist[ids+1] = _make_assembled_chunk(poplist[2*ids]->ichunk, 1 << (ids+1));
+	// If level 'ids' has a gap (see below), the oldest chunk may have no partner, and is dropped by itself.
+	if (poplist[2*ids+1]->ichunk != poplist[2*ids]->ichunk + poplist[2*ids]->binning) {
+	    poplist[2*ids+1] = shared_ptr<assembled_chunk> ();
+	    this->num_pool_drops++;
+	    break;
+	}
 
-	// Note: this test is currently superfluous, since _make_assembled_chunk() throws
-	// an exception (rather than returning NULL) if the allocation fails.  It's 
-	// just a placeholder to remind myself that the return value of this function
-	// is supposed to indicate success/failure, and that more thought needs to
-	// be put into assembled_chunk memory management.
+	// If no memory is available for the downsampled chunk, then the two source chunks are dropped
+	// (their memory is freed when the ring buffer is updated), leaving a gap in level ids+1.
+	unique_ptr<assembled_chunk> dst = _make_assembled_chunk(poplist[2*ids]->ichunk, 1 << (ids+1), true, 0, alloc_downsampled);
 
-	if (!pushlist[ids+1])
-	    return false;
+	if (!dst) {
+	    this->num_pool_drops += 2;
+	    break;
+	}
+
+	pushlist[ids+1] = recycled_shared_ptr(std::move(dst));
+
+	// If level 'ids' is compressed, the source chunks are decompressed into temporary chunks.
+	shared_ptr<assembled_chunk> src1 = _decompressed(poplist[2*ids]);
+	shared_ptr<assembled_chunk> src2 = _decompressed(poplist[2*ids+1]);
+
+	// If the next level is also downsampled in frequency, we do this first, so that the
+	// (more expensive) time-downsampling kernels run on the smaller arrays.
+
+	if (level_nupfreq[ids+1] != level_nupfreq[ids]) {
+	    shared_ptr<assembled_chunk> f1 = recycled_shared_ptr(_make_assembled_chunk(src1->ichunk, 1 << ids, false, level_nupfreq[ids+1], alloc_temporary));
+	    shared_ptr<assembled_chunk> f2 = recycled_shared_ptr(_make_assembled_chunk(src2->ichunk, 1 << ids, false, level_nupfreq[ids+1], alloc_temporary));
+
+	    f1->downsample_freq(src1.get());
+	    f2->downsample_freq(src2.get());
+	    src1 = f1;
+	    src2 = f2;
+	}
+
+	pushlist[ids+1]->downsample(src1.get(), src2.get());
 
-	pushlist[ids+1]->downsample(poplist[2*ids].get(), poplist[2*ids+1].get());
+	// Compress and/or requantize before the chunk is pushed (and becomes visible to readers).  If the
+	// memory_slab_budget refuses the compressed bytes, compress() leaves the chunk uncompressed.
+	int lz4_level = ini_params.telescoping_compression_level;
+	int rq_level = ini_params.telescoping_requantize_level;
+	bool lz4 = (lz4_level > 0) && (ids+1 >= lz4_level);
+	int nbits = ((rq_level > 0) && (ids+1 >= rq_level)) ? 4 : 8;
+
+	if (lz4 || (nbits < 8))
+	    pushlist[ids+1]->compress(nbits, lz4);
+    }
+
+    // Under memory pressure (see 'reclaim_request'), evict the oldest chunks in the last level early,
+    // up to the two slots available in poplist[].  Note that pushlist[nds-1] is never evicted.
+    if ((nds > 1) && (reclaim_request->load() > 0)) {
+	int ids = nds-1;
+	int npop = (poplist[2*ids] ? 1 : 0);
+
+	while ((npop < 2) && (npop < ringbuf_size[ids]) && (reclaim_request->load() > 0)) {
+	    shared_ptr<assembled_chunk> chunk = this->ringbuf_entry(ids, ringbuf_pos[ids] + npop);
+
+	    // As above, a chunk can't leave the ring buffer before its RFI mask is filled.
+	    if ((ini_params.nrfifreq > 0) && !chunk->has_rfi_mask)
+		break;
+	    if (ini_params.spill_file)
+		this->_spill(chunk);
+
+	    poplist[2*ids + npop] = chunk;
+	    npop++;
+	    (*reclaim_request)--;
+	    this->num_reclaimed++;
+	}
     }
+}
+
+
+// Step 2 of modifying the ring buffer: acquire lock, apply pushlist/poplist, and publish the new
+// ringbuf_state.  We have already computed the chunks to be added/removed at each level, so we
+// don't malloc/free/downsample with the lock held.  Returns the number of chunks dropped by the
+// "downstream" thread.
+//
+// Called from the assembler thread and from _downsampling_task().  These are serialized by the
+// 'writer_lock', which is held while the next ringbuf_state is built (without 'lock' held).
+
+int assembled_chunk_ringbuf::_update_ringbuf(const vector<shared_ptr<assembled_chunk>> &pushlist, const vector<shared_ptr<assembled_chunk>> &poplist)
+{
+    unique_lock<std::mutex> wlock(this->writer_lock);
 
-    // Step 2: acquire lock and modify the ring buffer.  We have already computed the chunks to
-    // be added/removed at each level (pushlist/poplist), so we don't malloc/free/downsample with
-    // the lock held.
+    // Build the ringbuf_state which will be published to lock-free readers.
+    shared_ptr<const ringbuf_state> next_state = this->_make_next_state(pushlist, poplist);
+    bool submit_task = false;
 
     pthread_mutex_lock(&this->lock);
 
@@ -465,21 +1084,23 @@ bool assembled_chunk_ringbuf::_put_assembled_chunk(unique_ptr<assembled_chunk> &
 	throw runtime_error("ch_frb_io: internal error: assembled_chunk_ringbuf::put_unassembled_packet() called after end_stream()");
     }
 
-    for (int ids = 0; ids < nds; ids++) {
+    for (int ids = 0; ids < num_downsampling_levels; ids++) {
 	// Number of chunks to be removed from level 'ids' of the telescoping ring buffer.
 	int npop = 0;
 	if (poplist[2*ids]) npop++;
 	if (poplist[2*ids+1]) npop++;
 	
 	// Remove chunks from ring buffer, by resetting shared_ptrs
-	// Note that we are still holding references to these chunks in poplist[].
-	// This ensures that assembled_chunk destructors are called without the lock held (at the end of this function).
+	// Note that the caller is still holding references to these chunks in poplist[].
+	// This ensures that assembled_chunk destructors are called without the lock held.
 
-	for (int p = 0; p < npop; p++)
-	    this->ringbuf_entry(ids, ringbuf_pos[ids]+p) = shared_ptr<assembled_chunk> ();
+	if (npop > 0) {
+	    for (int p = 0; p < npop; p++)
+		this->ringbuf_entry(ids, ringbuf_pos[ids]+p) = shared_ptr<assembled_chunk> ();
 
-	ringbuf_pos[ids] += npop;
-	ringbuf_size[ids] -= npop;
+	    ringbuf_pos[ids] += npop;
+	    ringbuf_size[ids] -= npop;
+	}
 
 	// Add chunk to level 'ids' of the telescoping ring buffer.
 
@@ -489,8 +1110,7 @@ bool assembled_chunk_ringbuf::_put_assembled_chunk(unique_ptr<assembled_chunk> &
 	}
     }
 
-    // Last step while holding lock: handle case where downstream thread is running
-    // slow, and chunks were dropped.
+    // Handle case where downstream thread is running slow, and chunks were dropped.
 
     int num_assembled_chunks_dropped = 0;
     int max_allowed_downstream_pos = ringbuf_pos[0] + ringbuf_size[0] - downstream_bufsize;
@@ -500,67 +1120,156 @@ bool assembled_chunk_ringbuf::_put_assembled_chunk(unique_ptr<assembled_chunk> &
 	downstream_pos = max_allowed_downstream_pos;
     }
 
-    // Make thread-local copies with lock held.
-    string loc_stream_pattern = this->stream_pattern;
-    int loc_stream_priority = this->stream_priority;
-    bool loc_stream_rfi_mask = this->stream_rfi_mask;
-    
+    // Same for named consumers.  (A consumer's bufsize can be as large as ringbuf_capacity[0], so we
+    // also need to handle the case where chunks were popped from ringbuf[0] by the downsampling logic.)
+
+    for (auto &kv: consumers) {
+	consumer_cursor &c = kv.second;
+	int max_allowed_pos = max(ringbuf_pos[0] + ringbuf_size[0] - c.bufsize, ringbuf_pos[0]);
+
+	if (c.pos < max_allowed_pos) {
+	    c.counts.ndropped += max_allowed_pos - c.pos;
+	    c.pos = max_allowed_pos;
+	}
+    }
+
+    // Publish the new ringbuf_state with the lock held, so that a processing thread which retrieves
+    // a chunk with get_assembled_chunk() can always find it with find_assembled_chunk().  We hold on
+    // to the old state, so that its destructor is called without the lock held.
+    next_state = std::atomic_exchange(&this->published_state, next_state);
+
+    // If level 0 is over capacity, start a downsampling task (unless one is already in flight).
+    if (async_downsampling && !ds_in_flight && (ringbuf_size[0] > ringbuf_capacity[0])) {
+	this->ds_in_flight = true;
+	submit_task = true;
+    }
+
     pthread_cond_broadcast(&this->cond_assembled_chunks_added);
     pthread_mutex_unlock(&this->lock);
+    wlock.unlock();
 
-    // Stream new chunk to disk (if 'stream_pattern' is a nonempty string).
-    // It's better to do this processing without the lock held, we just need to use
-    // 'loc_stream_pattern' and 'loc_stream_priority' here, for thread-safety.
+    if (pushlist[0] && chunks_added_callback)
+	chunks_added_callback();
 
-    if (loc_stream_pattern.size() > 0) {
-	shared_ptr<streaming_write_chunk_request> wreq = make_shared<streaming_write_chunk_request> ();
-	wreq->filename = pushlist[0]->format_filename(loc_stream_pattern);
-	wreq->priority = loc_stream_priority;
-        wreq->need_rfi_mask = loc_stream_rfi_mask;
-	// DEBUG
-	if (wreq->priority == -1000)
-            wreq->udelay = 1000000;
-	wreq->chunk = pushlist[0];	
-        wreq->assembler = shared_from_this();
-        
-	// return value from enqueue_write_request() is ignored.
-	output_devices.enqueue_write_request(wreq);
+    // The task keeps the ring buffer alive until it's done.
+    if (submit_task) {
+	shared_ptr<assembled_chunk_ringbuf> self = shared_from_this();
+	ini_params.downsampling_pool->submit([self]() { self->_downsampling_task(); });
     }
 
-    // This call to _check_invariants() is a good test during debugging, but
-    // shouldn't be enabled in production.
-    //
-    // FIXME!!  Make sure this line gets commented out eventually.
-    this->_check_invariants();
+    return num_assembled_chunks_dropped;
+}
 
-    // For even more debugging, uncomment this line!
-    // this->print_state();
 
-    if (event_counts) {
-	event_counts[intensity_network_stream::event_type::assembled_chunk_queued]++;
-	event_counts[intensity_network_stream::event_type::assembled_chunk_dropped] += num_assembled_chunks_dropped;
+// Runs in a downsampling_thread_pool worker.  At most one task per ring buffer is in flight
+// (tracked by 'ds_in_flight'), so the downsampling for each beam is done in order.
+//
+// The task downsamples until level 0 is back within its nominal capacity.  Each iteration
+// is applied to the ring buffer atomically (via _update_ringbuf()), so that the telescoping
+// ring buffer is always consistent and _check_invariants() holds.  Exceptions are stashed in
+// 'ds_error' and rethrown in the assembler thread.
+
+void assembled_chunk_ringbuf::_downsampling_task()
+{
+    try {
+	for (;;) {
+	    vector<shared_ptr<assembled_chunk>> &pushlist = this->ds_pushlist;
+	    vector<shared_ptr<assembled_chunk>> &poplist = this->ds_poplist;
+	    scratch_list_guard guard(pushlist, poplist);
+
+	    // Level 0 is modified concurrently by the assembler thread, so we read its size with the lock held.
+	    pthread_mutex_lock(&this->lock);
+	    int size0 = ringbuf_size[0] - 1;
+	    pthread_mutex_unlock(&this->lock);
+
+	    this->_prepare_downsampling(pushlist, poplist, size0);
+
+	    this->_update_ringbuf(pushlist, poplist);
+
+	    pthread_mutex_lock(&this->lock);
+
+	    if (ringbuf_size[0] <= ringbuf_capacity[0]) {
+		this->ds_in_flight = false;
+		pthread_cond_broadcast(&this->cond_downsampling_done);
+		pthread_mutex_unlock(&this->lock);
+		return;
+	    }
+
+	    pthread_cond_broadcast(&this->cond_downsampling_done);
+	    pthread_mutex_unlock(&this->lock);
+	}
+    } catch (...) {
+	pthread_mutex_lock(&this->lock);
+	this->ds_error = std::current_exception();
+	this->ds_in_flight = false;
+	pthread_cond_broadcast(&this->cond_downsampling_done);
+	pthread_mutex_unlock(&this->lock);
     }
+}
 
-    assert(chunk_fpga_end > this->max_fpga_flushed);
-    this->max_fpga_flushed = chunk_fpga_end;
 
-    if (ini_params.emit_warning_on_buffer_drop && (num_assembled_chunks_dropped > 0))
-	cout << "ch_frb_io: warning: processing thread is running too slow, dropping assembled_chunk" << endl;
-    if (ini_params.throw_exception_on_buffer_drop && (num_assembled_chunks_dropped > 0))
-	throw runtime_error("ch_frb_io: assembled_chunk was dropped and stream was constructed with 'throw_exception_on_buffer_drop' flag");
+// If 'all' is true, waits until no downsampling task is in flight.  Otherwise, waits until level 0
+// of the ring buffer has a free slot.  In both cases, rethrows any exception thrown by a downsampling task.
 
-    // Note: when this function returns, stray references in poplist[*][*] are dropped, and assembled_chunk destructors get called.
-    return true;
+void assembled_chunk_ringbuf::_wait_for_downsampling(bool all)
+{
+    pthread_mutex_lock(&this->lock);
+
+    while (ds_in_flight && (all || (ringbuf_size[0] >= (int) ringbuf[0].size())))
+	pthread_cond_wait(&this->cond_downsampling_done, &this->lock);
+
+    std::exception_ptr err = this->ds_error;
+    pthread_mutex_unlock(&this->lock);
+
+    if (err)
+	std::rethrow_exception(err);
+}
+
+
+shared_ptr<ringbuf_state> assembled_chunk_ringbuf::_make_next_state(const vector<shared_ptr<assembled_chunk>> &pushlist,
+								    const vector<shared_ptr<assembled_chunk>> &poplist)
+{
+    // Called with the writer_lock held, so the current state can't change under our feet.
+    // Copying 'prev' only copies pointers to its levels, and we only rebuild the levels which change.
+    shared_ptr<const ringbuf_state> prev = std::atomic_load(&this->published_state);
+    shared_ptr<ringbuf_state> next = make_shared<ringbuf_state> (*prev);
+
+    for (int ids = 0; ids < num_downsampling_levels; ids++) {
+	int npop = 0;
+	if (poplist[2*ids]) npop++;
+	if (poplist[2*ids+1]) npop++;
+
+	if ((npop == 0) && !pushlist[ids])
+	    continue;
+
+	const ringbuf_state::chunk_list &prev_level = prev->level(ids);
+	shared_ptr<ringbuf_state::chunk_list> level = make_shared<ringbuf_state::chunk_list> ();
+
+	level->reserve(prev_level.size() - npop + 1);
+	level->insert(level->end(), prev_level.begin() + npop, prev_level.end());
+
+	if (pushlist[ids])
+	    level->push_back(pushlist[ids]);
+	if (ids == 0)
+	    next->pos0 += npop;
+
+	next->levels[ids] = level;
+    }
+
+    return next;
 }
 
 
 void assembled_chunk_ringbuf::_check_invariants()
 {
-    // It's OK to access the ringbuf_* fields read-only without acquiring the lock,
-    // since _check_invariants() is only called from the assembler thread.
+    // It's OK to access the ringbuf_* fields read-only without acquiring the lock, since
+    // _check_invariants() is only called from the assembler thread, and we hold the writer_lock
+    // (to exclude the downsampling task, if there is one).
     //
     // Some checks in this function are redundant with checks elsewhere, but that's OK!
 
+    unique_lock<std::mutex> wlock(this->writer_lock);
+
     ch_assert(num_downsampling_levels > 0);
     ch_assert(ringbuf_pos.size() == (unsigned) num_downsampling_levels);
     ch_assert(ringbuf_size.size() == (unsigned) num_downsampling_levels);
@@ -571,10 +1280,13 @@ void assembled_chunk_ringbuf::_check_invariants()
 	ch_assert(ringbuf_pos[ids] >= 0);
 	ch_assert(ringbuf_size[ids] >= 0);
 	ch_assert(ringbuf_capacity[ids] >= 2);
-	ch_assert(ringbuf_size[ids] <= ringbuf_capacity[ids]);
-	ch_assert(ringbuf[ids].size() == (unsigned) ringbuf_capacity[ids]);
 
-	for (int ipos = ringbuf_pos[ids]; ipos < ringbuf_pos[ids] + ringbuf_capacity[ids]; ipos++) {
+	// With async downsampling, level 0 can temporarily hold two chunks more than its nominal capacity.
+	int nslots = ringbuf_capacity[ids] + ((async_downsampling && (ids == 0)) ? 2 : 0);
+	ch_assert(ringbuf_size[ids] <= nslots);
+	ch_assert(ringbuf[ids].size() == (unsigned) nslots);
+
+	for (int ipos = ringbuf_pos[ids]; ipos < ringbuf_pos[ids] + nslots; ipos++) {
 	    shared_ptr<assembled_chunk> chunk = this->ringbuf_entry(ids, ipos);
 
 	    // These entries of the ring buffer should be empty.
@@ -586,11 +1298,11 @@ void assembled_chunk_ringbuf::_check_invariants()
 	    // Nonempty entries...
 	    ch_assert(chunk);
 	    ch_assert(chunk->beam_id == this->beam_id);
-	    ch_assert(chunk->nupfreq == this->ini_params.nupfreq);
+	    ch_assert(chunk->nupfreq == this->level_nupfreq[ids]);
 	    ch_assert(chunk->nt_per_packet == this->ini_params.nt_per_packet);
 	    ch_assert(chunk->fpga_counts_per_sample == this->ini_params.fpga_counts_per_sample);
 	    ch_assert(chunk->binning == (1 << ids));
-	    ch_assert(chunk->isample == chunk->ichunk * constants::nt_per_assembled_chunk);
+	    ch_assert(chunk->isample == chunk->ichunk * ini_params.nt_per_chunk);
 
 	    if ((ini_params.nrfifreq > 0) && (ids > 0))
 		ch_assert(chunk->has_rfi_mask);
@@ -612,24 +1324,50 @@ void assembled_chunk_ringbuf::_check_invariants()
 	    else
 		continue;   // Last chunk in buffer, there is no 'next'
 
+	    // Level 0 is always contiguous, but later levels can have gaps (see _prepare_downsampling()).
 	    ch_assert(next);
-	    ch_assert(next->ichunk == chunk->ichunk + chunk->binning);
+	    if (ids == 0)
+		ch_assert(next->ichunk == chunk->ichunk + chunk->binning);
+	    else
+		ch_assert(next->ichunk >= chunk->ichunk + chunk->binning);
 	}
     }
 
-    // We do need to acquire the lock to access 'downstream_pos', since it's modified
-    // by the downstream thread.
+    // We do need to acquire the lock to access 'downstream_pos' (and the named consumers),
+    // since they're modified by the downstream thread(s).
 
     pthread_mutex_lock(&lock);
     int dpos = this->downstream_pos;
+    vector<consumer_cursor> cursors;
+    for (const auto &kv: consumers)
+	cursors.push_back(kv.second);
     pthread_mutex_unlock(&lock);
 
+    for (const auto &c: cursors) {
+	ch_assert(c.pos >= ringbuf_pos[0]);
+	ch_assert(c.pos <= ringbuf_pos[0] + ringbuf_size[0]);
+	ch_assert(c.pos >= ringbuf_pos[0] + ringbuf_size[0] - c.bufsize);
+    }
+
     ch_assert(downstream_bufsize > 0);
     ch_assert(downstream_bufsize <= ringbuf_capacity[0]);
 
     ch_assert(dpos >= ringbuf_pos[0]);
     ch_assert(dpos <= ringbuf_pos[0] + ringbuf_size[0]);
     ch_assert(dpos >= ringbuf_pos[0] + ringbuf_size[0] - downstream_bufsize);
+
+    // Check that the published ringbuf_state agrees with the ring buffer.
+    shared_ptr<const ringbuf_state> state = std::atomic_load(&this->published_state);
+
+    ch_assert(state);
+    ch_assert(state->levels.size() == (unsigned) num_downsampling_levels);
+    ch_assert(state->pos0 == ringbuf_pos[0]);
+
+    for (int ids = 0; ids < num_downsampling_levels; ids++) {
+	ch_assert(state->level(ids).size() == (unsigned) ringbuf_size[ids]);
+	for (int n = 0; n < ringbuf_size[ids]; n++)
+	    ch_assert(state->level(ids)[n] == this->ringbuf_entry(ids, ringbuf_pos[ids] + n));
+    }
 }
 
 
@@ -680,6 +1418,149 @@ shared_ptr<assembled_chunk> assembled_chunk_ringbuf::get_assembled_chunk(bool wa
 }
 
 
+shared_ptr<assembled_chunk> assembled_chunk_ringbuf::get_assembled_chunk_at(uint64_t ichunk, bool &missing, int &nskipped)
+{
+    shared_ptr<assembled_chunk> chunk;
+    missing = false;
+    nskipped = 0;
+
+    pthread_mutex_lock(&this->lock);
+
+    int pos_end = ringbuf_pos[0] + ringbuf_size[0];
+
+    while (downstream_pos < pos_end) {
+	const shared_ptr<assembled_chunk> &c = this->ringbuf_entry(0, downstream_pos);
+
+	if (c->ichunk > ichunk) {
+	    missing = true;
+	    break;
+	}
+
+	downstream_pos++;
+
+	if (c->ichunk == ichunk) {
+	    chunk = c;
+	    break;
+	}
+
+	nskipped++;
+    }
+
+    if (!chunk && this->doneflag)
+	missing = true;
+
+    pthread_mutex_unlock(&this->lock);
+
+    if (chunk) {
+        assert(chunk->fpga_end > this->max_fpga_retrieved);
+        this->max_fpga_retrieved = chunk->fpga_end;
+    }
+
+    return chunk;
+}
+
+
+bool assembled_chunk_ringbuf::assembled_chunk_ready()
+{
+    pthread_mutex_lock(&this->lock);
+    bool ret = this->doneflag || (downstream_pos < ringbuf_pos[0] + ringbuf_size[0]);
+    pthread_mutex_unlock(&this->lock);
+    return ret;
+}
+
+
+void assembled_chunk_ringbuf::set_chunks_added_callback(const std::function<void()> &callback)
+{
+    this->chunks_added_callback = callback;
+}
+
+
+void assembled_chunk_ringbuf::add_consumer(const string &name, int bufsize)
+{
+    if (bufsize == 0)
+	bufsize = ini_params.assembled_ringbuf_capacity;
+
+    if ((bufsize < 0) || (bufsize > ringbuf_capacity[0]))
+	throw runtime_error("ch_frb_io: assembled_chunk_ringbuf::add_consumer(): bufsize must be <= " + to_string(ringbuf_capacity[0]));
+
+    pthread_mutex_lock(&this->lock);
+
+    if (consumers.count(name)) {
+	pthread_mutex_unlock(&this->lock);
+	throw runtime_error("ch_frb_io: assembled_chunk_ringbuf::add_consumer(): consumer '" + name + "' already exists");
+    }
+
+    consumer_cursor &c = consumers[name];
+    c.pos = ringbuf_pos[0] + ringbuf_size[0];
+    c.bufsize = bufsize;
+
+    pthread_mutex_unlock(&this->lock);
+}
+
+
+void assembled_chunk_ringbuf::remove_consumer(const string &name)
+{
+    pthread_mutex_lock(&this->lock);
+    consumers.erase(name);
+
+    // Wake up any thread waiting in get_consumer_chunk(name), so that it can throw an exception.
+    pthread_cond_broadcast(&this->cond_assembled_chunks_added);
+    pthread_mutex_unlock(&this->lock);
+}
+
+
+shared_ptr<assembled_chunk> assembled_chunk_ringbuf::get_consumer_chunk(const string &name, bool wait)
+{
+    shared_ptr<assembled_chunk> chunk;
+    pthread_mutex_lock(&this->lock);
+
+    for (;;) {
+	auto it = consumers.find(name);
+
+	if (it == consumers.end()) {
+	    pthread_mutex_unlock(&this->lock);
+	    throw runtime_error("ch_frb_io: assembled_chunk_ringbuf::get_consumer_chunk(): consumer '" + name + "' does not exist");
+	}
+
+	consumer_cursor &c = it->second;
+
+	if (c.pos < ringbuf_pos[0] + ringbuf_size[0]) {
+	    chunk = this->ringbuf_entry(0, c.pos);
+	    c.pos++;
+	    c.counts.nretrieved++;
+	    break;
+	}
+
+	if (!wait || this->doneflag)
+	    break;
+
+	pthread_cond_wait(&this->cond_assembled_chunks_added, &this->lock);
+    }
+
+    pthread_mutex_unlock(&this->lock);
+    return chunk;
+}
+
+
+assembled_chunk_ringbuf::consumer_counts assembled_chunk_ringbuf::get_consumer_counts(const string &name)
+{
+    pthread_mutex_lock(&this->lock);
+
+    auto it = consumers.find(name);
+
+    if (it == consumers.end()) {
+	pthread_mutex_unlock(&this->lock);
+	throw runtime_error("ch_frb_io: assembled_chunk_ringbuf::get_consumer_counts(): consumer '" + name + "' does not exist");
+    }
+
+    consumer_counts ret = it->second.counts;
+    ret.nready = ringbuf_pos[0] + ringbuf_size[0] - it->second.pos;
+
+    pthread_mutex_unlock(&this->lock);
+    return ret;
+}
+
+
 // Called by the assembler thread, when it exits.
 void assembled_chunk_ringbuf::end_stream(int64_t *event_counts)
 {
@@ -687,12 +1568,27 @@ void assembled_chunk_ringbuf::end_stream(int64_t *event_counts)
 	throw runtime_error("ch_frb_io: internal error: empty pointers in assembled_chunk_ringbuf::end_stream(), this can happen if end_stream() is called twice");
 
     // Local variable (will shortly assign to this->final_fpga, after acquiring lock).
-    uint64_t loc_final_fpga = (active_chunk0->ichunk + 2) * uint64_t(constants::nt_per_assembled_chunk * active_chunk0->fpga_counts_per_sample);
+    uint64_t loc_final_fpga = (active_chunk0->ichunk + 2) * uint64_t(ini_params.nt_per_chunk * active_chunk0->fpga_counts_per_sample);
+
+    // Deliver remaining slices of the active chunks (sub-chunk delivery only).
+    if (subchunks_per_chunk > 0)
+	this->_put_subchunks((active_chunk0->ichunk + 2) * subchunks_per_chunk);
 
     // After these calls, 'active_chunk0' and 'active_chunk1' will be reset to null pointers.
     this->_put_assembled_chunk(active_chunk0, event_counts);
     this->_put_assembled_chunk(active_chunk1, event_counts);
 
+    // Let any downsampling task run to completion, before marking the stream done.
+    if (async_downsampling)
+	this->_wait_for_downsampling(true);
+
+    unique_lock<std::mutex> wlock(this->writer_lock);
+
+    // Final ringbuf_state, to be published below.
+    shared_ptr<ringbuf_state> next_state = make_shared<ringbuf_state> (*std::atomic_load(&this->published_state));
+    next_state->doneflag = true;
+    next_state->final_fpga = loc_final_fpga;
+
     pthread_mutex_lock(&this->lock);
 
     if (doneflag) {
@@ -702,40 +1598,145 @@ void assembled_chunk_ringbuf::end_stream(int64_t *event_counts)
 
     // Wake up processing thread, if it is waiting for data
     pthread_cond_broadcast(&this->cond_assembled_chunks_added);
+    pthread_cond_broadcast(&this->cond_subchunks_added);
 
     // With lock held
     this->doneflag = true;
     this->final_fpga = loc_final_fpga;
+
+    shared_ptr<const ringbuf_state> prev_state = std::atomic_exchange(&this->published_state, shared_ptr<const ringbuf_state> (next_state));
     
     pthread_mutex_unlock(&this->lock);
+    wlock.unlock();
+
+    if (chunks_added_callback)
+	chunks_added_callback();
 }
 
 
-std::unique_ptr<assembled_chunk> assembled_chunk_ringbuf::_make_assembled_chunk(uint64_t ichunk, int binning, bool zero)
+std::unique_ptr<assembled_chunk> assembled_chunk_ringbuf::_make_assembled_chunk(uint64_t ichunk, int binning, bool zero, int nupfreq, alloc_mode mode)
 {
     struct assembled_chunk::initializer chunk_params;
 
+    if (nupfreq <= 0) {
+	int ids = 0;
+	while ((ids < num_downsampling_levels-1) && ((1 << ids) < binning))
+	    ids++;
+	nupfreq = this->level_nupfreq[ids];
+    }
+
     chunk_params.beam_id = this->beam_id;
-    chunk_params.nupfreq = this->ini_params.nupfreq;
+    chunk_params.nupfreq = nupfreq;
     chunk_params.nrfifreq = this->ini_params.nrfifreq;
     chunk_params.nt_per_packet = this->ini_params.nt_per_packet;
+    chunk_params.nt_per_chunk = this->ini_params.nt_per_chunk;
+    chunk_params.freq_map = this->freq_map;
     chunk_params.fpga_counts_per_sample = this->ini_params.fpga_counts_per_sample;
     chunk_params.frame0_nano = this->frame0_nano;
     chunk_params.force_reference = this->ini_params.force_reference_kernels;
-    chunk_params.force_fast = this->ini_params.force_fast_kernels;
+    // Note: 'force_fast_kernels' only applies to levels where fast kernels exist (nupfreq even).
+    chunk_params.force_fast = this->ini_params.force_fast_kernels && (nupfreq % 2 == 0);
     chunk_params.stream_id = this->stream_id;
     chunk_params.binning = binning;
     chunk_params.ichunk = ichunk;
 
-    if (ini_params.memory_pool) {
-	chunk_params.pool = ini_params.memory_pool;
-	chunk_params.slab = ini_params.memory_pool->get_slab(zero);
+    // Allocate from the pool with the smallest slabs that fit, falling back to larger slabs.
+    // If no pools were specified, or no slab is available, the assembled_chunk allocates its own memory.
+
+    ssize_t nbytes = assembled_chunk::get_memory_slab_size(nupfreq, ini_params.nt_per_packet, ini_params.nrfifreq, ini_params.nt_per_chunk, nfreq_coarse);
+
+    if ((mode != alloc_heap) && memory_pools.size()) {
+	for (unsigned int i = 0; i < memory_pools.size(); i++) {
+	    const shared_ptr<memory_slab_pool> &p = memory_pools[i];
+	    if (p->nbytes_per_slab < nbytes)
+		continue;
+
+	    chunk_params.slab = p->get_slab(zero, false, numa_node, pool_clients[i], nbytes);
+
+	    if (chunk_params.slab) {
+		chunk_params.pool = p;
+		break;
+	    }
+	}
+
+	// No slab was available, or a quota or reservation refused the request.  The pools have asked the ring
+	// buffers to evict chunks early (see 'reclaim_request'), and until this frees slabs, we allocate on the
+	// heap.  Temporary chunks are not counted.  Otherwise, the heap memory is reserved in 'fallback_nbytes'
+	// (up to 'max_fallback_nbytes', except for active chunks, which are never refused), and released by the
+	// assembled_chunk when it is freed.
 
-	if (!chunk_params.slab)
-	    throw runtime_error("**** Too much memory pressure for this poor L1 node to survive!  Blowing up now... ****");
+	if (!chunk_params.slab && (mode != alloc_temporary)) {
+	    if (!_reserve_fallback(nbytes, mode == alloc_active))
+		return unique_ptr<assembled_chunk> ();
+
+	    chunk_params.heap_nbytes = this->fallback_nbytes;
+	    this->num_pool_fallbacks++;
+	}
+    }
+
+    try {
+	return assembled_chunk::make(chunk_params);
+    } catch (...) {
+	if (chunk_params.heap_nbytes)
+	    *fallback_nbytes -= nbytes;
+	throw;
+    }
+}
+
+
+// Atomically reserves 'nbytes' of heap memory in 'fallback_nbytes' (which is shared between the assembler
+// thread and the downsampling task).  Returns false if this would exceed 'max_fallback_nbytes', unless 'force'
+// is true.
+bool assembled_chunk_ringbuf::_reserve_fallback(ssize_t nbytes, bool force)
+{
+    if (force) {
+	*fallback_nbytes += nbytes;
+	return true;
     }
 
-    return assembled_chunk::make(chunk_params);
+    int64_t n = fallback_nbytes->load();
+
+    do {
+	if (n + nbytes > max_fallback_nbytes)
+	    return false;
+    } while (!fallback_nbytes->compare_exchange_weak(n, n + nbytes));
+
+    return true;
+}
+
+
+// Called by _prepare_downsampling(), when a chunk is dropped from the last level of the ring buffer.
+// The chunk is written (and decompressed if necessary) by the spill file's writer thread, so that disk
+// latency doesn't stall the assembler.  If the writer has fallen behind, the chunk is dropped (and counted
+// in chunk_spill_file::get_num_dropped()).
+void assembled_chunk_ringbuf::_spill(const shared_ptr<assembled_chunk> &chunk)
+{
+    ini_params.spill_file->enqueue_chunk(chunk);
+}
+
+
+// Reads a chunk from the spill file into a newly allocated chunk.  Called from RPC threads, so the chunk is
+// allocated on the heap, rather than competing with the assembler for pool slabs.  Returns an empty pointer
+// if the chunk was overwritten in the spill file during the read.
+shared_ptr<assembled_chunk> assembled_chunk_ringbuf::_read_spilled(const chunk_spill_file::record &rec)
+{
+    shared_ptr<assembled_chunk> chunk = _make_assembled_chunk(rec.ichunk, rec.binning, false, rec.nupfreq, alloc_heap);
+
+    if (!ini_params.spill_file->read_chunk(rec, chunk.get()))
+	return shared_ptr<assembled_chunk> ();
+
+    return chunk;
+}
+
+
+shared_ptr<assembled_chunk> assembled_chunk_ringbuf::_decompressed(const shared_ptr<assembled_chunk> &chunk)
+{
+    if (!chunk || !chunk->is_compressed())
+	return chunk;
+
+    shared_ptr<assembled_chunk> ret = _make_assembled_chunk(chunk->ichunk, chunk->binning, false, chunk->nupfreq, alloc_temporary);
+    chunk->decompress(ret.get());
+    return ret;
 }
 
 
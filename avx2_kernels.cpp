@@ -59,6 +59,11 @@ void fast_assembled_chunk::downsample(const assembled_chunk *src1, const assembl
     throw runtime_error("ch_frb_io: internal error: fast_assembled_chunk::downsample() called on a non-AVX2 machine");
 }
 
+void fast_assembled_chunk::downsample_freq(const assembled_chunk *src)
+{
+    throw runtime_error("ch_frb_io: internal error: fast_assembled_chunk::downsample_freq() called on a non-AVX2 machine");
+}
+
 void test_avx2_kernels(std::mt19937 &rng)
 {
     cerr << "test_avx2_kernels(): this machine does not have the AVX2 instruction set, nothing to do\n";
@@ -247,14 +252,12 @@ template<> inline __m256 incremental_upsample8::get<7>() { return _mm256_permute
 //
 // Just copies src -> dst, where both 'src' and 'dst' are logical 2D arrays of shape (nupfreq, 16).
 // The src array has frequency stride 16, as appropriate for a "close-packed" array.
-// The dst array has frequency stride nt_per_assembled_chunk, as appopriate for an assembled_chunk subarray.
+// The dst array has frequency stride 's' (=nt_per_chunk), as appopriate for an assembled_chunk subarray.
 // The kernel assumes nt_per_packet=16, and nupfreq is even.
 
 
-inline void _add_packet_kernel(uint8_t *dst, const uint8_t *src, int nupfreq)
+inline void _add_packet_kernel(uint8_t *dst, const uint8_t *src, int nupfreq, int s)
 {
-    constexpr int s = constants::nt_per_assembled_chunk;
-
     for (int i = 0; i < nupfreq; i += 2) {
 	__m256i x = _mm256_loadu_si256((const __m256i *) (src + 16*i));
 	__m128i x0 = _mm256_extractf128_si256(x, 0);
@@ -360,11 +363,10 @@ struct decoder {
 	decode32<3> (intensity+96, weights+96, data+96, sca, off);
     }
 
-    inline void decode_row(float *intensity, float *weights, const uint8_t *data, const float *scales, const float *offsets, float prescale)
+    // Assumes nt is divisible by 128.
+    inline void decode_row(float *intensity, float *weights, const uint8_t *data, const float *scales, const float *offsets, float prescale, int nt)
     {
-	static_assert(constants::nt_per_assembled_chunk % 128 == 0, "_decode_kernel() assumes nt_per_assembled_chunk divisible by 128");
-
-	constexpr int n = constants::nt_per_assembled_chunk / 128;
+	int n = nt / 128;
 	
 	for (int i = 0; i < n; i++)
 	    decode128(intensity + i*128, weights + i*128, data + i*128, scales + i*8, offsets + i*8, prescale);
@@ -588,7 +590,7 @@ inline void _ds_kernel1b(float *out_data, int *out_mask, const uint8_t *in_data,
 
 
 // Fast decode kernel.
-// Assumes nt (=nt_per_assembled_chunk) is a multiple of 256.
+// Assumes nt (=nt_per_chunk) is a multiple of 256.
 // Assumes nt_per_packet = 16.
 //
 // Reads (nupfreq, nt) input data values (uint8).
@@ -835,8 +837,8 @@ inline void _ds_kernel3(uint8_t *out, const float *data, const int *mask, const
 
 // Kernel for downsampling RFI mask.
 // Reads 'nbits_in' bits (not bytes!), writes (nbits_in/2) bits.
-// Assumes nbits_in is a multiple of 512.
-// Note that in the serer, nbits_in will equal nt_per_assembled_chunk.
+// Assumes nbits_in is a multiple of 256 (multiples of 512 take the vectorized path only).
+// Note that in the serer, nbits_in will equal nt_per_chunk.
 
 inline void _ds_kernel_rfimask(uint8_t *dst, const uint8_t *src, int nbits_in)
 {
@@ -892,6 +894,121 @@ inline void _ds_kernel_rfimask(uint8_t *dst, const uint8_t *src, int nbits_in)
 
 	_mm256_storeu_si256((__m256i *) (dst + 32*i), z);
     }
+
+    // Scalar tail, if nbits_in is not a multiple of 512 (e.g. nt_per_chunk=256).
+    for (int i = (nbits_in/512)*256; i < nbits_in/2; i += 8) {
+	uint8_t x = src[i/4];
+	uint8_t y = src[i/4 + 1];
+	uint8_t z = 0;
+
+	for (int b = 0; b < 4; b++) {
+	    if (((x >> (2*b)) & 3) == 3)
+		z |= (1 << b);
+	    if (((y >> (2*b)) & 3) == 3)
+		z |= (1 << (b+4));
+	}
+
+	dst[i/8] = z;
+    }
+}
+
+
+// Kernel for frequency downsampling (fast version of ds_slow_kernel_freq()).
+// Reads (nrows_out * fbinning, nt) bytes, writes (nrows_out, nt) bytes.
+// Assumes nt is a multiple of 32, and fbinning is a power of two <= 256.
+
+inline void _ds_freq_kernel(uint8_t *out, const uint8_t *in, int nrows_out, int fbinning, int nt)
+{
+    int log2_fb = 0;
+    while ((1 << log2_fb) < fbinning)
+	log2_fb++;
+
+    __m128i shift = _mm_cvtsi32_si128(log2_fb);
+    __m256i round = _mm256_set1_epi16(fbinning / 2);
+    __m256i zero = _mm256_setzero_si256();
+    __m256i ones = _mm256_set1_epi8(-1);
+
+    for (int i = 0; i < nrows_out; i++) {
+	const uint8_t *in_row = in + i * fbinning * nt;
+	uint8_t *out_row = out + i * nt;
+
+	for (int j = 0; j < nt; j += 32) {
+	    __m256i mask = zero;
+	    __m256i lo = round;   // 16-bit sums of bytes 0-15
+	    __m256i hi = round;   // 16-bit sums of bytes 16-31
+
+	    for (int k = 0; k < fbinning; k++) {
+		__m256i x = _mm256_loadu_si256((const __m256i *) (in_row + k*nt + j));
+		mask = _mm256_or_si256(mask, _mm256_cmpeq_epi8(x, zero));
+		mask = _mm256_or_si256(mask, _mm256_cmpeq_epi8(x, ones));
+		lo = _mm256_add_epi16(lo, _mm256_cvtepu8_epi16(_mm256_extracti128_si256(x, 0)));
+		hi = _mm256_add_epi16(hi, _mm256_cvtepu8_epi16(_mm256_extracti128_si256(x, 1)));
+	    }
+
+	    lo = _mm256_srl_epi16(lo, shift);
+	    hi = _mm256_srl_epi16(hi, shift);
+
+	    // packus_epi16 interleaves 128-bit lanes, permute4x64 puts them back in order.
+	    __m256i y = _mm256_packus_epi16(lo, hi);
+	    y = _mm256_permute4x64_epi64(y, 0xd8);
+	    y = _mm256_andnot_si256(mask, y);
+
+	    _mm256_storeu_si256((__m256i *) (out_row + j), y);
+	}
+    }
+}
+
+
+// -------------------------------------------------------------------------------------------------
+//
+// Chunk-length dispatch.
+//
+// The chunk length (nt_per_chunk) is a runtime parameter, but the add_packet and decode loops are
+// specialized for common power-of-two values, so that the compiler sees a constant row stride.
+// The template argument NT is either the chunk length, or zero for the generic (runtime) version.
+
+
+template<int NT>
+inline void _fast_add_packet(uint8_t *data, float *scales, float *offsets, const intensity_packet &packet, uint64_t t0, int nupfreq, int nt_coarse, int nt_per_chunk, const int *local_index)
+{
+    const int nt = NT ? NT : nt_per_chunk;
+
+    for (int f = 0; f < packet.nfreq_coarse; f++) {
+	// If 'local_index' is non-null, the chunk stores a subset of coarse channels (see class coarse_freq_map).
+	int ic = local_index ? local_index[packet.coarse_freq_ids[f]] : packet.coarse_freq_ids[f];
+	if (ic < 0)
+	    continue;
+
+	int d = ic*nt_coarse + (t0/16);
+	scales[d] = packet.scales[f];
+	offsets[d] = packet.offsets[f];
+
+	uint8_t *dst = data + ic * nupfreq * nt + t0;
+	const uint8_t *src = packet.data + f * nupfreq * 16;
+
+	_add_packet_kernel(dst, src, nupfreq, nt);
+    }
+}
+
+
+template<int NT>
+inline void _fast_decode(float *intensity, float *weights, int istride, int wstride, float prescale, const uint8_t *data, const float *scales, const float *offsets, int nfreq_coarse, int nupfreq, int nt_coarse, int nt_per_chunk)
+{
+    const int nt = NT ? NT : nt_per_chunk;
+    decoder d;
+
+    for (int if_coarse = 0; if_coarse < nfreq_coarse; if_coarse++) {
+	const float *scales_f = scales + if_coarse * nt_coarse;
+	const float *offsets_f = offsets + if_coarse * nt_coarse;
+	
+	for (int if_fine = if_coarse*nupfreq; if_fine < (if_coarse+1)*nupfreq; if_fine++) {
+	    const uint8_t *src_f = data + if_fine * nt;
+	    float *int_f = intensity + if_fine * istride;
+	    float *wt_f = weights + if_fine * wstride;
+
+	    d.decode_row(int_f, wt_f, src_f, scales_f, offsets_f, prescale, nt);
+	}
+    }    
 }
 
 
@@ -907,8 +1024,8 @@ fast_assembled_chunk::fast_assembled_chunk(const assembled_chunk::initializer &i
 	throw runtime_error("ch_frb_io: fast kernels are only implemented for nt_per_packet=16, you need to either ensure that this is satisfied, or use slow kernels");
     if (nupfreq % 2 != 0)
 	throw runtime_error("ch_frb_io: fast kernels are only implemented for nfreq divisible by 2048, you need to either ensure that this is satisfied, or use slow kernels");
-    if (constants::nt_per_assembled_chunk % 256 != 0)
-	throw runtime_error("ch_frb_io: internal error: constants::nt_per_assembled not divisible by 256 (assumed in fast downsampling kernel)");
+    if (nt_per_chunk % 256 != 0)
+	throw runtime_error("ch_frb_io: fast kernels are only implemented for nt_per_chunk divisible by 256, you need to either ensure that this is satisfied, or use slow kernels");
 }
 
 
@@ -923,18 +1040,15 @@ void fast_assembled_chunk::add_packet(const intensity_packet &packet)
 {
     // Offset relative to beginning of packet
     uint64_t t0 = packet.fpga_count / uint64_t(fpga_counts_per_sample) - isample;
-
-    for (int f = 0; f < packet.nfreq_coarse; f++) {
-	int coarse_freq_id = packet.coarse_freq_ids[f];
-
-	int d = coarse_freq_id*nt_coarse + (t0/nt_per_packet);
-	this->scales[d] = packet.scales[f];
-	this->offsets[d] = packet.offsets[f];
-
-	uint8_t *dst = data + coarse_freq_id * nupfreq * constants::nt_per_assembled_chunk + t0;
-	const uint8_t *src = packet.data + f * nupfreq * 16;
-
-	_add_packet_kernel(dst, src, nupfreq);
+    const int *li = freq_map ? &freq_map->local_index[0] : nullptr;
+
+    switch (nt_per_chunk) {
+    case 256:  _fast_add_packet<256> (data, scales, offsets, packet, t0, nupfreq, nt_coarse, nt_per_chunk, li); break;
+    case 512:  _fast_add_packet<512> (data, scales, offsets, packet, t0, nupfreq, nt_coarse, nt_per_chunk, li); break;
+    case 1024: _fast_add_packet<1024> (data, scales, offsets, packet, t0, nupfreq, nt_coarse, nt_per_chunk, li); break;
+    case 2048: _fast_add_packet<2048> (data, scales, offsets, packet, t0, nupfreq, nt_coarse, nt_per_chunk, li); break;
+    case 4096: _fast_add_packet<4096> (data, scales, offsets, packet, t0, nupfreq, nt_coarse, nt_per_chunk, li); break;
+    default:   _fast_add_packet<0> (data, scales, offsets, packet, t0, nupfreq, nt_coarse, nt_per_chunk, li); break;
     }
 }
 
@@ -944,25 +1058,24 @@ void fast_assembled_chunk::decode(float *intensity, float *weights, int istride,
 {
     if (!intensity || !weights)
 	throw runtime_error("ch_frb_io: null pointer passed to fast_assembled_chunk::decode()");
-    if (istride < constants::nt_per_assembled_chunk)
+    if (istride < nt_per_chunk)
 	throw runtime_error("ch_frb_io: bad istride passed to fast_assembled_chunk::decode()");
-    if (wstride < constants::nt_per_assembled_chunk)
+    if (wstride < nt_per_chunk)
 	throw runtime_error("ch_frb_io: bad wstride passed to fast_assembled_chunk::decode()");
 
-    decoder d;
-
-    for (int if_coarse = 0; if_coarse < constants::nfreq_coarse_tot; if_coarse++) {
-	const float *scales_f = this->scales + if_coarse * nt_coarse;
-	const float *offsets_f = this->offsets + if_coarse * nt_coarse;
-	
-	for (int if_fine = if_coarse*nupfreq; if_fine < (if_coarse+1)*nupfreq; if_fine++) {
-	    const uint8_t *src_f = this->data + if_fine * constants::nt_per_assembled_chunk;
-	    float *int_f = intensity + if_fine * istride;
-	    float *wt_f = weights + if_fine * wstride;
+    if (this->is_compressed()) {
+	this->make_decompressed()->decode(intensity, weights, istride, wstride, prescale);
+	return;
+    }
 
-	    d.decode_row(int_f, wt_f, src_f, scales_f, offsets_f, prescale);
-	}
-    }    
+    switch (nt_per_chunk) {
+    case 256:  _fast_decode<256> (intensity, weights, istride, wstride, prescale, data, scales, offsets, nfreq_coarse, nupfreq, nt_coarse, nt_per_chunk); break;
+    case 512:  _fast_decode<512> (intensity, weights, istride, wstride, prescale, data, scales, offsets, nfreq_coarse, nupfreq, nt_coarse, nt_per_chunk); break;
+    case 1024: _fast_decode<1024> (intensity, weights, istride, wstride, prescale, data, scales, offsets, nfreq_coarse, nupfreq, nt_coarse, nt_per_chunk); break;
+    case 2048: _fast_decode<2048> (intensity, weights, istride, wstride, prescale, data, scales, offsets, nfreq_coarse, nupfreq, nt_coarse, nt_per_chunk); break;
+    case 4096: _fast_decode<4096> (intensity, weights, istride, wstride, prescale, data, scales, offsets, nfreq_coarse, nupfreq, nt_coarse, nt_per_chunk); break;
+    default:   _fast_decode<0> (intensity, weights, istride, wstride, prescale, data, scales, offsets, nfreq_coarse, nupfreq, nt_coarse, nt_per_chunk); break;
+    }
 }
 
 
@@ -971,10 +1084,15 @@ void fast_assembled_chunk::downsample(const assembled_chunk *src1, const assembl
 {
     this->_check_downsample(src1, src2);
 
-    int nfreq_c = constants::nfreq_coarse_tot;
-    int nt_f = constants::nt_per_assembled_chunk;
+    int nfreq_c = nfreq_coarse;
+    int nt_f = nt_per_chunk;
     int nt_c = nt_f / nt_per_packet;
 
+    downsampling_workspace ws = get_downsampling_workspace(nupfreq, nt_f, nt_c);
+    float *ds_data = ws.ds_data;
+    int *ds_mask = ws.ds_mask;
+    float *ds_w2 = ws.ds_w2;
+
     for (int ifreq_c = 0; ifreq_c < nfreq_c; ifreq_c++) {
 	int ifreq_f = ifreq_c * nupfreq;
 
@@ -1028,6 +1146,24 @@ void fast_assembled_chunk::downsample(const assembled_chunk *src1, const assembl
 }
 
 
+// Virtual override.
+void fast_assembled_chunk::downsample_freq(const assembled_chunk *src)
+{
+    this->_check_downsample_freq(src);
+
+    int fbinning = src->nupfreq / this->nupfreq;
+    int nrows_out = nfreq_coarse * this->nupfreq;
+
+    // Note: nt_per_chunk is a multiple of 256 (checked in constructor).
+    if ((fbinning & (fbinning-1)) || (fbinning > 256))
+	ds_slow_kernel_freq(this->data, src->data, nrows_out, fbinning, nt_per_chunk);
+    else
+	_ds_freq_kernel(this->data, src->data, nrows_out, fbinning, nt_per_chunk);
+
+    this->_copy_freq_downsampled_metadata(src);
+}
+
+
 // -------------------------------------------------------------------------------------------------
 //
 // Unit testing
@@ -1323,6 +1459,52 @@ static void test_avx2_ds_kernel3(std::mt19937 &rng)
 }
 
 
+static void test_avx2_ds_freq_kernel(std::mt19937 &rng, int nrows_out, int fbinning, int nt)
+{
+    int nin = nrows_out * fbinning * nt;
+    int nout = nrows_out * nt;
+
+    unique_ptr<uint8_t[]> in(new uint8_t[nin]);
+    unique_ptr<uint8_t[]> out_slow(new uint8_t[nout]);
+    unique_ptr<uint8_t[]> out_fast(new uint8_t[nout]);
+
+    // Bias toward extreme values, so that masking and 16-bit overflow are exercised.
+    for (int i = 0; i < nin; i++) {
+	int r = randint(rng, 0, 100);
+	in[i] = (r < 2) ? 0x00 : ((r < 4) ? 0xff : ((r < 20) ? 0xfe : randint(rng, 0, 256)));
+    }
+
+    ds_slow_kernel_freq(out_slow.get(), in.get(), nrows_out, fbinning, nt);
+    _ds_freq_kernel(out_fast.get(), in.get(), nrows_out, fbinning, nt);
+
+    for (int i = 0; i < nout; i++) {
+	if (out_slow[i] != out_fast[i]) {
+	    cerr << "test_avx2_ds_freq_kernel failed: (nrows_out,fbinning,nt)=(" << nrows_out << "," << fbinning << "," << nt << "),"
+		 << " i=" << i << ", (slow,fast)=(" << int(out_slow[i]) << "," << int(out_fast[i]) << ")\n";
+	    throw runtime_error("test_avx2_ds_freq_kernel() failed");
+	}
+    }
+}
+
+
+static void test_avx2_ds_freq_kernel(std::mt19937 &rng)
+{
+    cout << "test_avx2_ds_freq_kernel..";
+
+    for (int iouter = 0; iouter < 1000; iouter++) {
+	if (iouter % 10 == 0)
+	    cout << "." << flush;
+
+	int nrows_out = randint(rng, 1, 9);
+	int fbinning = 1 << randint(rng, 0, 9);
+	int nt = 32 * randint(rng, 1, 9);
+	test_avx2_ds_freq_kernel(rng, nrows_out, fbinning, nt);
+    }
+
+    cout << "success" << endl;
+}
+
+
 // Helper function for test_avx2_kernels(), see below for usage.
 inline bool data8_almost_equal(uint8_t x, uint8_t y)
 {
@@ -1339,6 +1521,7 @@ void test_avx2_kernels(std::mt19937 &rng)
     test_avx2_ds_kernel1(rng);
     test_avx2_ds_kernel2(rng);
     test_avx2_ds_kernel3(rng);
+    test_avx2_ds_freq_kernel(rng);
 
     cerr << "test_avx2_kernels()";
 
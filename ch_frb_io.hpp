@@ -6,6 +6,7 @@
 #endif
 
 #include <queue>
+#include <deque>
 #include <string>
 #include <vector>
 #include <map>
@@ -20,6 +21,7 @@
 #include <iostream>
 #include <mutex>
 #include <condition_variable>
+#include <exception>
 
 #include <hdf5.h>
 
@@ -41,7 +43,12 @@ struct noncopyable
 
 // Defined later in this file
 class assembled_chunk;
+struct assembled_subchunk;
+struct coarse_freq_map;
 class memory_slab_pool;
+class memory_slab_budget;
+class downsampling_thread_pool;
+class chunk_spill_file;
 class output_device;
 
 // Defined in ch_frb_io_internals.hpp
@@ -60,8 +67,21 @@ struct uptr_deleter {
 };
 template<typename T>
 using uptr = std::unique_ptr<T[], uptr_deleter>;
-// And we use it for blocks of memory used for assembled_chunks.
-typedef uptr<uint8_t> memory_slab_t;
+
+// Blocks of memory used for assembled_chunks are either allocated by malloc()-like calls
+// (mmap_nbytes == 0), or mapped by huge_page_alloc() (see below) and unmapped by munmap().
+// The deleter also records the NUMA node the memory was allocated on (or -1), and the pool client
+// it was handed out to (or -1), which are used by memory_slab_pool::put_slab().
+struct memory_slab_deleter {
+    size_t mmap_nbytes = 0;
+    int numa_node = -1;
+    int client = -1;
+
+    memory_slab_deleter() { }
+    memory_slab_deleter(size_t mmap_nbytes_) : mmap_nbytes(mmap_nbytes_) { }
+    void operator()(uint8_t *p) const;
+};
+typedef std::unique_ptr<uint8_t[], memory_slab_deleter> memory_slab_t;
 
 // -------------------------------------------------------------------------------------------------
 //
@@ -97,7 +117,9 @@ namespace constants {
     // intensity_network_ostream::send_chunk().
     static constexpr int output_ringbuf_capacity = 8;
 
+    // Default chunk length.  Streams can override it (see intensity_network_stream::initializer::nt_per_chunk).
     static constexpr int nt_per_assembled_chunk = 1024;
+    static constexpr int max_allowed_nt_per_chunk = 16384;
 
     // These parameters don't really affect anything but appear in asserts.
     static constexpr int max_input_udp_packet_size = 9000;   // largest value the input stream will accept
@@ -107,6 +129,11 @@ namespace constants {
     static constexpr int max_allowed_nt_per_packet = 1024;
     static constexpr int max_allowed_fpga_counts_per_sample = 3200;
     static constexpr double max_allowed_output_gbps = 10.0;
+
+    // Limits on the telescoping ring buffer.  The binning (2^level) of an assembled_chunk must fit
+    // in an int, and each level needs its own bit in the l1_ringbuf_level bitmask (see below).
+    static constexpr int max_telescoping_levels = 31;
+    static constexpr int max_allowed_binning = 1 << (max_telescoping_levels - 1);
 };
 
 
@@ -332,6 +359,10 @@ public:
 	int fpga_counts_per_sample = 384;
 	int stream_id = 0;   // only used in assembled_chunk::format_filename().
 
+	// Number of time samples per assembled_chunk.  Must be a power of two, and a multiple of
+	// nt_per_packet.  (The fast AVX2 kernels are used if it is also a multiple of 256.)
+	int nt_per_chunk = constants::nt_per_assembled_chunk;
+
 	// If 'nt_align' is set to a nonzero value, then the time sample index of the first
 	// assembled_chunk in the stream must be a multiple of nt_align.  This is used in the
 	// real-time server, to align all beams to the RFI and dedispersion block sizes.  Note
@@ -339,6 +370,12 @@ public:
 	// treated as assembler misses.
 	int nt_align = 0;
 
+	// If 'coarse_freq_ids' is nonempty, then the stream only assembles this subset of the coarse
+	// frequency channels (a strictly increasing list of ids in [0,nfreq_coarse_tot)), and the
+	// assembled_chunks are sized accordingly (see assembled_chunk::nfreq_coarse).  Data for other
+	// coarse channels is dropped by assembled_chunk::add_packet().
+	std::vector<int> coarse_freq_ids;
+
 	// If 'frame0_url' is a nonempty string, then assembler thread will retrieve frame0 info by "curling" the URL.
         std::string frame0_url = "";
         int frame0_timeout = 3000;
@@ -383,6 +420,11 @@ public:
 	int max_unassembled_nbytes_per_list = 8 * 1024 * 1024;
 	int unassembled_ringbuf_timeout_usec = 250000;   // 0.25 sec
 
+	// If nonzero, the packet buffers in the 'unassembled_ringbuf' are backed by huge pages of this
+	// size (see huge_page_alloc()).  Huge pages for the assembled_chunks themselves are configured in
+	// the memory_slab_pool (see memory_slab_pool::initializer::huge_page_size).
+	ssize_t huge_page_size = 0;
+
 	// The 'assembled_ringbuf' is between the assembler thread and processing threads.
 	int assembled_ringbuf_capacity = 8;
 
@@ -391,6 +433,70 @@ public:
 	// and whose elements are the number of assembled_chunks at each level.
         std::vector<int> telescoping_ringbuf_capacity;
 
+	// Optional frequency downsampling in the telescoping ring buffer.  If nonempty, this vector has
+	// the same length as telescoping_ringbuf_capacity, and telescoping_freq_binning[i] is the factor
+	// by which 'nupfreq' is reduced in level i.  The first element must be 1 (level 0 is also the
+	// "downstream" buffer), and each element must be a multiple of the previous one, and divide nupfreq.
+	std::vector<int> telescoping_freq_binning;
+
+	// Additional memory_slab_pools, typically with smaller slabs for frequency-downsampled chunks.
+	// Each assembled_chunk is allocated from the pool with the smallest slabs that are large enough,
+	// falling back to pools with larger slabs if it is empty.
+	std::vector<std::shared_ptr<memory_slab_pool>> small_memory_pools;
+
+	// Memory pressure handling (see memory_slab_pool::add_client()).  Each beam is a client of each
+	// memory_slab_pool, and the beams of a stream are grouped by stream_id.  Reservations guarantee
+	// a number of slabs in each pool which other streams (or beams) can't take, and quotas (if nonzero)
+	// cap the number of slabs in use.  Under pressure, the pool asks beams which are over their
+	// reservation to evict the oldest chunks from the last level of the telescoping ring buffer early.
+	//
+	// If no slab can be obtained (or a quota or reservation refuses the request), the assembled_chunk is
+	// allocated on the heap instead, to bridge the gap until the evictions free slabs.  Each beam can hold
+	// at most 'max_pool_fallbacks' full-size chunks of heap memory this way (see memory_accounting::fallback_nbytes).
+	// Beyond that, chunks which would be downsampled into later levels of the telescoping ring buffer are
+	// dropped instead, and counted in the "memory_pool_drops" statistic (leaving a gap in time).  Chunks being
+	// assembled from packets are never refused, so that memory pressure never stops the assembler.
+	ssize_t memory_pool_reserved_slabs_per_beam = 0;
+	ssize_t memory_pool_quota_per_beam = 0;
+	ssize_t memory_pool_reserved_slabs_per_stream = 0;
+	ssize_t memory_pool_quota_per_stream = 0;
+	int max_pool_fallbacks = 4;
+
+	// If nonzero, then chunks in levels >= telescoping_compression_level of the telescoping ring
+	// buffer are stored bitshuffle/LZ4-compressed.  find_assembled_chunk() and visit_ringbuf() return
+	// decompressed copies (one at a time), whereas get_ringbuf_snapshots() returns the compressed
+	// chunks themselves (see assembled_chunk::make_decompressed()).  Level 0 is never compressed.
+	int telescoping_compression_level = 0;
+
+	// If nonzero, then chunks in levels >= telescoping_requantize_level are stored with 4 bits per
+	// sample (with scales and offsets adjusted to match), and expanded back to 8 bits when retrieved.
+	// This can be combined with telescoping_compression_level.  Level 0 is never requantized.
+	int telescoping_requantize_level = 0;
+
+	// If 'spill_file' is non-null, then chunks which are dropped from the last level of the telescoping
+	// ring buffer are written to it, and find_assembled_chunk() will also return chunks from the spill
+	// file.  Range queries (get_ringbuf_snapshots() and visit_ringbuf()) only return spilled chunks if
+	// both ends of the range are specified (nonzero), since an unbounded query could read the whole file.
+	// Spilled chunks are read back into heap memory, not the memory_slab_pools.  See class chunk_spill_file below.
+	std::shared_ptr<chunk_spill_file> spill_file;
+
+	// If 'downsampling_pool' is non-null, then the telescoping ring buffer is downsampled by the
+	// pool's worker threads, rather than in the assembler thread.  New chunks are still pushed to
+	// level 0 of the ring buffer immediately, and deeper levels are updated when the workers finish.
+	std::shared_ptr<downsampling_thread_pool> downsampling_pool;
+
+	// Sub-chunk streaming delivery, for low-latency consumers.  If 'subchunk_nt' is nonzero, then
+	// time slices of length 'subchunk_nt' samples are copied out of the active chunks and delivered
+	// via get_assembled_subchunk(), as soon as all packets in the slice have arrived, or a packet
+	// has arrived which is more than 'subchunk_lateness_nt' samples past the end of the slice.
+	// Delivery of full assembled_chunks is unaffected.  Up to 'subchunk_ringbuf_capacity' slices
+	// are buffered per beam, after which the oldest are dropped.  The slices are recycled from a
+	// fixed set of (subchunk_ringbuf_capacity + 2) per beam, so if the processing threads hold on
+	// to more than two slices at a time, further slices are dropped.
+	int subchunk_nt = 0;
+	int subchunk_lateness_nt = 0;
+	int subchunk_ringbuf_capacity = 64;
+
 	// A temporary hack that will go away soon.
 	// Sleep for specified number of seconds, after intensity_stream starts up.
 	double sleep_hack = 0.0;
@@ -416,6 +522,45 @@ public:
 	num_types = 12                 // must be last
     };
 
+    // Memory accounting, returned by get_memory_accounting().  All sizes are in bytes.  Note that the
+    // memory_slab_pools and output_devices may be shared with other streams, so their totals aren't
+    // specific to this stream.
+    struct memory_accounting {
+	// memory_slab_pools (memory_pool and small_memory_pools, summed).
+	int64_t pool_nbytes = 0;             // allocated slabs
+	int64_t pool_nbytes_free = 0;        // available slabs (including slabs in per-thread magazines)
+	int64_t pool_nbytes_low_water = 0;   // low-water mark of the available slabs (see memory_slab_pool::get_low_water_mark())
+
+	// Chunk memory (see assembled_chunk::get_memory_nbytes()) held by the telescoping ring buffers.
+	// The per-level and per-beam vectors are indexed by level and assembler index respectively.
+	int64_t ringbuf_nchunks = 0;
+	int64_t ringbuf_nbytes = 0;
+	int64_t ringbuf_nslabs = 0;          // number of these chunks which hold a pool slab
+	std::vector<int64_t> ringbuf_level_nbytes;
+	std::vector<int64_t> beam_ringbuf_nbytes;
+
+	// Chunk memory referenced by write requests in the output_devices, which are queued, or waiting
+	// for an RFI mask.  These chunks are usually also in a ring buffer (and counted there).
+	int64_t write_queue_nbytes = 0;
+	int64_t awaiting_rfi_nbytes = 0;
+
+	// Serialization (msgpack) buffers of the output_devices.
+	int64_t output_buffer_nbytes = 0;
+
+	// Heap memory held by chunks which couldn't get a slab from a memory_slab_pool (see
+	// initializer::max_pool_fallbacks), summed over beams.  These chunks are also counted in ringbuf_nbytes
+	// while they are in a ring buffer.
+	int64_t fallback_nbytes = 0;
+
+	// Heap memory held by all compressed chunks in the process (see assembled_chunk::compress()).
+	// Compressed chunks in this stream's ring buffers are also counted in ringbuf_nbytes.
+	int64_t compressed_nbytes = 0;
+
+	// Packet lists between the network and assembler threads (udp_packet_ringbuf).
+	int64_t udp_ringbuf_nbytes = 0;
+	int64_t udp_ringbuf_nbytes_queued = 0;
+    };
+
     const initializer ini_params;
 
     // The largest FPGA count in a received packet.
@@ -438,6 +583,40 @@ public:
     // satisifes 0 <= assembler_ix < ini_params.beam_ids.size(), and is not a beam_id.)
 
     std::shared_ptr<assembled_chunk> get_assembled_chunk(int assembler_index, bool wait=true);
+
+    // Named consumers: additional processing threads (e.g. monitoring or quick-look pipelines) can read
+    // the same assembled_chunks, each with an independent position and buffering policy.  add_consumer()
+    // registers the consumer for all beams; see assembled_chunk_ringbuf::add_consumer() for details.
+    void add_consumer(const std::string &name, int bufsize=0);
+    void remove_consumer(const std::string &name);
+    std::shared_ptr<assembled_chunk> get_consumer_chunk(int assembler_index, const std::string &consumer, bool wait=true);
+
+    // Sub-chunk streaming delivery (see initializer::subchunk_nt).  Returns the next time slice for the
+    // given beam, blocking if necessary.  Returns an empty pointer at end-of-stream, or if 'wait' is false
+    // and no slice is ready.
+    std::shared_ptr<assembled_subchunk> get_assembled_subchunk(int assembler_index, bool wait=true);
+
+    // Multi-beam waiting, for processing threads which handle several beams.  Blocks until
+    // get_assembled_chunk(ix, false) would return without blocking for one of the given assembler
+    // indices (i.e. a chunk is ready, or that beam has reached end-of-stream), and returns that index.
+    // Returns -1 if 'timeout_sec' elapses first.  A negative timeout means "wait forever".
+    int wait_for_assembled_chunk(const std::vector<int> &assembler_indices, double timeout_sec=-1.0);
+
+    // Time-aligned batches, for beam-parallel processing threads.  Returns a vector of length
+    // assembler_indices.size(), containing the chunk with the given 'ichunk' for each assembler index,
+    // waiting until all chunks are available or 'timeout_sec' elapses (negative means "wait forever").
+    // Chunks which are still unavailable at the deadline, or which will never arrive (dropped, or past
+    // end-of-stream), are returned as empty pointers.  Like get_assembled_chunk(), this advances the
+    // read position of each beam, so that the next batch would normally be requested with ichunk+1.
+    // If a beam has chunks older than 'ichunk' which haven't been retrieved, they are skipped, and
+    // counted in the 'assembled_chunk_dropped' event count (see get_event_counts()).
+    std::vector<std::shared_ptr<assembled_chunk>> get_assembled_chunk_batch(const std::vector<int> &assembler_indices, uint64_t ichunk, double timeout_sec=-1.0);
+
+    // Returns an eventfd (see eventfd(2)) which becomes readable when chunks are queued for any beam
+    // (or the stream ends), so that processing threads can use it in an epoll/poll loop.  After it
+    // becomes readable, the caller should read() it to reset the counter, then drain each beam with
+    // get_assembled_chunk(ix, false).  The fd is owned by the intensity_network_stream.
+    int get_chunk_eventfd() const { return chunk_eventfd; }
     
     // Can be called at any time, from any thread.  Note that the event counts returned by get_event_counts()
     // may slightly lag the real-time event counts (this behavior derives from wanting to avoid acquiring a
@@ -448,6 +627,10 @@ public:
 
     std::vector<std::unordered_map<std::string, uint64_t> > get_statistics();
 
+    // A cheap snapshot of the memory held by each subsystem, which can be called at any time, from any
+    // thread.  It doesn't block the assembler thread (the ring buffers are read from their published state).
+    memory_accounting get_memory_accounting();
+
     // Retrieves chunks from one or more ring buffers.  The uint64_t
     // return value is a bitmask of l1_ringbuf_level values saying
     // where in the ringbuffer the chunk was found; this is an
@@ -456,6 +639,10 @@ public:
     // If a vector of beam numbers is given, only the ring buffers for
     // those beams will be returned; otherwise the ring buffers for
     // all beams will be returned.
+    //
+    // Chunks are returned as stored, so chunks in the compressed levels of the ring buffer (see
+    // initializer::telescoping_compression_level) are compressed.  They can be decoded or packed as
+    // usual, which decompresses a temporary copy, one chunk at a time (see assembled_chunk::compress()).
     std::vector< std::vector< std::pair<std::shared_ptr<assembled_chunk>, uint64_t> > >
     get_ringbuf_snapshots(const std::vector<int> &beams = std::vector<int>(),
                           uint64_t min_fpga_counts=0, uint64_t max_fpga_counts=0);
@@ -466,6 +653,14 @@ public:
     // If anything else goes wrong, an exception will be thrown.
     std::shared_ptr<assembled_chunk> find_assembled_chunk(int beam, uint64_t fpga_counts, bool toplevel=true);
 
+    // Range query on the telescoping ring buffer for the given beam, without building a snapshot vector.
+    // Calls visitor(chunk, where) for each chunk overlapping [min_fpga_counts, max_fpga_counts], where
+    // 'where' is an l1_ringbuf_level as in get_ringbuf_snapshots().  Returns false if the beam is not
+    // handled by this stream.  Compressed chunks are decompressed one at a time, into a copy which is
+    // freed when the visitor returns (unless the visitor keeps a reference).
+    bool visit_ringbuf(int beam, uint64_t min_fpga_counts, uint64_t max_fpga_counts,
+		       const std::function<void(const std::shared_ptr<assembled_chunk> &, uint64_t)> &visitor);
+
     // Returns the first fpgacount of the first chunk sent downstream by
     // the given beam id.
     uint64_t get_first_fpga_count(int beam);
@@ -606,11 +801,19 @@ protected:
     int stream_chunks_written;
     size_t stream_bytes_written;
 
+    // Used by wait_for_assembled_chunk() and get_chunk_eventfd().  The assemblers call
+    // _chunks_added() whenever a chunk is queued, which increments 'chunks_added_seq'.
+    std::mutex chunks_added_lock;
+    std::condition_variable cond_chunks_added;
+    uint64_t chunks_added_seq = 0;
+    int chunk_eventfd = -1;
+
     // The actual constructor is protected, so it can be a helper function 
     // for intensity_network_stream::make(), but can't be called otherwise.
     intensity_network_stream(const initializer &x);
 
     void _open_socket();
+    void _chunks_added();
     void _network_flush_packets();
     void _add_event_counts(std::vector<int64_t> &event_subcounts);
     void _update_packet_rates(std::shared_ptr<packet_counts> last_packet_counts);
@@ -645,24 +848,28 @@ protected:
 //
 // The 'offsets' and 'scales' arrays below are coarse-grained in both frequency and time, relative 
 // to the 'data' array.  The level of frequency coarse-graining is the constructor argument 'nupfreq',
-// and the level of time coarse-graining is the constructor-argument 'nt_per_packet'.  For no particular
-// reason, the number of coarse-grained frequency channels is a compile-time constant (constants::nfreq_coarse)
-// whereas the number of fine-grained time samples is also a compile-time constant (constants::nt_per_assembled_chunk).
+// and the level of time coarse-graining is the constructor-argument 'nt_per_packet'.  The number of
+// fine-grained time samples is the constructor argument 'nt_per_chunk' (by default
+// constants::nt_per_assembled_chunk).
+//
+// By default, a chunk contains all constants::nfreq_coarse_tot coarse frequency channels.  If the
+// initializer has a nonempty 'freq_map', then the chunk only stores the subset of coarse channels
+// listed in freq_map->coarse_freq_ids, in that order, and 'nfreq_coarse' is the size of the subset.
 //
 // Summarizing:
 //
-//   fine-grained shape = (constants::nfreq_coarse * nupfreq, constants::nt_per_assembled_chunk)
-//   coarse-grained shape = (constants::nfreq_coarse, constants::nt_per_assembled_chunk / nt_per_packet)
+//   fine-grained shape = (nfreq_coarse * nupfreq, nt_per_chunk)
+//   coarse-grained shape = (nfreq_coarse, nt_per_chunk / nt_per_packet)
 //
 // A note on timestamps: there are several units of time used in different parts of the CHIME pipeline.
 //
 //   1 fpga count = 2.56e-6 seconds    (approx)
 //   1 intensity sample = fpga_counts_per_sample * (1 fpga count)
-//   1 assembled_chunk = constants::nt_per_assembled_chunk * (1 intensity sample)
+//   1 assembled_chunk = nt_per_chunk * (1 intensity sample)
 //
 // The 'isample' and 'ichunk' fields of the 'struct assembled_chunk' are simply defined by
 //   isample = (initial fpga count) / fpga_counts_per_sample
-//   ichunk = (initial fpga count) / (fpga_counts_per_sample * constants::nt_per_assembled_chunk)
+//   ichunk = (initial fpga count) / (fpga_counts_per_sample * nt_per_chunk)
 //
 // The 'binning' field of the 'struct assembled_chunk' is 1, 2, 4, 8, ... depending on what level
 // of downsampling has been applied (i.e. the location of the assembled_chunk in the telescoping
@@ -670,6 +877,22 @@ protected:
 // (src2->ichunk == src1->ichunk + binning).
 
 
+// Mapping table for an assembled_chunk which stores a subset of the coarse frequency channels.
+// It is immutable after construction, and shared between all chunks of a stream.
+
+struct coarse_freq_map {
+    std::vector<int> coarse_freq_ids;   // local channel index -> coarse_freq_id (strictly increasing)
+    std::vector<int> local_index;       // coarse_freq_id -> local channel index, or -1 (length nfreq_coarse_tot)
+
+    coarse_freq_map(const std::vector<int> &coarse_freq_ids);
+
+    int nfreq_coarse() const { return coarse_freq_ids.size(); }
+
+    // Returns an empty pointer if 'coarse_freq_ids' is empty (i.e. the full band).
+    static std::shared_ptr<const coarse_freq_map> make(const std::vector<int> &coarse_freq_ids);
+};
+
+
 class assembled_chunk : noncopyable {
 public:
     struct initializer {
@@ -677,6 +900,7 @@ public:
 	int nupfreq = 0;
         int nrfifreq = 0;    // number of frequencies in downsampled RFI chain processing
 	int nt_per_packet = 0;
+	int nt_per_chunk = constants::nt_per_assembled_chunk;
 	int fpga_counts_per_sample = 0;
 	int binning = 1;
 	int stream_id = 0;   // only used in assembled_chunk::format_filename().
@@ -684,6 +908,9 @@ public:
 	bool force_reference = false;
 	bool force_fast = false;
 
+	// If empty (the default), the chunk contains all coarse frequency channels.
+	std::shared_ptr<const coarse_freq_map> freq_map;
+
         // "ctime" in nanoseconds of FGPAcount zero
         uint64_t frame0_nano = 0;
 
@@ -691,6 +918,11 @@ public:
 	// Otherwise, both pointers should be empty, and the assembled_chunk constructor will allocate.
 	std::shared_ptr<memory_slab_pool> pool;
         mutable memory_slab_t slab;
+
+	// If the constructor allocates, and 'heap_nbytes' is non-null, then the caller has already added the
+	// size of the allocation (see get_memory_slab_size()) to *heap_nbytes, and the chunk subtracts it when
+	// the memory is freed (used by assembled_chunk_ringbuf to account for chunks which couldn't get a slab).
+	std::shared_ptr<std::atomic<int64_t>> heap_nbytes;
     };
 
     // Parameters specified at construction.
@@ -698,27 +930,35 @@ public:
     const int nupfreq = 0;
     const int nrfifreq = 0;
     const int nt_per_packet = 0;
+    const int nt_per_chunk = 0;
     const int fpga_counts_per_sample = 0;    // no binning factor applied here
     const int binning = 0;                   // either 1, 2, 4, 8... depending on level in telescoping ring buffer
     const int stream_id = 0;
     const uint64_t ichunk = 0;
     // "ctime" in nanoseconds of FGPAcount zero
     const uint64_t frame0_nano = 0;
+    const std::shared_ptr<const coarse_freq_map> freq_map;   // empty if all coarse channels are present
 
     // Derived parameters.
-    const int nt_coarse = 0;          // equal to (constants::nt_per_assembled_chunk / nt_per_packet)
-    const int nscales = 0;            // equal to (constants::nfreq_coarse * nt_coarse)
-    const int ndata = 0;              // equal to (constants::nfreq_coarse * nupfreq * constants::nt_per_assembled_chunk)
-    const int nrfimaskbytes = 0;      // equal to (nrfifreq * constants::nt_per_assembled_chunk / 8)
-    const uint64_t isample = 0;       // equal to ichunk * constants::nt_per_assembled_chunk
-    const uint64_t fpga_begin = 0;    // equal to ichunk * constants::nt_per_assembled_chunk * fpga_counts_per_sample
-    const uint64_t fpga_end = 0;      // equal to (ichunk+binning) * constants::nt_per_assembled_chunk * fpga_counts_per_sample
+    const int nfreq_coarse = 0;       // equal to constants::nfreq_coarse_tot, or freq_map->nfreq_coarse()
+    const int nt_coarse = 0;          // equal to (nt_per_chunk / nt_per_packet)
+    const int nscales = 0;            // equal to (nfreq_coarse * nt_coarse)
+    const int ndata = 0;              // equal to (nfreq_coarse * nupfreq * nt_per_chunk)
+    const int nrfimaskbytes = 0;      // equal to (nrfifreq * nt_per_chunk / 8)
+    const uint64_t isample = 0;       // equal to ichunk * nt_per_chunk
+    const uint64_t fpga_begin = 0;    // equal to ichunk * nt_per_chunk * fpga_counts_per_sample
+    const uint64_t fpga_end = 0;      // equal to (ichunk+binning) * nt_per_chunk * fpga_counts_per_sample
 
     // Note: you probably don't want to call the assembled_chunk constructor directly!
     // Instead use the static factory function assembed_chunk::make().
     assembled_chunk(const initializer &ini_params);
     virtual ~assembled_chunk();
 
+    // Chunk objects (not their memory slabs) are recycled through a free list, see block_free_list
+    // in ch_frb_io_internals.hpp.  (This also applies to the subclass fast_assembled_chunk.)
+    static void *operator new(size_t nbytes);
+    static void operator delete(void *p, size_t nbytes);
+
     // Returns C time() (seconds since the epoch, 1970.0) of the first/last sample in this chunk.
     double time_begin() const;
     double time_end() const;
@@ -726,7 +966,7 @@ public:
     // The following virtual member functions have default implementations,
     // which are overridden by the subclass 'fast_assembled_chunk' to be faster
     // on a CPU with the AVX2 instruction set, if certain conditions are met
-    // (currently nt_per_packet==16 and nupfreq even).
+    // (currently nt_per_packet==16, nupfreq even, and nt_per_chunk a multiple of 256).
     //
     // If 'prescale' is specified, then the intensity array written by decode()
     // will be multiplied by its value.  This is a temporary workaround for some
@@ -741,6 +981,12 @@ public:
     virtual void decode_subset(float *intensity, float *weights, int t0, int nt, int istride, int wstride) const;
     virtual void downsample(const assembled_chunk *src1, const assembled_chunk *src2);   // downsamples data and RFI mask
 
+    // Downsamples in frequency, by averaging groups of (src->nupfreq / this->nupfreq) adjacent
+    // upchannelized frequencies within each coarse channel.  The source chunk must have the same
+    // ichunk and binning.  Since scales and offsets are per-coarse-channel, they are copied unchanged,
+    // and so is the RFI mask.  An output sample is masked if any of its inputs is masked.
+    virtual void downsample_freq(const assembled_chunk *src);
+
     // Static factory functions which can return either an assembled_chunk or a fast_assembled_chunk.
     static std::unique_ptr<assembled_chunk> make(const initializer &ini_params);
     static std::shared_ptr<assembled_chunk> read_msgpack_file(const std::string& filename);
@@ -753,6 +999,33 @@ public:
     // How big can the bitshuffle-compressed data for a chunk of this size become?
     size_t max_compressed_size();
 
+    // In-memory compression, used for the deep levels of the telescoping ring buffer.
+    // compress() optionally requantizes the data to 4 bits (nbits=4), optionally bitshuffle/LZ4-compresses
+    // it (lz4=true), copies it (along with scales, offsets and RFI mask) into a heap allocation of just the
+    // right size, and returns the memory slab to its pool.  After compress() is called, all array pointers
+    // are null.  decode(), decode_subset(), write_hdf5_file(), write_msgpack_file() and the msgpack packer
+    // still work, via a decompressed temporary, but add_packet(), fill_with_copy() and downsample() throw.
+    // decompress() writes 8-bit data to a chunk with the same parameters (e.g. newly allocated from a pool),
+    // and make_decompressed() returns such a chunk (allocated on the heap).
+    // The intermediate buffers are per-thread scratch space, which is reused between calls.
+    //
+    // If the chunk's memory_slab_pool has a memory_slab_budget, the compressed data is charged to the budget
+    // (until the chunk is destroyed).  If the budget is exhausted, compress() returns false and leaves the
+    // chunk uncompressed (the failure is counted in memory_slab_budget::get_num_failed_charges()).
+    // get_total_compressed_nbytes() returns the total held by all compressed chunks in the process, whether
+    // or not they are charged to a budget (see intensity_network_stream::memory_accounting).
+    bool compress(int nbits=8, bool lz4=true);
+    void decompress(assembled_chunk *dst) const;
+    std::unique_ptr<assembled_chunk> make_decompressed() const;
+    bool is_compressed() const { return compressed_nbytes > 0; }
+    ssize_t get_compressed_nbytes() const { return compressed_nbytes; }
+    static int64_t get_total_compressed_nbytes();
+
+    // Memory accounting: bytes held by this chunk (its memory slab, or its compressed data), and
+    // whether the memory is a slab from a memory_slab_pool.
+    ssize_t get_memory_nbytes() const { return is_compressed() ? compressed_nbytes : memory_slab_nbytes; }
+    bool has_pool_slab() const { return bool(memory_pool); }
+
     // Performs a printf-like pattern replacement on *pattern* given the parameters of this assembled_chunk.
     // Replacements:
     //   (STREAM)  -> %01i stream_id
@@ -760,23 +1033,32 @@ public:
     //   (CHUNK)   -> %08i ichunk
     //   (NCHUNK)  -> %02i  size in chunks
     //   (BINNING) -> %02i  size in chunks
+    //   (LEVEL)   -> %02i  level in telescoping ring buffer (log2 of binning)
     //   (FPGA0)   -> %012i start FPGA-counts
     //   (FPGAN)   -> %08i  FPGA-counts size
     std::string format_filename(const std::string &pattern) const;
 
+    // Copies samples [it0, it0+nt) into 'out', which is resized as needed.  Both 'it0' and 'nt'
+    // must be multiples of nt_per_packet.  Used for sub-chunk streaming delivery.
+    void get_subchunk(assembled_subchunk &out, int it0, int nt) const;
+
+    // Returns the coarse_freq_id stored in local channel 'ifreq_c', where 0 <= ifreq_c < nfreq_coarse.
+    int get_coarse_freq_id(int ifreq_c) const { return freq_map ? freq_map->coarse_freq_ids[ifreq_c] : ifreq_c; }
+
     // Utility functions currently used only for testing.
     void fill_with_copy(const std::shared_ptr<assembled_chunk> &x);
     void randomize(std::mt19937 &rng);   // also randomizes rfi_mask (if it exists)
 
-    static ssize_t get_memory_slab_size(int nupfreq, int nt_per_packet, int nrfifreq);
+    static ssize_t get_memory_slab_size(int nupfreq, int nt_per_packet, int nrfifreq, int nt_per_chunk=constants::nt_per_assembled_chunk,
+					int nfreq_coarse=constants::nfreq_coarse_tot);
 
     // I wanted to make the following fields protected, but msgpack doesn't like it...
 
     // Primary buffers.
-    float *scales = nullptr;   // 2d array of shape (constants::nfreq_coarse, nt_coarse)
-    float *offsets = nullptr;  // 2d array of shape (constants::nfreq_coarse, nt_coarse)
-    uint8_t *data = nullptr;   // 2d array of shape (constants::nfreq_coarse * nupfreq, constants::nt_per_assembled_chunk)
-    uint8_t *rfi_mask = nullptr;   // 2d array of downsampled masks, packed bitwise; (nrfifreq x constants::nt_per_assembled_chunk / 8 bits)
+    float *scales = nullptr;   // 2d array of shape (nfreq_coarse, nt_coarse)
+    float *offsets = nullptr;  // 2d array of shape (nfreq_coarse, nt_coarse)
+    uint8_t *data = nullptr;   // 2d array of shape (nfreq_coarse * nupfreq, nt_per_chunk)
+    uint8_t *rfi_mask = nullptr;   // 2d array of downsampled masks, packed bitwise; (nrfifreq x nt_per_chunk / 8 bits)
 
     // False on initialization.
     // If the RFI mask is being saved (nrfifreq > 0), it will be subsequently set to True by the processing thread.
@@ -784,22 +1066,29 @@ public:
 
     std::atomic<int> packets_received;
 
-    // Temporary buffers used during downsampling.
-    float *ds_w2 = nullptr;    // 1d array of length (nt_coarse/2)
-    float *ds_data = nullptr;  // 2d array of shape (nupfreq, constants::nt_per_assembled_chunk/2)
-    int *ds_mask = nullptr;    // 2d array of shape (nupfreq, constants::nt_per_assembled_chunk/2)
-
     // Used in the write path, to keep track of writes to disk.
     std::mutex filename_mutex;
     std::unordered_set<std::string> filename_set;
     std::unordered_map<std::string, std::string> filename_map;  // hash output_device_name -> filename
 
 protected:
-    // The array members above (scales, ..., ds_mask) are packed into a single contiguous memory slab.
+    // The array members above (scales, ..., rfi_mask) are packed into a single contiguous memory slab.
     std::shared_ptr<memory_slab_pool> memory_pool;
     memory_slab_t memory_slab;
+    ssize_t memory_slab_nbytes = 0;
+    std::shared_ptr<std::atomic<int64_t>> heap_nbytes;   // see initializer::heap_nbytes
+
+    // Nonempty iff compress() has been called.  Contains scales, offsets, RFI mask and data (in that order).
+    std::unique_ptr<uint8_t[]> compressed_buf;
+    ssize_t compressed_nbytes = 0;
+    std::shared_ptr<memory_slab_budget> compressed_budget;   // nonempty iff 'compressed_nbytes' is charged
+    bool compressed_lz4 = false;    // false if bitshuffle didn't reduce the size, and data was copied uncompressed
+    int compressed_nbits = 8;       // either 8 or 4 (see requantize_4bit() in ch_frb_io_internals.hpp)
 
     void _check_downsample(const assembled_chunk *src1, const assembled_chunk *src2);
+    void _check_downsample_freq(const assembled_chunk *src);
+    bool _same_coarse_freqs(const assembled_chunk *x) const;
+    void _copy_freq_downsampled_metadata(const assembled_chunk *src);
 
     // Note: destructors must call _deallocate()!  
     // Otherwise the memory_slab can't be returned to the pool.
@@ -808,7 +1097,7 @@ protected:
 
 
 // If the CPU has the AVX2 instruction set, and for some choices of packet parameters (the precise 
-// criterion is nt_per_packet == 16 and nupfreq % 2 == 0), we can speed up the assembled_chunk
+// criterion is nt_per_packet == 16, nupfreq % 2 == 0, and nt_per_chunk % 256 == 0), we can speed up the assembled_chunk
 // member functions using assembly language kernels.
 
 class fast_assembled_chunk : public assembled_chunk
@@ -823,7 +1112,32 @@ public:
     virtual void add_packet(const intensity_packet &p) override;
     virtual void decode(float *intensity, float *weights, int istride, int wstride, float prescale=1.0) const override;
     virtual void downsample(const assembled_chunk *src1, const assembled_chunk *src2) override;
+    virtual void downsample_freq(const assembled_chunk *src) override;
+};
 
+
+// A time slice of an assembled_chunk, returned by intensity_network_stream::get_assembled_subchunk().
+// The data, scales and offsets are copies, with the same encoding as the assembled_chunk.
+
+struct assembled_subchunk {
+    int beam_id = 0;
+    int nupfreq = 0;
+    int nt_per_packet = 0;
+    int fpga_counts_per_sample = 0;
+    uint64_t ichunk = 0;
+    int it0 = 0;                 // first sample of the slice, relative to the start of the chunk
+    int nt = 0;                  // number of samples in the slice
+    uint64_t fpga_begin = 0;
+    uint64_t fpga_end = 0;
+    int nfreq_coarse = 0;        // see assembled_chunk::nfreq_coarse
+    std::shared_ptr<const coarse_freq_map> freq_map;
+
+    std::vector<uint8_t> data;   // 2d array of shape (nfreq_coarse * nupfreq, nt)
+    std::vector<float> scales;   // 2d array of shape (nfreq_coarse, nt / nt_per_packet)
+    std::vector<float> offsets;  // 2d array of shape (nfreq_coarse, nt / nt_per_packet)
+
+    // Same as assembled_chunk::decode(), but 'istride' and 'wstride' need only be >= nt.
+    void decode(float *intensity, float *weights, int istride, int wstride, float prescale=1.0) const;
 };
 
 
@@ -835,10 +1149,102 @@ public:
 
 class memory_slab_pool {
 public:
-    // The 'verbosity' parameter has the following meaning:
-    //   0 = ninja-quiet
-    //   1 = a little output during initialization
-    //   2 = debug trace of all allocations/deallocations
+    struct initializer {
+	ssize_t nbytes_per_slab = 0;
+	ssize_t nslabs = 0;
+	std::vector<int> allocation_cores;
+
+	// The 'verbosity' parameter has the following meaning:
+	//   0 = ninja-quiet
+	//   1 = a little output during initialization
+	//   2 = debug trace of all allocations/deallocations
+	int verbosity = 1;
+
+	// If nonzero, slabs are backed by huge pages of this size (e.g. 2MB or 1GB), falling back to
+	// transparent huge pages if explicit huge pages can't be obtained (see huge_page_alloc()).
+	// Note that each slab is rounded up to a multiple of the huge page size, and the rounded size
+	// (memory_slab_pool::nbytes_per_mapping) is what is charged to the budget and reported.
+	ssize_t huge_page_size = 0;
+
+	// If 'numa_aware' is true, the slabs are divided evenly between the NUMA nodes.  Each node's
+	// slabs are allocated (and first touched) by a thread pinned to the node's cores, so that they
+	// are local to the node, and 'allocation_cores' is ignored.
+	bool numa_aware = false;
+
+	// If 'parallel_allocation' is true, the slabs are allocated and pre-faulted by one thread per
+	// core in 'allocation_cores' (or per core of each NUMA node), each pinned to its core.  If no
+	// cores are specified, one unpinned thread per online core is used.
+	bool parallel_allocation = false;
+
+	// If nonzero, the constructor returns as soon as this many slabs are in the pool, and the
+	// remaining slabs are allocated in the background.  Use get_num_slabs_allocated() to follow
+	// progress, or wait_for_allocation() to block until all slabs have been allocated.
+	ssize_t nslabs_initial = 0;
+
+	// Memory pressure handling.  When the number of available slabs drops below 'low_watermark'
+	// (or a get_slab() call fails), the pool asks its clients to release slabs (see add_client()),
+	// until 'high_watermark' slabs are expected to be available.
+	ssize_t low_watermark = 0;
+	ssize_t high_watermark = 0;
+
+	// If nonzero, each thread keeps a cache ("magazine") of up to this many slabs, so that most
+	// get_slab() and put_slab() calls don't touch the shared free list.  Magazines are refilled
+	// and flushed in batches of magazine_size/2 slabs.  They are bypassed for clients with a
+	// reservation or quota, since these are enforced against the shared free list.
+	int magazine_size = 0;
+
+	// If 'background_zeroing' is true, slabs returned to the pool are zeroed by a background thread
+	// (pinned to 'zeroing_cores', if specified), using non-temporal stores, so that get_slab(zero=true)
+	// can usually hand out a pre-zeroed slab without a memset().  Per-thread magazines remember which
+	// of their slabs are zero, and are refilled with pre-zeroed slabs by get_slab(zero=true).
+	bool background_zeroing = false;
+	std::vector<int> zeroing_cores;
+
+	// Size classes.  Pools with different slab sizes (e.g. for streams with different nupfreq, or
+	// for reduced-size telescoping levels) can share a byte budget (see memory_slab_budget).  A pool
+	// with a budget starts with 'nslabs' slabs, and grows on demand up to 'nslabs_max' slabs, as long
+	// as the budget allows.  Slabs above 'nslabs' are freed again when another pool sharing the budget
+	// needs the bytes, if they are idle.  Without a budget, 'nslabs_max' is ignored.
+	std::shared_ptr<memory_slab_budget> budget;
+	ssize_t nslabs_max = 0;
+    };
+
+    // Called by the pool under memory pressure, with the number of slabs it would like returned.
+    // Must not block or call back into the pool.  Returns the number of slabs the client expects
+    // to release (possibly asynchronously).
+    using reclaim_callback_t = std::function<ssize_t (ssize_t nslabs)>;
+
+    // Counters returned by get_pressure_stats().
+    struct pressure_stats {
+	int64_t num_failed_gets = 0;        // get_slab() calls which returned a null pointer
+	int64_t num_quota_refusals = 0;     // ... of which were refused by a quota or reservation
+	int64_t num_reclaims = 0;           // number of times the reclaim callbacks were invoked
+	int64_t num_slabs_reclaimed = 0;    // sum of the reclaim callbacks' return values
+    };
+
+    // Per-node occupancy, returned by get_node_stats().
+    struct node_stats {
+	int numa_node = -1;       // -1 if the pool is not NUMA-aware
+	ssize_t nslabs = 0;       // number of slabs allocated on this node
+	ssize_t navailable = 0;   // number of these slabs currently in the pool
+    };
+
+    // Per-class occupancy, returned by get_usage_stats().
+    struct usage_stats {
+	ssize_t nbytes_per_slab = 0;
+	ssize_t nslabs_allocated = 0;   // between nslabs and nslabs_max
+	ssize_t nslabs_max = 0;
+	ssize_t nslabs_in_use = 0;      // allocated slabs which are not in the pool (or in a magazine)
+	int64_t nbytes_requested = 0;   // cumulative, see get_slab(nbytes_needed)
+	int64_t nbytes_handed_out = 0;  // cumulative, nbytes_per_slab per get_slab() call
+	int64_t num_grown = 0;          // slabs allocated on demand
+	int64_t num_shrunk = 0;         // slabs freed on behalf of other pools sharing the budget
+
+	double utilization = 0.0;       // nslabs_in_use / nslabs_allocated
+	double fragmentation = 0.0;     // 1 - nbytes_requested / nbytes_handed_out (internal fragmentation)
+    };
+
+    memory_slab_pool(const initializer &ini_params);
     memory_slab_pool(ssize_t nbytes_per_slab, ssize_t nslabs, const std::vector<int> &allocation_cores, int verbosity=1);
     ~memory_slab_pool();
 
@@ -848,29 +1254,429 @@ public:
     // or get_slab() blocks until a slab is available (wait=true).
     //
     // If zero=true, then the new slab is zeroed.
+    //
+    // If the pool is NUMA-aware, the slab is taken from 'numa_node' if possible (by default, the node
+    // of the calling thread), falling back to other nodes.
+    //
+    // If 'client' is a client id (see add_client()), the slab is charged to the client and its group,
+    // and the request is refused (returning a null pointer, even if wait=true) if it would exceed a
+    // quota, or eat into the unused reservations of other clients.
+    //
+    // If 'nbytes_needed' is nonzero, it is the number of bytes the caller will actually use, and
+    // is only used to compute the fragmentation (see get_usage_stats()).
 
-    memory_slab_t get_slab(bool zero=true, bool wait=false);
+    memory_slab_t get_slab(bool zero=true, bool wait=false, int numa_node=-1, int client=-1, ssize_t nbytes_needed=0);
     
     // Puts a slab back in the pool.
     // Note: 'p' will be set to a null pointer after put_slab() returns.
     void put_slab(memory_slab_t &p);
 
-    int count_slabs_available();
+    int count_slabs_available();   // includes slabs cached in per-thread magazines
+    ssize_t get_low_water_mark();  // smallest number of available slabs (as in count_slabs_available()) since construction
+
+    std::vector<node_stats> get_node_stats();
+    int64_t get_num_remote_slabs();   // number of get_slab() calls which fell back to another node
+
+    // Clients (e.g. the beams of an intensity_network_stream) are grouped (e.g. by stream_id).
+    // Each client and group can have a reservation (a number of slabs which other clients can't take)
+    // and a quota (a maximum number of slabs in use, or zero for no limit).  Returns the client id.
+    int add_client(int group, ssize_t nreserved, ssize_t quota, const reclaim_callback_t &reclaim_callback);
+    void remove_client(int client);
+    void set_group_limits(int group, ssize_t nreserved, ssize_t quota);
+
+    pressure_stats get_pressure_stats();
+
+    // Number of slabs zeroed by the background thread, and by get_slab(zero=true) callers.
+    void get_zeroing_counts(int64_t &nzeroed_background, int64_t &nzeroed_on_get);
+
+    // Progress of the (possibly background) allocation, see initializer::nslabs_initial.
+    ssize_t get_num_slabs_allocated();
+    bool allocation_complete();
+    void wait_for_allocation();
+
+    // Returns the page size actually obtained (see huge_page_alloc()).  If huge pages were requested,
+    // but some slabs fell back to transparent huge pages, this is the base page size.
+    ssize_t get_page_size();
+
+    usage_stats get_usage_stats();
 
     const ssize_t nbytes_per_slab;
+    const ssize_t nbytes_per_mapping;   // memory actually mapped per slab (rounded up to huge_page_size)
     const ssize_t nslabs;
+    const ssize_t nslabs_max;
     const int verbosity;
+    const ssize_t huge_page_size;
+    const bool numa_aware;
+    const ssize_t low_watermark;
+    const ssize_t high_watermark;
+    const int magazine_size;
+    const bool background_zeroing;
+    const std::shared_ptr<memory_slab_budget> budget;
 
 protected:
+    friend class memory_slab_budget;
+
     std::mutex lock;
     std::condition_variable cv;
 
-    std::vector<memory_slab_t> slabs;
-    ssize_t curr_size = 0;
+    // Available slabs are kept in per-node stacks, parallel to 'nodes'.
+    // If the pool is not NUMA-aware, there is a single stack, and nodes = { -1 }.
+    std::vector<int> nodes;
+    std::vector<std::vector<memory_slab_t>> slabs;
+    std::vector<ssize_t> node_nslabs;
+
+    // Slabs which are known to be zero (freshly allocated, or cleaned by the zeroing thread), parallel to 'slabs'.
+    // Both lists are included in 'curr_size'.  A slab which is being zeroed is counted in 'nzeroing' instead.
+    std::vector<std::vector<memory_slab_t>> zeroed_slabs;
+    ssize_t nzeroing = 0;
+    std::thread zeroing_thread;
+    std::condition_variable zeroing_cv;
+    bool zeroing_cancelled = false;
+    int64_t num_zeroed_background = 0;
+    std::atomic<int64_t> num_zeroed_on_get{0};
+
+    ssize_t curr_size = 0;    // summed over nodes
     ssize_t low_water_mark = 0;
+    ssize_t page_size = 0;
+    int64_t num_remote_slabs = 0;
+
+    // Allocation state, protected by 'lock'.
+    std::vector<std::thread> allocation_threads;
+    ssize_t nslabs_allocated = 0;
+    int nthreads_running = 0;
+    bool allocating_in_background = false;
+    bool allocation_cancelled = false;
+    std::string allocation_error;
+
+    // Size class state (see initializer::budget), protected by 'lock'.
+    ssize_t nbytes_charged = 0;   // bytes charged to the budget
+    int ngrowing = 0;             // number of get_slab() callers allocating a slab on demand
+    int64_t num_grown = 0;
+    int64_t num_shrunk = 0;
+    std::atomic<int64_t> num_gets{0};
+    std::atomic<int64_t> nbytes_requested{0};
+
+    struct client_state {
+	int group = 0;
+	ssize_t nreserved = 0;
+	ssize_t quota = 0;
+	ssize_t nused = 0;    // includes slabs cached in the client's magazines
+	bool active = true;
+	reclaim_callback_t reclaim_callback;
+    };
+
+    struct group_state {
+	ssize_t nreserved = 0;
+	ssize_t quota = 0;
+	ssize_t nused = 0;
+    };
+
+    // Pressure handling state, protected by 'lock'.  Client ids index 'clients' (and are never reused).
+    std::vector<client_state> clients;
+    std::map<int, group_state> groups;
+    pressure_stats pstats;
+    bool reclaiming = false;
+    std::atomic<int> nclients{0};
+    std::atomic<bool> limits_active{false};   // true if any client or group has a reservation or quota
+
+    // Per-thread magazines (see initializer::magazine_size).  Each thread has one magazine per (pool, client),
+    // which is registered here, so that the pool can drain it (or detach it, in the destructor).  Slabs in
+    // a magazine stay charged to its client.  Lock ordering: a magazine's lock is acquired before the pool's.
+    struct magazine;
+    struct thread_magazines;
+    std::vector<std::shared_ptr<magazine>> magazines;   // protected by 'lock'
+    std::atomic<ssize_t> ncached{0};                    // total number of slabs in magazines
+    std::atomic<int> nwaiters{0};                       // number of blocked get_slab(wait=true) callers
+    uint64_t serial = 0;                                // unique pool id, used to look up magazines
+
+    magazine &_get_magazine(int client);
+    memory_slab_t _magazine_get(int numa_node, int client, bool zero, bool &is_zero);
+    bool _magazine_put(memory_slab_t &p);
+    void _flush_magazine(magazine &mag, ssize_t n);   // called with the magazine's lock held
+    void _drain_magazines();
+
+    int _node_index(int numa_node) const;
+    void _join_allocation_threads();
+
+    // Pops a slab from node 'inode' (called with the lock held).  If zero=true, a pre-zeroed slab is
+    // preferred, otherwise a dirty one.  On return, 'is_zero' indicates whether the slab is known to be zero.
+    memory_slab_t _pop_slab(int inode, bool zero, bool &is_zero);
+    void _push_dirty_slab(int inode, memory_slab_t &p);
+
+    void _zeroing_thread_main(const std::vector<int> &cores);
+
+    // Helpers for pressure handling, called with the lock held.
+    ssize_t _navailable() const;
+    bool _client_may_allocate(int client);
+    bool _client_within_quota(int client);
+    ssize_t _nprotected(int client);
+    void _charge(int client, ssize_t n);
+
+    // Called without the lock held.
+    void _reclaim(ssize_t nwanted);
+
+    // Size classes.  _grow() allocates one slab on demand (returning a null pointer if the budget is
+    // exhausted), and _shrink() frees idle slabs above 'nslabs', returning the number of bytes freed.
+    // Both are called without the lock held; _shrink() is called by the budget, with its lock held.
+    memory_slab_t _grow(int inode);
+    ssize_t _shrink(ssize_t nbytes);
+    void _detach_budget();
+
+    // Called by constructor, in separate threads (one or more per node).
+    void allocate(int inode, ssize_t n, const std::vector<int> &allocation_cores);
+};
+
+
+// -------------------------------------------------------------------------------------------------
+//
+// memory_slab_budget
+//
+// A byte budget shared by several memory_slab_pools with different slab sizes ("size classes"), see
+// memory_slab_pool::initializer::budget.  Each pool charges its slabs to the budget.  When a pool
+// wants to grow, and the budget is exhausted, idle slabs which other pools have grown on demand are
+// freed to make room.
+
+
+class memory_slab_budget : noncopyable {
+public:
+    memory_slab_budget(ssize_t nbytes_max);
+
+    ssize_t get_nbytes_used();
+    int64_t get_num_failed_charges();
+
+    // Usage of each pool sharing the budget, in order of construction.
+    std::vector<memory_slab_pool::usage_stats> get_class_stats();
+
+    const ssize_t nbytes_max;
+
+protected:
+    friend class memory_slab_pool;
+    friend class assembled_chunk;
+
+    // Lock ordering: the budget's lock is acquired before a pool's.
+    std::mutex lock;
+    ssize_t nbytes_used = 0;
+    int64_t num_failed_charges = 0;
+    std::vector<memory_slab_pool *> pools;
+
+    // Called by memory_slab_pool (and by assembled_chunk::compress()), without the pool's lock held.  If the
+    // budget is exhausted, _try_charge() shrinks the other pools, and returns false if this isn't enough.
+    bool _try_charge(memory_slab_pool *requester, ssize_t nbytes);
+    void _release(ssize_t nbytes);
+    void _register(memory_slab_pool *pool);
+    void _unregister(memory_slab_pool *pool);
+};
+
+
+// -------------------------------------------------------------------------------------------------
+//
+// downsampling_thread_pool
+//
+// Worker threads which downsample the telescoping ring buffer asynchronously, so that the assembler
+// thread doesn't stall when several levels cascade at once.  To enable, construct a pool and put it
+// in intensity_network_stream::initializer::downsampling_pool.  One pool can be shared between all
+// beams (and streams); the downsampling for each beam is still done in order, one chunk at a time.
+
+
+class downsampling_thread_pool : noncopyable {
+public:
+    // If 'cores' is nonempty, worker threads are pinned to the given list of cores.
+    downsampling_thread_pool(int nthreads, const std::vector<int> &cores = std::vector<int>());
+
+    // Runs any queued tasks, then joins the worker threads.  (If the destructor is called from a
+    // task, e.g. because the task held the last reference to the pool, the calling worker is detached
+    // instead, and exits after the task returns.)
+    ~downsampling_thread_pool();
+
+    // Queues a task for the worker threads.  Never blocks (the queue is unbounded).
+    void submit(const std::function<void()> &task);
+
+    int count_queued_tasks();
+
+    const int nthreads;
+
+protected:
+    // Shared with the worker threads, so that a detached worker (see destructor) can outlive the pool.
+    struct worker_state {
+	std::mutex lock;
+	std::condition_variable cv;
+	std::deque<std::function<void()>> tasks;
+	bool stopping = false;
+    };
+
+    std::shared_ptr<worker_state> state;
+    std::vector<std::thread> threads;
+
+    static void worker_main(std::shared_ptr<worker_state> state, const std::vector<int> &cores);
+};
+
+
+// -------------------------------------------------------------------------------------------------
+//
+// decode_ahead_stream
+//
+// Optional decode-ahead stage for a processing thread which reads one beam of an intensity_network_stream.
+// Instead of calling get_assembled_chunk() followed by assembled_chunk::decode(), the processing thread
+// calls get_decoded_chunk(), and receives a chunk which has already been decoded by a worker thread into
+// one of the caller-registered (intensity, weights) buffers.  The worker decodes up to K chunks ahead,
+// where K is the number of registered buffers, so that decoding overlaps with downstream processing.
+//
+// The decode_ahead_stream takes the place of the get_assembled_chunk() consumer for its beam.  Each buffer
+// must have room for (nupfreq * nfreq_coarse) rows (nfreq_coarse is nfreq_coarse_tot unless the stream
+// has a coarse_freq_ids subset), with strides 'istride' and 'wstride'.
+
+
+class decode_ahead_stream : noncopyable {
+public:
+    decode_ahead_stream(const std::shared_ptr<intensity_network_stream> &stream, int assembler_index, int istride, int wstride, float prescale=1.0);
+
+    // Stops the worker thread (if running).
+    ~decode_ahead_stream();
+
+    // Registers a caller-owned buffer.  All buffers must be registered before start().
+    void add_buffer(float *intensity, float *weights);
+
+    // Starts the worker thread.
+    void start();
+
+    struct decoded_chunk {
+	std::shared_ptr<assembled_chunk> chunk;   // empty pointer at end-of-stream
+	float *intensity = nullptr;
+	float *weights = nullptr;
+    };
+
+    // Returns the next decoded chunk, blocking if necessary to wait for data.  If 'wait' is false
+    // and no decoded chunk is ready, returns a decoded_chunk with an empty 'chunk' pointer (use
+    // end_of_stream() to distinguish this case from end-of-stream).  The buffers in the decoded_chunk
+    // belong to the caller until release() is called.  If the worker thread threw an exception, it
+    // is rethrown here.
+    decoded_chunk get_decoded_chunk(bool wait=true);
+    void release(const decoded_chunk &c);
+
+    bool end_of_stream();
+
+    const std::shared_ptr<intensity_network_stream> stream;
+    const int assembler_index;
+    const int istride;
+    const int wstride;
+    const float prescale;
+
+protected:
+    std::mutex lock;
+    std::condition_variable cv;
+
+    std::vector<std::pair<float *, float *>> free_buffers;
+    std::deque<decoded_chunk> ready;
+    int nbuffers = 0;
+    bool started = false;
+    bool stopping = false;
+    bool eos = false;
+    std::exception_ptr worker_error;
+
+    std::thread worker;
+
+    void worker_main();
+};
+
+
+// -------------------------------------------------------------------------------------------------
+//
+// chunk_spill_file
+//
+// A circular file (typically on a local SSD) which holds chunks after they have been dropped from the
+// last level of the telescoping ring buffer.  The file is preallocated to 'nbytes', and when it is full,
+// the oldest chunks are overwritten.  One spill file can be shared between all beams (and streams).
+//
+// The index (beam_id, fpga_begin) -> file offset is kept in memory only, so the contents of the file
+// are not recoverable after the process exits.  Chunks are stored uncompressed.
+//
+// The assembled_chunk_ringbuf doesn't write chunks itself, since that would put disk latency on the
+// assembler thread.  Instead, it calls enqueue_chunk(), and chunks are written by a dedicated writer
+// thread.  If the writer falls behind by more than 'write_queue_capacity' chunks, new chunks are dropped
+// (see get_num_dropped()).  Queued chunks are still returned by find_chunk() and find_chunks().
+
+
+class chunk_spill_file : noncopyable {
+public:
+    // Metadata for one chunk in the spill file.
+    struct record {
+	int beam_id = 0;
+	int nupfreq = 0;
+	int nrfifreq = 0;
+	int nt_per_packet = 0;
+	int nt_per_chunk = 0;
+	int nfreq_coarse = 0;
+	int binning = 0;
+	uint64_t ichunk = 0;
+	uint64_t fpga_begin = 0;
+	uint64_t fpga_end = 0;
+	bool has_rfi_mask = false;
+
+	off_t offset = 0;
+	ssize_t nbytes = 0;
+	uint64_t seq = 0;    // used to detect records which are overwritten while being read
+    };
+
+    // The destructor writes all queued chunks before returning.
+    chunk_spill_file(const std::string &filename, ssize_t nbytes, int verbosity=1, int write_queue_capacity=8);
+    ~chunk_spill_file();
+
+    // Appends a chunk, overwriting the oldest chunks if necessary.  Thread-safe.  Blocks until the
+    // write completes, and throws an exception if it fails.
+    void write_chunk(const assembled_chunk *chunk);
+
+    // Queues a chunk for the writer thread, and returns immediately.  The chunk may be compressed.
+    // Returns false (and drops the chunk) if the queue is full.  Write errors are logged, not thrown.
+    bool enqueue_chunk(const std::shared_ptr<assembled_chunk> &chunk);
+
+    // Looks up the chunk with the given (beam_id, fpga_begin).  Returns false if not found.  If the chunk
+    // is still waiting to be written, then 'queued' is set to the chunk (otherwise it is set to an empty
+    // pointer, and the chunk can be read with read_chunk()).
+    bool find_chunk(int beam_id, uint64_t fpga_begin, record &rec, std::shared_ptr<assembled_chunk> &queued);
+
+    // Returns records for all chunks which overlap the range [min_fpga_counts, max_fpga_counts], in time order.
+    // Either endpoint can be zero, to indicate that the range is unbounded on that side.  Only chunks which
+    // end at or before 'fpga_cutoff' are returned (used to avoid duplicating chunks in the ring buffer).
+    // Chunks which are still waiting to be written are returned in 'queued' (they are newer than the
+    // chunks in 'out').
+    void find_chunks(int beam_id, uint64_t min_fpga_counts, uint64_t max_fpga_counts, uint64_t fpga_cutoff, std::vector<record> &out,
+		     std::vector<std::shared_ptr<assembled_chunk>> &queued);
 
-    // Called by constructor, in separate thread.
-    void allocate(const std::vector<int> &allocation_cores);
+    // Reads a chunk into 'dst', which must have parameters matching the record.  Returns false if the
+    // chunk was overwritten (e.g. by a concurrent call to write_chunk()) before the read finished.
+    bool read_chunk(const record &rec, assembled_chunk *dst);
+
+    // Number of chunks dropped by enqueue_chunk() because the queue was full.
+    int64_t get_num_dropped();
+
+    const std::string filename;
+    const ssize_t nbytes;
+    const int verbosity;
+    const int write_queue_capacity;
+
+protected:
+    int fd = -1;
+
+    std::mutex lock;
+    std::condition_variable cv;
+    off_t write_pos = 0;
+    uint64_t next_seq = 1;
+
+    std::deque<record> records;    // in the order they were written (i.e. circular order in the file)
+    std::map<std::pair<int,uint64_t>, record> index;   // (beam_id, fpga_begin) -> record
+
+    // Chunks passed to enqueue_chunk().  The chunk being written stays at the front of the queue until
+    // it is added to the 'index', so that it is always visible to readers in one place or the other.
+    std::deque<std::shared_ptr<assembled_chunk>> queue;
+    int64_t num_dropped = 0;
+    bool stopping = false;
+
+    std::thread writer;
+
+    void writer_main();
+    void _write_chunk(const assembled_chunk *chunk, bool pop_queue);
+
+    static ssize_t _record_nbytes(const assembled_chunk *chunk);
 };
 
 
@@ -937,6 +1743,9 @@ public:
 	//   2 = log i/o thread startup/shutdown
 	//   3 = verbose trace of all write_requests
 	int verbosity = 1;
+
+	// If nonzero, the serialization buffer is backed by huge pages (see huge_page_alloc()).
+	ssize_t huge_page_size = 0;
     };
 
     const initializer ini_params;
@@ -953,6 +1762,10 @@ public:
     // Counts the number of queued write request chunks
     int count_queued_write_requests();
 
+    // Memory accounting: bytes of chunk memory referenced by queued write requests, and by requests which
+    // are waiting for an RFI mask, and the size of the serialization buffer.  Doesn't acquire the lock.
+    void get_memory_accounting(int64_t &nbytes_queued, int64_t &nbytes_awaiting_rfi, int64_t &nbytes_buffer);
+
     // If 'wait' is true, then end_stream() blocks until pending writes are complete.
     // If 'wait' is false, then end_stream() cancels all pending writes.
     void end_stream(bool wait);
@@ -986,7 +1799,12 @@ protected:
     std::condition_variable _cond;
 
     // Temporary buffer used for assembled_chunk serialization, accessed only by I/O thread
-    std::unique_ptr<uint8_t[]> _buffer;
+    memory_slab_t _buffer;
+    ssize_t _buffer_nbytes = 0;
+
+    // See get_memory_accounting().  Modified with the lock held.
+    std::atomic<int64_t> _nbytes_queued{0};
+    std::atomic<int64_t> _nbytes_awaiting_rfi{0};
 
     // Constructor is protected -- use output_device::make() instead!
     output_device(const initializer &ini_params);
@@ -1188,21 +2006,51 @@ protected:
     
 
 // Used in RPC's which return chunks, to indicate where the chunk was found.
-// Note: implementation of assembled_chunk_ringbuf::get_ringbuf_snapshot() assumes
-// that L1RB_LEVELn == 2^n, so be careful when modifying this!
+// Note: L1RB_LEVELn == 2^n for n <= 7.  Deeper levels skip over the L1RB_WRITEQUEUE bit,
+// so always use l1_ringbuf_level_bit() to convert a level to a bitmask value.
 enum l1_ringbuf_level {
     L1RB_DOWNSTREAM = 1,
     L1RB_LEVEL1 = 2,
     L1RB_LEVEL2 = 4,
     L1RB_LEVEL3 = 8,
     L1RB_LEVEL4 = 0x10,
+    L1RB_LEVEL5 = 0x20,
+    L1RB_LEVEL6 = 0x40,
+    L1RB_LEVEL7 = 0x80,
     // queued for writing in the L1 RPC system
     L1RB_WRITEQUEUE = 0x100,
+    // read back from the chunk_spill_file (above all levels of the telescoping ring buffer)
+    L1RB_SPILL = 0x10000000000,
 };
 
+// Returns the l1_ringbuf_level bit for level n of the telescoping ring buffer, where n=1 is
+// the original intensity data, n=2 is downsampled by 2, etc.  Valid for 1 <= n <= max_telescoping_levels.
+inline uint64_t l1_ringbuf_level_bit(int n)
+{
+    return (n < 8) ? (uint64_t(1) << n) : (uint64_t(1) << (n+1));
+}
+
 
 extern void pin_thread_to_cores(const std::vector<int> &core_list);
 
+// Allocates 'nbytes' of zeroed, prefaulted memory backed by huge pages of size 'huge_page_size'
+// (e.g. 2MB or 1GB).  Explicit huge pages (mmap with MAP_HUGETLB) are tried first, which requires
+// pages to be reserved (e.g. /proc/sys/vm/nr_hugepages).  If this fails, we fall back to an
+// ordinary mapping with madvise(MADV_HUGEPAGE), i.e. transparent huge pages.  On return,
+// 'page_size' is the page size actually obtained: either huge_page_size, or the base page size
+// in the fallback case (in which the kernel may or may not use transparent huge pages).
+// The allocation is rounded up to a multiple of huge_page_size.
+extern memory_slab_t huge_page_alloc(ssize_t nbytes, ssize_t huge_page_size, ssize_t &page_size);
+
+// Allocates with huge_page_alloc() if huge_page_size is nonzero, otherwise with aligned_alloc().
+extern memory_slab_t alloc_memory_slab(ssize_t nbytes, ssize_t huge_page_size=0);
+
+// NUMA topology, read from /sys/devices/system/node.  If this information is unavailable
+// (e.g. osx), there is a single node 0, containing all cores.
+extern std::vector<int> get_numa_nodes();
+extern std::vector<int> get_numa_node_cores(int node);
+extern int get_current_numa_node();    // node of the core the calling thread is running on
+
 
 // Utility routine: converts a string to type T (only a few T's are defined; see lexical_cast.cpp)
 // Returns true on success, false on failure
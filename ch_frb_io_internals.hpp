@@ -7,9 +7,11 @@
 
 #include <cmath>
 #include <cstring>
+#include <algorithm>
 #include <sstream>
 #include <iostream>
 #include <stdexcept>
+#include <exception>
 #include <memory>
 
 #include <errno.h>
@@ -169,7 +171,7 @@ struct udp_packet_list {
     //   off_buf[curr_npackets] = curr_nbytes
     // so that the i-th packet always has size (off_buf[i+1] - off_buf[i])
 
-    std::unique_ptr<uint8_t[]> buf;   // points to an array of length (max_nbytes + max_packet_size).
+    memory_slab_t buf;                // points to an array of length (max_nbytes + max_packet_size).
     std::unique_ptr<int[]> off_buf;   // points to an array of length (max_npackets + 1).
 
     // Bare pointers.
@@ -177,7 +179,8 @@ struct udp_packet_list {
     uint8_t *data_end = nullptr;      // points to &buf[curr_nbytes]
     int *packet_offsets = nullptr;    // points to &off_buf[0].  Note that packet_offsets[npackets] is always equal to 'nbytes'.
 
-    udp_packet_list(int max_npackets, int max_nbytes);
+    // If 'huge_page_size' is nonzero, 'buf' is backed by huge pages (see huge_page_alloc()).
+    udp_packet_list(int max_npackets, int max_nbytes, ssize_t huge_page_size=0);
 
     // Accessors (not range-checked)
     inline uint8_t *get_packet_data(int i)  { return data_start + packet_offsets[i]; }
@@ -202,6 +205,7 @@ struct udp_packet_ringbuf : noncopyable {
     const int ringbuf_capacity;
     const int max_npackets_per_list;
     const int max_nbytes_per_list;
+    const ssize_t huge_page_size;
 
     pthread_mutex_t lock;
     pthread_cond_t cond_packets_added;
@@ -212,7 +216,7 @@ struct udp_packet_ringbuf : noncopyable {
     int ringbuf_pos = 0;
     std::vector<std::unique_ptr<udp_packet_list> > ringbuf;
 
-    udp_packet_ringbuf(int ringbuf_capacity, int max_npackets_per_list, int max_nbytes_per_list);
+    udp_packet_ringbuf(int ringbuf_capacity, int max_npackets_per_list, int max_nbytes_per_list, ssize_t huge_page_size=0);
     ~udp_packet_ringbuf();
     
     // Note!  The pointer 'p' is _swapped_ with an empty udp_packet_list from the ring buffer.
@@ -223,6 +227,9 @@ struct udp_packet_ringbuf : noncopyable {
 
     void get_size(int* currsize, int* maxsize);
 
+    // Memory accounting: total size of the packet buffers in the ring buffer, and bytes of queued packets.
+    void get_memory_accounting(int64_t &nbytes_allocated, int64_t &nbytes_queued);
+
     // Note!  The pointer 'p' is _swapped_ with the udp_packet_list which is extracted from the ring buffer.
     // In other words, when get_packet_list() returns, the original udp_packet_list will be "recycled" (rather than freed).
     // Returns true on success (possibly after blocking), returns false if ring buffer is empty and stream has ended.
@@ -244,6 +251,42 @@ struct udp_packet_ringbuf : noncopyable {
 // It also manages the "active" assembled_chunks, which are being filled with data as new packets arrive.
 // There is one assembled_chunk_ringbuf for each beam.
 
+
+// An immutable copy of the telescoping ring buffer, which is published by the assembler thread
+// after each modification (see assembled_chunk_ringbuf::_put_assembled_chunk()).  RPC-type readers
+// (get_ringbuf_size(), get_ringbuf_snapshot(), find_assembled_chunk()) use the most recently
+// published ringbuf_state, and never acquire the ring buffer lock.
+//
+// Old states are reclaimed by shared_ptr reference counting, so a reader holding a state keeps
+// its chunks alive until it is done.  This is the same semantics as get_ringbuf_snapshot().
+
+struct ringbuf_state {
+    typedef std::vector<std::shared_ptr<assembled_chunk>> chunk_list;
+
+    // level(ids) contains the chunks in level 'ids' of the telescoping ring buffer, in time order.
+    // Chunks in level 0 are contiguous: level(0)[n]->ichunk == level(0)[0]->ichunk + n.  Later levels
+    // are usually contiguous too, but can have gaps if chunks were dropped under memory pressure.
+    //
+    // Each level is immutable, and shared between successive states, so that publishing a new state
+    // only copies the levels which changed (usually just level 0).
+    std::vector<std::shared_ptr<const chunk_list>> levels;
+
+    const chunk_list &level(int ids) const { return *levels[ids]; }
+
+    int pos0 = 0;             // ring buffer position of level(0)[0] (compare with downstream_pos)
+    bool doneflag = false;
+    uint64_t final_fpga = 0;  // only meaningful if doneflag is set
+
+    // Time index.  find() uses O(1) ichunk arithmetic if there are no gaps, and binary search otherwise.
+    //
+    // find(): returns index of chunk in level 'ids' starting at 'ichunk', or -1 if absent.
+    // get_range(): returns half-open index range [n0, n1) of chunks in level 'ids' which overlap
+    //   [min_fpga_counts, max_fpga_counts], with zero meaning "unbounded" as in get_ringbuf_snapshot().
+    int find(int ids, uint64_t ichunk) const;
+    void get_range(int ids, uint64_t min_fpga_counts, uint64_t max_fpga_counts, uint64_t fpga_per_ichunk, int &n0, int &n1) const;
+};
+
+
 class assembled_chunk_ringbuf : noncopyable,
                                 public std::enable_shared_from_this<assembled_chunk_ringbuf> {
 public:
@@ -299,6 +342,16 @@ public:
 
     void get_streamed_chunks(int &achunks, size_t &abytes);
 
+    // Memory pressure counters: chunks allocated on the heap (since no slab was available), chunks evicted early,
+    // chunks dropped from levels >= 1 (since no memory was available for downsampling), and the heap memory
+    // currently held by fallback chunks (see initializer::max_pool_fallbacks).
+    void get_memory_pressure_counts(int64_t &nfallbacks, int64_t &nreclaimed, int64_t &ndropped, int64_t &nbytes_fallback);
+
+    // Memory accounting: chunks and bytes (see assembled_chunk::get_memory_nbytes()) held by each level of the
+    // telescoping ring buffer, and the number of these chunks which hold a pool slab.  The vectors are resized to
+    // num_downsampling_levels.  Lock-free (uses the published ringbuf_state).
+    void get_memory_residency(std::vector<int64_t> &level_nchunks, std::vector<int64_t> &level_nbytes, int64_t &nslabs);
+
     // Debugging: print state
     void print_state();
 
@@ -308,6 +361,48 @@ public:
     // to indicate end-of-stream.
     std::shared_ptr<assembled_chunk> get_assembled_chunk(bool wait=true);
 
+    // Nonblocking variant of get_assembled_chunk(), used for time-aligned multi-beam batches (see
+    // intensity_network_stream::get_assembled_chunk_batch()).  If the chunk with the given 'ichunk' is in
+    // ringbuf[0] at or after the "downstream" position, it is returned, and the downstream position is
+    // advanced past it.  Older chunks are skipped, and counted in 'nskipped'.  Otherwise, an empty pointer is
+    // returned, and 'missing' is set to true if the chunk will never arrive (a later chunk has already been
+    // queued, or the stream has ended).
+    std::shared_ptr<assembled_chunk> get_assembled_chunk_at(uint64_t ichunk, bool &missing, int &nskipped);
+
+    // Called by processing threads, via intensity_network_stream::get_assembled_subchunk().
+    // Returns the next time slice (see ini_params.subchunk_nt), blocking if necessary to wait for data.
+    // Returns an empty pointer at end-of-stream, or if 'wait' is false and no slice is ready.
+    std::shared_ptr<assembled_subchunk> get_assembled_subchunk(bool wait=true);
+
+    // Returns true if get_assembled_chunk() would return without blocking, i.e. either a chunk
+    // is ready, or the ring buffer is empty and end_stream() has been called.
+    bool assembled_chunk_ready();
+
+    // Optional callback, called (without the lock held) whenever a new chunk is added to ringbuf[0],
+    // and when end_stream() is called.  Used by intensity_network_stream to wake up threads waiting
+    // on several beams.  Must be set before the assembler thread starts.
+    void set_chunks_added_callback(const std::function<void()> &callback);
+
+    // Named consumer cursors.  In addition to the "downstream" consumer above, any number of named
+    // consumers can read the stream of assembled_chunks, each with its own position in ringbuf[0] and
+    // its own buffering capacity 'bufsize' (default ini_params.assembled_ringbuf_capacity, and at most
+    // the size of ringbuf[0]).  If a consumer falls behind by more than 'bufsize' chunks, chunks are
+    // dropped for that consumer only.  Chunks are shared between consumers, not copied.
+    //
+    // A new consumer starts with the next chunk to be assembled.  The chunks returned to a named consumer
+    // must be treated as read-only, since they are shared with the downstream consumer.
+    void add_consumer(const std::string &name, int bufsize=0);
+    void remove_consumer(const std::string &name);
+    std::shared_ptr<assembled_chunk> get_consumer_chunk(const std::string &name, bool wait=true);
+
+    struct consumer_counts {
+	int64_t nretrieved = 0;   // chunks returned by get_consumer_chunk()
+	int64_t ndropped = 0;     // chunks dropped because the consumer fell behind
+	int nready = 0;           // chunks currently available to the consumer
+    };
+
+    consumer_counts get_consumer_counts(const std::string &name);
+
     // Find an assembled_chunk with the given fpgacounts start time, if it exists in the ring buffer.
     // Called by processing threads, in order to fill the RFI mask.
     // Returns an empty pointer iff stream has ended, and chunk is requested past end-of-stream.
@@ -318,6 +413,22 @@ public:
     // The return value is a vector of (chunk, where) pairs, where 'where' is of type enum l1_ringbuf_level (defined in ch_frb_io.hpp)
     std::vector<std::pair<std::shared_ptr<assembled_chunk>, uint64_t>> get_ringbuf_snapshot(uint64_t min_fpga_counts=0, uint64_t max_fpga_counts=0);
 
+    // Same as above, but the snapshot is written into a caller-supplied vector, which is cleared first.
+    // Callers which keep 'out' around between calls (e.g. RPC servers) avoid reallocating it every time.
+    void get_ringbuf_snapshot(std::vector<std::pair<std::shared_ptr<assembled_chunk>, uint64_t>> &out, uint64_t min_fpga_counts, uint64_t max_fpga_counts);
+
+    // Range query: calls visitor(chunk, where) for each chunk overlapping [min_fpga_counts, max_fpga_counts],
+    // in time order, where 'where' is as in get_ringbuf_snapshot().  (A zero min/max means "unbounded".)
+    // The range in each level is computed by ichunk arithmetic, so only overlapping chunks are visited.
+    // Chunks in the spill file are only visited if both min_fpga_counts and max_fpga_counts are nonzero.
+    // Compressed chunks are decompressed one at a time (on the heap, not from the memory_slab_pools),
+    // whereas get_ringbuf_snapshot() returns them compressed.
+    //
+    // The visitor is called on the most recently published ringbuf_state, without the lock held,
+    // so a slow visitor does not delay the assembler thread.
+    typedef std::function<void(const std::shared_ptr<assembled_chunk> &, uint64_t)> ringbuf_visitor_t;
+    void visit_ringbuf(uint64_t min_fpga_counts, uint64_t max_fpga_counts, const ringbuf_visitor_t &visitor);
+
     // Returns stats about the ring buffer, for the get_statistics RPC.
     //  *ringbuf_fpga_next* is the FPGA-counts of the next chunk that will be delivered to get_assembled_chunk().
     //  *ringbuf_n_ready* is the number of chunks available to be consumed by get_assembled_chunk().
@@ -326,6 +437,8 @@ public:
     //  *ringbuf_fpga_min* is the smallest FPGA-counts number available in the ring buffer (including ones that have already been consumed by get_assembled_chunk().)
     //  *ringbuf_fpga_max* is the largest FPGA-counts number available in the ring buffer (including ones that have already been consumed by get_assembled_chunk().).  This includes the number of FPGA samples in the chunks.
     //
+    // These stats are computed from the published ringbuf_state, without acquiring the lock.
+    //
     // If *level* is specified, then returns *capacity*, *nelements*,
     // *fpga_min* and *fpga_max* for one level of the ringbuffer;
     // level=1 is the original intensity data, level=2 is
@@ -343,6 +456,10 @@ protected:
     const int beam_id;
     const int stream_id;   // only used in assembled_chunk::format_filename().
 
+    // Built from ini_params.coarse_freq_ids, and shared by all chunks (empty if the stream has the full band).
+    const std::shared_ptr<const coarse_freq_map> freq_map;
+    const int nfreq_coarse;
+
     uint64_t frame0_nano; // nanosecond time() value for fgpacount zero
     
     output_device_pool output_devices;
@@ -350,19 +467,90 @@ protected:
     // Set to 'true' in the first call to put_unassembled_packet().
     bool first_packet_received = false;
 
+    // NUMA node of the assembler thread, recorded when the first packet is received, and used
+    // to allocate chunks from a NUMA-aware memory_slab_pool (-1 means the calling thread's node).
+    std::atomic<int> numa_node{-1};
+
     // Helper function called in assembler thread, to add a new assembled_chunk to the ring buffer.
     // Resets 'chunk' to a null pointer.
     // Warning: only safe to call from assembler thread.
     bool _put_assembled_chunk(std::unique_ptr<assembled_chunk> &chunk, int64_t *event_counts);
 
+    // Helpers for _put_assembled_chunk(), also called from _downsampling_task().
+    // See comments in assembled_chunk_ringbuf.cpp.
+    void _prepare_downsampling(std::vector<std::shared_ptr<assembled_chunk>> &pushlist, std::vector<std::shared_ptr<assembled_chunk>> &poplist, int size0);
+    int _update_ringbuf(const std::vector<std::shared_ptr<assembled_chunk>> &pushlist, const std::vector<std::shared_ptr<assembled_chunk>> &poplist);
+
+    // Scratch pushlist/poplist vectors, reused so that adding a chunk doesn't allocate.  The first pair
+    // is used by the assembler thread (in _put_assembled_chunk()), the second by _downsampling_task().
+    std::vector<std::shared_ptr<assembled_chunk>> asm_pushlist;
+    std::vector<std::shared_ptr<assembled_chunk>> asm_poplist;
+    std::vector<std::shared_ptr<assembled_chunk>> ds_pushlist;
+    std::vector<std::shared_ptr<assembled_chunk>> ds_poplist;
+
+    // Sub-chunk streaming delivery (if ini_params.subchunk_nt is nonzero).  Called by assembler thread.
+    void _count_subchunk_packet(const intensity_packet &packet, int iactive, uint64_t packet_t0);
+    void _put_subchunks(uint64_t end);
+
+    // Asynchronous downsampling (if ini_params.downsampling_pool is non-null).
+    void _downsampling_task();
+    void _wait_for_downsampling(bool all);
+
     // For debugging.
     // Warning: only safe to call from assembler thread.
     void _check_invariants();
     
     // Helper function: allocates new assembled chunk (from a memory_slab_pool, if one has been
-    // specified in ini_params::memory_pool).  For now, an exception is thrown if the allocation
-    // fails.  (FIXME: add code to recover gracefully.)
-    std::unique_ptr<assembled_chunk> _make_assembled_chunk(uint64_t ichunk, int binning, bool zero=true);
+    // specified in ini_params::memory_pool).  If no slab can be obtained, the assembled_chunk
+    // allocates its own memory instead, depending on 'mode':
+    //
+    //   alloc_active: chunks being assembled from packets.  The memory is reserved in 'fallback_nbytes',
+    //     even beyond 'max_fallback_nbytes', since level 0 can't have gaps.  (This is bounded by the
+    //     capacity of level 0, since the other modes don't exceed 'max_fallback_nbytes'.)
+    //   alloc_downsampled: chunks in levels >= 1.  The memory is reserved in 'fallback_nbytes', and an
+    //     empty pointer is returned if it would exceed 'max_fallback_nbytes'.
+    //   alloc_temporary: short-lived chunks in _prepare_downsampling() (at most four at a time), which
+    //     are not counted.
+    //   alloc_heap: never uses the pools (used for chunks read back from the spill file by RPCs).
+    //
+    // In the first two cases, 'num_pool_fallbacks' is incremented.  No exception is thrown if memory
+    // is exhausted, so that memory pressure never kills the assembler.
+    //
+    // If 'nupfreq' is zero, then it is determined by the binning (see telescoping_freq_binning), otherwise
+    // it is overridden (used for temporary chunks in _prepare_downsampling()).
+    enum alloc_mode { alloc_active, alloc_downsampled, alloc_temporary, alloc_heap };
+    std::unique_ptr<assembled_chunk> _make_assembled_chunk(uint64_t ichunk, int binning, bool zero=true, int nupfreq=0, alloc_mode mode=alloc_active);
+    bool _reserve_fallback(ssize_t nbytes, bool force);
+
+    // If 'chunk' has been compressed or requantized (see ini_params.telescoping_compression_level and
+    // ini_params.telescoping_requantize_level), returns a new, decompressed copy (from a memory_slab_pool
+    // if possible).  Otherwise returns 'chunk' itself.  Used by the assembler, not by the RPC-facing
+    // lookups, which decompress on the heap (see visit_ringbuf()).
+    std::shared_ptr<assembled_chunk> _decompressed(const std::shared_ptr<assembled_chunk> &chunk);
+
+    void _visit_ringbuf(uint64_t min_fpga_counts, uint64_t max_fpga_counts, const ringbuf_visitor_t &visitor, bool decompress);
+
+    // Helpers for ini_params.spill_file.
+    void _spill(const std::shared_ptr<assembled_chunk> &chunk);
+    std::shared_ptr<assembled_chunk> _read_spilled(const chunk_spill_file::record &rec);
+
+    // Value of 'nupfreq' in each level of the telescoping ring buffer (length num_downsampling_levels).
+    std::vector<int> level_nupfreq;
+
+    // All memory_slab_pools (ini_params.memory_pool and ini_params.small_memory_pools), sorted by slab size.
+    std::vector<std::shared_ptr<memory_slab_pool>> memory_pools;
+
+    // Memory pressure handling.  'pool_clients' is parallel to 'memory_pools' (see memory_slab_pool::add_client()).
+    // The pools' reclaim callbacks add to 'reclaim_request', and the writer of the ring buffer evicts that many
+    // chunks from its last level in the next _prepare_downsampling().  (The counter is in a shared_ptr, so that
+    // a callback can safely outlive the ring buffer.)
+    std::vector<int> pool_clients;
+    std::shared_ptr<std::atomic<ssize_t>> reclaim_request;
+    std::atomic<int64_t> num_pool_fallbacks{0};   // chunks allocated on the heap, since no slab was available
+    std::shared_ptr<std::atomic<int64_t>> fallback_nbytes;   // heap memory currently held by these chunks
+    int64_t max_fallback_nbytes = 0;                          // see initializer::max_pool_fallbacks
+    std::atomic<int64_t> num_pool_drops{0};       // chunks dropped from levels >= 1, see _prepare_downsampling()
+    std::atomic<int64_t> num_reclaimed{0};        // chunks evicted early under memory pressure
 
     // The "active" chunks are in the process of being filled with data as packets arrive.
     // Currently we take the active window to be two assembled_chunks long, but this could be generalized.
@@ -371,19 +559,54 @@ protected:
     std::unique_ptr<assembled_chunk> active_chunk0;
     std::unique_ptr<assembled_chunk> active_chunk1;
 
+    // See set_chunks_added_callback().
+    std::function<void()> chunks_added_callback;
+
+    // Sub-chunk streaming delivery (see ini_params.subchunk_nt).  These fields are only accessed by the
+    // assembler thread.  Slices are indexed by (ichunk * subchunks_per_chunk + slice index within chunk).
+    // The length-(2*subchunks_per_chunk) vector 'subchunk_counts' counts (coarse frequency, packet) pairs
+    // received in each slice of active_chunk0 and active_chunk1.
+    int subchunks_per_chunk = 0;      // zero if sub-chunk delivery is disabled
+    int subchunk_nexpected = 0;       // value of subchunk_counts[] for a complete slice
+    uint64_t next_subchunk = 0;       // next slice to be delivered
+    uint64_t subchunk_max_t = 0;      // largest time sample received in the active chunks (plus one)
+    std::vector<int> subchunk_counts;
+
+    // Slices are recycled through a fixed set of assembled_subchunks (see _put_subchunks()).
+    struct subchunk_free_list;
+    std::shared_ptr<subchunk_free_list> subchunk_free;
+
+    // True if ini_params.downsampling_pool is non-null, and there are levels to downsample.
+    bool async_downsampling = false;
+
     // Not sure if this really affects bottom-line performance, but thought it would be a good idea
     // to ensure that the "assembler-only" and "shared" fields were on different cache lines.
     char pad[constants::cache_line_size];
 
+    // Serializes modifications of the ring buffer, between the assembler thread and the downsampling
+    // task.  Always acquired before 'lock'.  Readers and the "downstream" thread don't need it.
+    std::mutex writer_lock;
+
     // All fields below are protected by the lock
     pthread_mutex_t lock;
 
     // Processing thread waits here if the ring buffer is empty.
     pthread_cond_t cond_assembled_chunks_added;
+
+    // Processing thread waits here if 'subchunks' is empty.
+    pthread_cond_t cond_subchunks_added;
+    std::deque<std::shared_ptr<assembled_subchunk>> subchunks;
+    int64_t num_subchunks_dropped = 0;
+
+    // Assembler thread waits here if level 0 is full, while a downsampling task is in flight.
+    pthread_cond_t cond_downsampling_done;
+    bool ds_in_flight = false;
+    std::exception_ptr ds_error;
     
     // Telescoping ring buffer.
     // All ringbuf* vectors have length num_downsampling_levels.
-    // ringbuf[i] is a vector of length ringbuf_capacity[i]
+    // ringbuf[i] is a vector of length ringbuf_capacity[i], except that ringbuf[0] has two
+    // extra slots if 'async_downsampling' is set (see _put_assembled_chunk()).
 
     int num_downsampling_levels;
     std::vector<int> ringbuf_pos;
@@ -391,14 +614,35 @@ protected:
     std::vector<int> ringbuf_capacity;
     std::vector<std::vector<std::shared_ptr<assembled_chunk>>> ringbuf;
 
-    int downstream_pos;      // Position of "downstream" thread in ringbuf[0]
+    // Position of "downstream" thread in ringbuf[0].  Modified with the lock held, but atomic so that
+    // readers of the published ringbuf_state can also read it without the lock.
+    std::atomic<int> downstream_pos;
+
     int downstream_bufsize;  // Buffering capacity (in assembled_chunks) between assembler and downstream.
 
+    // Named consumers (see add_consumer()).  Protected by 'lock'.
+    struct consumer_cursor {
+	int pos = 0;
+	int bufsize = 0;
+	consumer_counts counts;
+    };
+
+    std::map<std::string, consumer_cursor> consumers;
+
     inline std::shared_ptr<assembled_chunk> &ringbuf_entry(int ids, int ipos)
     {
-	return ringbuf[ids][ipos % ringbuf_capacity[ids]];
+	return ringbuf[ids][ipos % ringbuf[ids].size()];
     }
 
+    // Most recently published ringbuf_state (see above).  Must be accessed with std::atomic_load()
+    // and std::atomic_exchange().  New states are published in _update_ringbuf() and end_stream().
+    std::shared_ptr<const ringbuf_state> published_state;
+
+    // Helper for the assembler thread: returns the ringbuf_state which will result from applying
+    // pushlist/poplist (see _put_assembled_chunk()) to the most recently published state.
+    std::shared_ptr<ringbuf_state> _make_next_state(const std::vector<std::shared_ptr<assembled_chunk>> &pushlist,
+						    const std::vector<std::shared_ptr<assembled_chunk>> &poplist);
+
     // Are we streaming data to disk?  (Note: these fields require the lock for either read or write access.)
     std::string stream_pattern;
     int stream_priority = 0;
@@ -427,6 +671,41 @@ extern void ds_slow_kernel2(const float *in_data, const int *in_mask, float *w0,
 extern void ds_slow_kernel3(uint8_t *out, const float *data, const int *mask, const float *enc_off, 
 			    const float *enc_scal, int nupfreq, int nt_per_chunk, int nt_per_packet);
 
+// Frequency downsampling kernel: averages groups of 'fbinning' consecutive rows of 8-bit data, where
+// each row has length nt_per_chunk.  If any input sample is masked (0x00 or 0xff), the output is masked (0x00).
+extern void ds_slow_kernel_freq(uint8_t *out, const uint8_t *in, int nrows_out, int fbinning, int nt_per_chunk);
+
+// Scratch space for assembled_chunk::downsample().  Each thread has its own workspace, which is
+// grown as needed (and never shrunk), so that the scratch isn't part of every chunk's memory slab.
+// The pointers are valid until the calling thread's next call to get_downsampling_workspace().
+struct downsampling_workspace {
+    float *ds_data = nullptr;  // 2d array of shape (nupfreq, nt_per_chunk/2)
+    int *ds_mask = nullptr;    // 2d array of shape (nupfreq, nt_per_chunk/2)
+    float *ds_w2 = nullptr;    // 1d array of length (nt_coarse/2)
+};
+
+extern downsampling_workspace get_downsampling_workspace(int nupfreq, int nt_per_chunk, int nt_coarse);
+
+// 4-bit requantization, used for the deep levels of the telescoping ring buffer.
+//
+// requantize_4bit() reads an (nfreq_coarse * nupfreq, nt_per_chunk) array of 8-bit data, with
+// per-(coarse freq, t_coarse) scales and offsets, and writes the data packed two samples per byte (low
+// nibble first), with new scales and offsets.  In each (coarse freq, t_coarse) block, the range of unmasked
+// 8-bit values is mapped onto 4-bit values 1..14, so the error is at most half of the new scale.  As in the
+// 8-bit case, the values 0x0 and 0xf denote masked samples.
+//
+// expand_4bit() is the inverse: it writes 8-bit data, with scales and offsets adjusted so that the 4-bit
+// values are represented exactly.  The 'in' and 'out' pointers can be (out + ndata/2) and 'out' respectively,
+// i.e. the packed data can be expanded in place if it is stored in the second half of the output array.
+
+extern void requantize_4bit(uint8_t *out, float *out_scales, float *out_offsets, const uint8_t *in, const float *in_scales, 
+			    const float *in_offsets, int nupfreq, int nt_per_chunk, int nt_per_packet,
+			    int nfreq_coarse=constants::nfreq_coarse_tot);
+
+extern void expand_4bit(uint8_t *out, float *out_scales, float *out_offsets, const uint8_t *in, const float *in_scales, 
+			const float *in_offsets, int nupfreq, int nt_per_chunk, int nt_per_packet,
+			int nfreq_coarse=constants::nfreq_coarse_tot);
+
 
 // -------------------------------------------------------------------------------------------------
 //
@@ -584,6 +863,168 @@ inline std::unique_ptr<T[]> aligned_unique_ptr(size_t nelts)
     return std::unique_ptr<T[]> (aligned_alloc<T> (nelts));
 }
 
+
+// Recycling of the small fixed-size objects which are allocated and freed for every chunk (assembled_chunk
+// objects, shared_ptr control blocks, write requests), so that the assembler thread doesn't call malloc().
+//
+// A block_free_list<N> keeps up to 'max_blocks' freed blocks of N bytes in a shared list, with a small
+// per-thread cache in front of it (like the magazines in memory_slab_pool), so that the shared lock is
+// only taken once per 'cache_size/2' allocations or deallocations.  Chunks are usually freed by a
+// different thread than the one which allocated them, so blocks flow from the freeing thread's cache to
+// the allocating thread's cache through the shared list.  When a thread exits, its cache is flushed to
+// the shared list.  The shared list is never destroyed, so that objects can safely be freed during static
+// destruction (or after the calling thread's cache has been flushed).
+
+template<size_t N>
+class block_free_list {
+public:
+    static const size_t max_blocks = 1024;
+    static const int cache_size = 32;
+
+    static void *allocate()
+    {
+	thread_cache *tc = _get_thread_cache();
+	void *p = nullptr;
+
+	if (!tc)
+	    return _get().pop(&p, 1) ? p : ::operator new(N);
+
+	if (tc->n == 0)
+	    tc->n = _get().pop(tc->blocks, cache_size/2);
+
+	if (tc->n > 0)
+	    return tc->blocks[--tc->n];
+
+	return ::operator new(N);
+    }
+
+    static void deallocate(void *p)
+    {
+	thread_cache *tc = _get_thread_cache();
+
+	if (!tc) {
+	    _get().push(&p, 1);
+	    return;
+	}
+
+	// Flush the least recently freed half of the cache to the shared list.
+	if (tc->n == cache_size) {
+	    _get().push(tc->blocks, cache_size/2);
+	    std::copy(tc->blocks + cache_size/2, tc->blocks + cache_size, tc->blocks);
+	    tc->n -= cache_size/2;
+	}
+
+	tc->blocks[tc->n++] = p;
+    }
+
+protected:
+    std::mutex lock;
+    std::vector<void *> blocks;
+
+    // Trivially destructible, so that it can still be used while the thread is exiting.
+    struct thread_cache {
+	void *blocks[cache_size];
+	int n;
+	int state;   // 0 = not yet registered, 1 = active, 2 = flushed on thread exit
+    };
+
+    struct thread_cache_flusher {
+	thread_cache *tc = nullptr;
+
+	~thread_cache_flusher()
+	{
+	    _get().push(tc->blocks, tc->n);
+	    tc->n = 0;
+	    tc->state = 2;
+	}
+    };
+
+    block_free_list() { blocks.reserve(max_blocks); }
+
+    static block_free_list &_get()
+    {
+	static block_free_list *fl = new block_free_list();
+	return *fl;
+    }
+
+    // Returns the calling thread's cache, or a null pointer if the thread is exiting.
+    static thread_cache *_get_thread_cache()
+    {
+	static thread_local thread_cache tc;
+
+	if (tc.state == 0) {
+	    static thread_local thread_cache_flusher f;
+	    f.tc = &tc;
+	    tc.state = 1;
+	}
+
+	return (tc.state == 1) ? &tc : nullptr;
+    }
+
+    // Moves up to 'n' blocks from the shared list to 'out', and returns the number moved.
+    int pop(void **out, int n)
+    {
+	std::lock_guard<std::mutex> lg(this->lock);
+
+	n = std::min(n, int(blocks.size()));
+	std::copy(blocks.end() - n, blocks.end(), out);
+	blocks.resize(blocks.size() - n);
+	return n;
+    }
+
+    // Moves 'n' blocks to the shared list, freeing the ones which don't fit.
+    void push(void **in, int n)
+    {
+	std::unique_lock<std::mutex> ul(this->lock);
+
+	int m = std::min(n, int(max_blocks - blocks.size()));
+	blocks.insert(blocks.end(), in, in + m);
+	ul.unlock();
+
+	for (int i = m; i < n; i++)
+	    ::operator delete(in[i]);
+    }
+};
+
+
+// An allocator which takes single objects from a block_free_list, for use with std::allocate_shared(),
+// or as the control block allocator in the std::shared_ptr constructor (see recycled_shared_ptr()).
+template<typename T>
+struct recycling_allocator {
+    typedef T value_type;
+
+    recycling_allocator() { }
+    template<typename U> recycling_allocator(const recycling_allocator<U> &) { }
+
+    T *allocate(size_t n)
+    {
+	if (n == 1)
+	    return reinterpret_cast<T *> (block_free_list<sizeof(T)>::allocate());
+	return reinterpret_cast<T *> (::operator new(n * sizeof(T)));
+    }
+
+    void deallocate(T *p, size_t n)
+    {
+	if (n == 1)
+	    block_free_list<sizeof(T)>::deallocate(p);
+	else
+	    ::operator delete(p);
+    }
+};
+
+template<typename T, typename U>
+inline bool operator==(const recycling_allocator<T> &, const recycling_allocator<U> &) { return true; }
+
+template<typename T, typename U>
+inline bool operator!=(const recycling_allocator<T> &, const recycling_allocator<U> &) { return false; }
+
+// Converts unique_ptr -> shared_ptr (resetting 'p' to a null pointer), with a recycled control block.
+template<typename T>
+inline std::shared_ptr<T> recycled_shared_ptr(std::unique_ptr<T> &&p)
+{
+    return std::shared_ptr<T> (p.release(), std::default_delete<T> (), recycling_allocator<T> ());
+}
+
 template<typename T, typename... Args>
 std::unique_ptr<T> make_unique(Args&& ...args)
 {
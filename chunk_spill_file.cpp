@@ -0,0 +1,314 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <cstring>
+
+#include "ch_frb_io_internals.hpp"
+#include "chlog.hpp"
+
+using namespace std;
+
+namespace ch_frb_io {
+#if 0
+};  // pacify emacs c-mode!
+#endif
+
+
+// Records are aligned to this many bytes in the spill file.
+static constexpr ssize_t spill_alignment = 4096;
+
+
+chunk_spill_file::chunk_spill_file(const string &filename_, ssize_t nbytes_, int verbosity_, int write_queue_capacity_) :
+    filename(filename_),
+    nbytes(nbytes_),
+    verbosity(verbosity_),
+    write_queue_capacity(write_queue_capacity_)
+{
+    if (filename.size() == 0)
+	throw runtime_error("ch_frb_io: chunk_spill_file constructor: empty filename");
+    if ((nbytes <= 0) || (nbytes % spill_alignment))
+	throw runtime_error("ch_frb_io: chunk_spill_file constructor: nbytes must be a positive multiple of " + to_string(spill_alignment));
+    if (write_queue_capacity <= 0)
+	throw runtime_error("ch_frb_io: chunk_spill_file constructor: write_queue_capacity must be > 0");
+
+    this->fd = open(filename.c_str(), O_RDWR | O_CREAT, 0644);
+
+    if (fd < 0)
+	throw runtime_error("ch_frb_io: chunk_spill_file: couldn't open " + filename + ": " + strerror(errno));
+
+    // Preallocate, so that writes don't fail later due to lack of disk space.
+    int err = posix_fallocate(fd, 0, nbytes);
+
+    if (err) {
+	close(fd);
+	throw runtime_error("ch_frb_io: chunk_spill_file: couldn't allocate " + to_string(nbytes) + " bytes in " + filename + ": " + strerror(err));
+    }
+
+    if (verbosity >= 1)
+	chlog("Opened spill file " << filename << " (" << nbytes << " bytes)");
+
+    this->writer = std::thread(&chunk_spill_file::writer_main, this);
+}
+
+
+chunk_spill_file::~chunk_spill_file()
+{
+    unique_lock<std::mutex> ulock(this->lock);
+    this->stopping = true;
+    this->cv.notify_all();
+    ulock.unlock();
+
+    writer.join();
+
+    close(fd);
+    fd = -1;
+}
+
+
+bool chunk_spill_file::enqueue_chunk(const shared_ptr<assembled_chunk> &chunk)
+{
+    if (!chunk)
+	throw runtime_error("ch_frb_io: chunk_spill_file::enqueue_chunk(): null pointer");
+
+    lock_guard<std::mutex> lg(this->lock);
+
+    if (ssize_t(queue.size()) >= write_queue_capacity) {
+	this->num_dropped++;
+	return false;
+    }
+
+    queue.push_back(chunk);
+    this->cv.notify_all();
+    return true;
+}
+
+
+int64_t chunk_spill_file::get_num_dropped()
+{
+    lock_guard<std::mutex> lg(this->lock);
+    return num_dropped;
+}
+
+
+// Called as separate thread!
+void chunk_spill_file::writer_main()
+{
+    for (;;) {
+	unique_lock<std::mutex> ulock(this->lock);
+
+	while (!stopping && queue.empty())
+	    cv.wait(ulock);
+
+	// When 'stopping' is set, we still drain the queue before exiting.
+	if (queue.empty())
+	    return;
+
+	shared_ptr<assembled_chunk> chunk = queue.front();
+	ulock.unlock();
+
+	try {
+	    // The decompressed copy is on the heap, and only lives until the write completes.
+	    if (chunk->is_compressed())
+		this->_write_chunk(chunk->make_decompressed().get(), true);
+	    else
+		this->_write_chunk(chunk.get(), true);
+	} catch (std::exception &e) {
+	    chlog("chunk_spill_file: failed to write chunk to " << filename << ": " << e.what());
+	    ulock.lock();
+	    queue.pop_front();
+	}
+    }
+}
+
+
+// Static member function.
+ssize_t chunk_spill_file::_record_nbytes(const assembled_chunk *chunk)
+{
+    ssize_t n = 2 * chunk->nscales * sizeof(float) + chunk->nrfimaskbytes + chunk->ndata;
+    return ((n + spill_alignment - 1) / spill_alignment) * spill_alignment;
+}
+
+
+void chunk_spill_file::write_chunk(const assembled_chunk *chunk)
+{
+    this->_write_chunk(chunk, false);
+}
+
+
+// If 'pop_queue' is true, the chunk is the front of the queue (see writer_main()), and is removed from
+// the queue when the write fails or becomes visible in the index.
+void chunk_spill_file::_write_chunk(const assembled_chunk *chunk, bool pop_queue)
+{
+    if (!chunk)
+	throw runtime_error("ch_frb_io: chunk_spill_file::write_chunk(): null pointer");
+    if (chunk->is_compressed())
+	throw runtime_error("ch_frb_io: chunk_spill_file::write_chunk(): chunk must be decompressed first");
+
+    record rec;
+    rec.beam_id = chunk->beam_id;
+    rec.nupfreq = chunk->nupfreq;
+    rec.nrfifreq = chunk->nrfifreq;
+    rec.nt_per_packet = chunk->nt_per_packet;
+    rec.nt_per_chunk = chunk->nt_per_chunk;
+    rec.nfreq_coarse = chunk->nfreq_coarse;
+    rec.binning = chunk->binning;
+    rec.ichunk = chunk->ichunk;
+    rec.fpga_begin = chunk->fpga_begin;
+    rec.fpga_end = chunk->fpga_end;
+    rec.has_rfi_mask = chunk->has_rfi_mask;
+    rec.nbytes = _record_nbytes(chunk);
+
+    if (rec.nbytes > nbytes)
+	throw runtime_error("ch_frb_io: chunk_spill_file::write_chunk(): chunk is larger than spill file " + filename);
+
+    // Step 1: with lock held, reserve space in the file, and drop the records which will be overwritten.
+
+    // Since records are written in circular order, the records to be dropped are always at the front
+    // of the 'records' deque.  If we wrap around, the (oldest) records at the end of the file are dropped
+    // as well, to keep the deque in circular order.
+
+    unique_lock<std::mutex> ulock(this->lock);
+
+    off_t wrap_pos = nbytes;
+
+    if (write_pos + rec.nbytes > nbytes) {
+	wrap_pos = write_pos;
+	write_pos = 0;
+    }
+
+    rec.offset = write_pos;
+    rec.seq = next_seq++;
+    write_pos += rec.nbytes;
+
+    while (records.size() > 0) {
+	const record &r = records.front();
+	bool overlaps = (r.offset < rec.offset + rec.nbytes) && (r.offset + r.nbytes > rec.offset);
+
+	if (!overlaps && (r.offset < wrap_pos))
+	    break;
+
+	auto it = index.find({ r.beam_id, r.fpga_begin });
+	if ((it != index.end()) && (it->second.seq == r.seq))
+	    index.erase(it);
+
+	records.pop_front();
+    }
+
+    // Note: the record is added to 'records' now (to keep it in circular order, if there are concurrent
+    // writers), but only added to the 'index' (and made visible to readers) after it has been written.
+    records.push_back(rec);
+    ulock.unlock();
+
+    // Step 2: write without lock held.
+
+    ssize_t nb_scales = chunk->nscales * sizeof(float);
+
+    struct iovec iov[4];
+    iov[0] = { chunk->scales, size_t(nb_scales) };
+    iov[1] = { chunk->offsets, size_t(nb_scales) };
+    iov[2] = { chunk->data, size_t(chunk->ndata) };
+    iov[3] = { chunk->rfi_mask, size_t(chunk->nrfimaskbytes) };
+
+    ssize_t n = pwritev(fd, iov, (chunk->nrfimaskbytes > 0) ? 4 : 3, rec.offset);
+
+    if (n != 2*nb_scales + chunk->ndata + chunk->nrfimaskbytes)
+	throw runtime_error("ch_frb_io: chunk_spill_file: write to " + filename + " failed: " + ((n < 0) ? strerror(errno) : "short write"));
+
+    // Step 3: with lock held, make the record visible to readers (unless another writer has
+    // already wrapped around and dropped it, which is very unlikely).
+
+    ulock.lock();
+
+    if (records.size() && (records.front().seq <= rec.seq))
+	index[{ rec.beam_id, rec.fpga_begin }] = rec;
+    if (pop_queue)
+	queue.pop_front();
+}
+
+
+bool chunk_spill_file::find_chunk(int beam_id, uint64_t fpga_begin, record &rec, shared_ptr<assembled_chunk> &queued)
+{
+    lock_guard<std::mutex> lg(this->lock);
+
+    queued.reset();
+
+    for (const auto &chunk: queue) {
+	if ((chunk->beam_id == beam_id) && (chunk->fpga_begin == fpga_begin)) {
+	    queued = chunk;
+	    return true;
+	}
+    }
+
+    auto it = index.find({ beam_id, fpga_begin });
+    if (it == index.end())
+	return false;
+
+    rec = it->second;
+    return true;
+}
+
+
+void chunk_spill_file::find_chunks(int beam_id, uint64_t min_fpga_counts, uint64_t max_fpga_counts, uint64_t fpga_cutoff, vector<record> &out,
+				   vector<shared_ptr<assembled_chunk>> &queued)
+{
+    lock_guard<std::mutex> lg(this->lock);
+
+    for (auto it = index.lower_bound({ beam_id, 0 }); (it != index.end()) && (it->first.first == beam_id); it++) {
+	const record &r = it->second;
+
+	if (r.fpga_end > fpga_cutoff)
+	    break;
+	if (min_fpga_counts && (r.fpga_end <= min_fpga_counts))
+	    continue;
+	if (max_fpga_counts && (r.fpga_begin > max_fpga_counts))
+	    break;
+
+	out.push_back(r);
+    }
+
+    for (const auto &chunk: queue) {
+	if ((chunk->beam_id != beam_id) || (chunk->fpga_end > fpga_cutoff))
+	    continue;
+	if (min_fpga_counts && (chunk->fpga_end <= min_fpga_counts))
+	    continue;
+	if (max_fpga_counts && (chunk->fpga_begin > max_fpga_counts))
+	    continue;
+
+	queued.push_back(chunk);
+    }
+}
+
+
+bool chunk_spill_file::read_chunk(const record &rec, assembled_chunk *dst)
+{
+    if (!dst)
+	throw runtime_error("ch_frb_io: chunk_spill_file::read_chunk(): null pointer");
+
+    if ((dst->beam_id != rec.beam_id) || (dst->nupfreq != rec.nupfreq) || (dst->nrfifreq != rec.nrfifreq) || 
+	(dst->nt_per_packet != rec.nt_per_packet) || (dst->nt_per_chunk != rec.nt_per_chunk) || (dst->nfreq_coarse != rec.nfreq_coarse) || (dst->binning != rec.binning) || (dst->ichunk != rec.ichunk))
+	throw runtime_error("ch_frb_io: chunk_spill_file::read_chunk(): destination chunk doesn't match record");
+
+    ssize_t nb_scales = dst->nscales * sizeof(float);
+
+    struct iovec iov[4];
+    iov[0] = { dst->scales, size_t(nb_scales) };
+    iov[1] = { dst->offsets, size_t(nb_scales) };
+    iov[2] = { dst->data, size_t(dst->ndata) };
+    iov[3] = { dst->rfi_mask, size_t(dst->nrfimaskbytes) };
+
+    ssize_t n = preadv(fd, iov, (dst->nrfimaskbytes > 0) ? 4 : 3, rec.offset);
+
+    if (n != 2*nb_scales + dst->ndata + dst->nrfimaskbytes)
+	throw runtime_error("ch_frb_io: chunk_spill_file: read from " + filename + " failed: " + ((n < 0) ? strerror(errno) : "short read"));
+
+    dst->has_rfi_mask = rec.has_rfi_mask;
+
+    // Check that the record wasn't overwritten while we were reading it.
+    lock_guard<std::mutex> lg(this->lock);
+
+    auto it = index.find({ rec.beam_id, rec.fpga_begin });
+    return (it != index.end()) && (it->second.seq == rec.seq);
+}
+
+
+}  // namespace ch_frb_io
@@ -0,0 +1,183 @@
+#include "ch_frb_io_internals.hpp"
+
+using namespace std;
+
+namespace ch_frb_io {
+#if 0
+};  // pacify emacs c-mode!
+#endif
+
+
+decode_ahead_stream::decode_ahead_stream(const shared_ptr<intensity_network_stream> &stream_, int assembler_index_, int istride_, int wstride_, float prescale_) :
+    stream(stream_),
+    assembler_index(assembler_index_),
+    istride(istride_),
+    wstride(wstride_),
+    prescale(prescale_)
+{
+    if (!stream)
+	throw runtime_error("ch_frb_io: decode_ahead_stream constructor: 'stream' is an empty pointer");
+    if ((assembler_index < 0) || (assembler_index >= (int)stream->ini_params.beam_ids.size()))
+	throw runtime_error("ch_frb_io: decode_ahead_stream constructor: bad assembler_index " + to_string(assembler_index));
+    if (istride < stream->ini_params.nt_per_chunk)
+	throw runtime_error("ch_frb_io: decode_ahead_stream constructor: istride must be >= nt_per_chunk(=" + to_string(stream->ini_params.nt_per_chunk) + ")");
+    if (wstride < stream->ini_params.nt_per_chunk)
+	throw runtime_error("ch_frb_io: decode_ahead_stream constructor: wstride must be >= nt_per_chunk(=" + to_string(stream->ini_params.nt_per_chunk) + ")");
+}
+
+
+decode_ahead_stream::~decode_ahead_stream()
+{
+    unique_lock<std::mutex> ulock(this->lock);
+    this->stopping = true;
+    cv.notify_all();
+    ulock.unlock();
+
+    if (worker.joinable())
+	worker.join();
+}
+
+
+void decode_ahead_stream::add_buffer(float *intensity, float *weights)
+{
+    if (!intensity || !weights)
+	throw runtime_error("ch_frb_io: decode_ahead_stream::add_buffer(): null pointer");
+
+    unique_lock<std::mutex> ulock(this->lock);
+
+    if (started)
+	throw runtime_error("ch_frb_io: decode_ahead_stream::add_buffer() called after start()");
+
+    free_buffers.push_back(make_pair(intensity, weights));
+    nbuffers++;
+}
+
+
+void decode_ahead_stream::start()
+{
+    unique_lock<std::mutex> ulock(this->lock);
+
+    if (started)
+	throw runtime_error("ch_frb_io: decode_ahead_stream::start() called twice");
+    if (nbuffers == 0)
+	throw runtime_error("ch_frb_io: decode_ahead_stream::start(): no buffers were registered");
+
+    this->started = true;
+    this->worker = std::thread(std::bind(&decode_ahead_stream::worker_main, this));
+}
+
+
+decode_ahead_stream::decoded_chunk decode_ahead_stream::get_decoded_chunk(bool wait)
+{
+    unique_lock<std::mutex> ulock(this->lock);
+
+    if (!started)
+	throw runtime_error("ch_frb_io: decode_ahead_stream::get_decoded_chunk() called before start()");
+
+    while (ready.empty() && !eos && !worker_error && wait)
+	cv.wait(ulock);
+
+    if (!ready.empty()) {
+	decoded_chunk ret = ready.front();
+	ready.pop_front();
+	return ret;
+    }
+
+    if (worker_error)
+	std::rethrow_exception(worker_error);
+
+    return decoded_chunk();
+}
+
+
+void decode_ahead_stream::release(const decoded_chunk &c)
+{
+    if (!c.intensity || !c.weights)
+	return;
+
+    unique_lock<std::mutex> ulock(this->lock);
+
+    if ((int)free_buffers.size() >= nbuffers)
+	throw runtime_error("ch_frb_io: decode_ahead_stream::release(): more buffers released than registered (double release?)");
+
+    free_buffers.push_back(make_pair(c.intensity, c.weights));
+    cv.notify_all();
+}
+
+
+bool decode_ahead_stream::end_of_stream()
+{
+    unique_lock<std::mutex> ulock(this->lock);
+    return eos && ready.empty();
+}
+
+
+// Called as separate thread!
+void decode_ahead_stream::worker_main()
+{
+    // Polling timeout for stream->wait_for_assembled_chunk(), so that the destructor doesn't block
+    // indefinitely if the stream is idle.
+    const double timeout_sec = 0.1;
+
+    vector<int> ix(1, assembler_index);
+
+    try {
+	for (;;) {
+	    // Wait for a free buffer.
+	    unique_lock<std::mutex> ulock(this->lock);
+
+	    while (!stopping && free_buffers.empty())
+		cv.wait(ulock);
+
+	    if (stopping)
+		return;
+
+	    pair<float *, float *> buf = free_buffers.back();
+	    free_buffers.pop_back();
+	    ulock.unlock();
+
+	    // Wait for a chunk.
+	    shared_ptr<assembled_chunk> chunk;
+
+	    for (;;) {
+		if (stream->wait_for_assembled_chunk(ix, timeout_sec) >= 0) {
+		    chunk = stream->get_assembled_chunk(assembler_index, false);
+		    break;   // empty pointer means end-of-stream
+		}
+
+		ulock.lock();
+		bool s = this->stopping;
+		ulock.unlock();
+
+		if (s)
+		    return;
+	    }
+
+	    if (!chunk) {
+		ulock.lock();
+		free_buffers.push_back(buf);
+		this->eos = true;
+		cv.notify_all();
+		return;
+	    }
+
+	    chunk->decode(buf.first, buf.second, istride, wstride, prescale);
+
+	    decoded_chunk d;
+	    d.chunk = chunk;
+	    d.intensity = buf.first;
+	    d.weights = buf.second;
+
+	    ulock.lock();
+	    ready.push_back(d);
+	    cv.notify_all();
+	}
+    } catch (...) {
+	unique_lock<std::mutex> ulock(this->lock);
+	this->worker_error = std::current_exception();
+	cv.notify_all();
+    }
+}
+
+
+}  // namespace ch_frb_io
@@ -0,0 +1,91 @@
+#include "ch_frb_io_internals.hpp"
+#include "chlog.hpp"
+
+using namespace std;
+
+namespace ch_frb_io {
+#if 0
+};  // pacify emacs c-mode!
+#endif
+
+
+downsampling_thread_pool::downsampling_thread_pool(int nthreads_, const vector<int> &cores) :
+    nthreads(nthreads_),
+    state(make_shared<worker_state> ())
+{
+    if (nthreads <= 0)
+	throw runtime_error("ch_frb_io: downsampling_thread_pool constructor expects nthreads > 0");
+
+    for (int i = 0; i < nthreads; i++)
+	threads.push_back(std::thread(std::bind(&downsampling_thread_pool::worker_main, state, cores)));
+}
+
+
+downsampling_thread_pool::~downsampling_thread_pool()
+{
+    unique_lock<std::mutex> ulock(state->lock);
+    state->stopping = true;
+    state->cv.notify_all();
+    ulock.unlock();
+
+    // A worker can't join itself.  This happens if a task drops the last reference to the pool
+    // (e.g. via an assembled_chunk_ringbuf), in which case the worker only uses 'state' from now on.
+    for (auto &t: threads) {
+	if (t.get_id() == std::this_thread::get_id())
+	    t.detach();
+	else
+	    t.join();
+    }
+}
+
+
+void downsampling_thread_pool::submit(const std::function<void()> &task)
+{
+    unique_lock<std::mutex> ulock(state->lock);
+
+    if (state->stopping)
+	throw runtime_error("ch_frb_io: internal error: downsampling_thread_pool::submit() called during destruction");
+
+    state->tasks.push_back(task);
+    state->cv.notify_one();
+}
+
+
+int downsampling_thread_pool::count_queued_tasks()
+{
+    unique_lock<std::mutex> ulock(state->lock);
+    return state->tasks.size();
+}
+
+
+// Called as separate thread!  (Static member function, see destructor.)
+void downsampling_thread_pool::worker_main(shared_ptr<worker_state> state, const vector<int> &cores)
+{
+    pin_thread_to_cores(cores);
+
+    for (;;) {
+	unique_lock<std::mutex> ulock(state->lock);
+
+	while (!state->stopping && state->tasks.empty())
+	    state->cv.wait(ulock);
+
+	// When 'stopping' is set, we still drain the queue before exiting.
+	if (state->tasks.empty())
+	    return;
+
+	std::function<void()> task = std::move(state->tasks.front());
+	state->tasks.pop_front();
+	ulock.unlock();
+
+	// Tasks are expected to catch their own exceptions (see assembled_chunk_ringbuf::_downsampling_task()).
+	// If one gets through anyway, we print it rather than letting it terminate the process.
+	try {
+	    task();
+	} catch (exception &e) {
+	    chlog("downsampling_thread_pool: task threw exception: " << e.what());
+	}
+    }
+}
+
+
+}  // namespace ch_frb_io
@@ -2,11 +2,13 @@
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/eventfd.h>
 #include <arpa/inet.h>
 
 #include <functional>
 #include <algorithm>
 #include <iostream>
+#include <chrono>
 
 #include <curl/curl.h>
 #include <json/json.h>
@@ -83,7 +85,11 @@ intensity_network_stream::intensity_network_stream(const initializer &ini_params
     if (ini_params.nrfifreq < 0)
 	throw runtime_error("ch_frb_io: bad value of 'nrfifreq'");
     
-    if ((ini_params.nrfifreq > 0) && ((constants::nfreq_coarse_tot * ini_params.nupfreq) % ini_params.nrfifreq))
+    // Throws an exception if 'coarse_freq_ids' is invalid.
+    shared_ptr<const coarse_freq_map> freq_map = coarse_freq_map::make(ini_params.coarse_freq_ids);
+    int nfreq_coarse = freq_map ? freq_map->nfreq_coarse() : constants::nfreq_coarse_tot;
+
+    if ((ini_params.nrfifreq > 0) && ((nfreq_coarse * ini_params.nupfreq) % ini_params.nrfifreq))
 	throw runtime_error("ch_frb_io: bad value of 'nrfifreq'");
 
     if ((ini_params.nt_per_packet <= 0) || (ini_params.nt_per_packet > constants::max_allowed_nt_per_packet))
@@ -95,8 +101,11 @@ intensity_network_stream::intensity_network_stream(const initializer &ini_params
     if ((ini_params.stream_id < 0) || (ini_params.stream_id > 9))
 	throw runtime_error("ch_frb_io: bad value of 'stream_id'");
 
-    if ((ini_params.nt_align < 0) || (ini_params.nt_align % constants::nt_per_assembled_chunk))
-	throw runtime_error("ch_frb_io: 'nt_align' must be a multiple of nt_per_assembled_chunk(=" + to_string(constants::nt_per_assembled_chunk) + ")");
+    if ((ini_params.huge_page_size < 0) || (ini_params.huge_page_size & (ini_params.huge_page_size-1)))
+	throw runtime_error("ch_frb_io: bad value of 'huge_page_size' (must be zero or a power of two)");
+
+    if ((ini_params.nt_per_chunk <= 0) || (ini_params.nt_align < 0) || (ini_params.nt_align % ini_params.nt_per_chunk))
+	throw runtime_error("ch_frb_io: 'nt_align' must be a multiple of nt_per_chunk(=" + to_string(ini_params.nt_per_chunk) + ")");
 	 
     if ((ini_params.udp_port <= 0) || (ini_params.udp_port >= 65536))
 	throw runtime_error("ch_frb_io: intensity_network_stream constructor: bad udp port " + to_string(ini_params.udp_port));
@@ -104,6 +113,9 @@ intensity_network_stream::intensity_network_stream(const initializer &ini_params
     if (ini_params.force_fast_kernels && ini_params.force_reference_kernels)
 	throw runtime_error("ch_frb_io: both flags force_fast_kernels, force_reference_kernels were set");
 
+    if (ini_params.force_fast_kernels && (ini_params.nt_per_chunk % 256))
+	throw runtime_error("ch_frb_io: the 'force_fast_kernels' flag was set, but the fast kernels require nt_per_chunk to be a multiple of 256");
+
 #ifndef __AVX2__
     if (ini_params.force_fast_kernels)
 	throw runtime_error("ch_frb_io: the 'force_fast_kernels' flag was set, but this machine does not have the AVX2 instruction set");
@@ -119,16 +131,24 @@ intensity_network_stream::intensity_network_stream(const initializer &ini_params
 
     // Note: the socket is initialized in _open_socket().
 
+    this->chunk_eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (chunk_eventfd < 0)
+	throw runtime_error(string("ch_frb_io: eventfd() failed: ") + strerror(errno));
+
     this->assemblers.resize(nbeams);
-    for (int ix = 0; ix < nbeams; ix++)
+    for (int ix = 0; ix < nbeams; ix++) {
 	assemblers[ix] = make_shared<assembled_chunk_ringbuf> (ini_params, ini_params.beam_ids[ix], ini_params.stream_id);
+	assemblers[ix]->set_chunks_added_callback([this]() { this->_chunks_added(); });
+    }
 
     this->unassembled_ringbuf = make_unique<udp_packet_ringbuf> (ini_params.unassembled_ringbuf_capacity, 
 								 ini_params.max_unassembled_packets_per_list, 
-								 ini_params.max_unassembled_nbytes_per_list);
+								 ini_params.max_unassembled_nbytes_per_list,
+								 ini_params.huge_page_size);
 
     this->incoming_packet_list = make_unique<udp_packet_list> (ini_params.max_unassembled_packets_per_list,
-							       ini_params.max_unassembled_nbytes_per_list);
+							       ini_params.max_unassembled_nbytes_per_list,
+							       ini_params.huge_page_size);
 
     this->cumulative_event_counts = vector<int64_t> (event_type::num_types, 0);
     this->network_thread_event_subcounts = vector<int64_t> (event_type::num_types, 0);
@@ -155,6 +175,11 @@ intensity_network_stream::~intensity_network_stream()
 	close(sockfd);
 	sockfd = -1;
     }
+
+    if (chunk_eventfd >= 0) {
+	close(chunk_eventfd);
+	chunk_eventfd = -1;
+    }
 }
 
 
@@ -346,6 +371,151 @@ shared_ptr<assembled_chunk> intensity_network_stream::get_assembled_chunk(int as
 }
 
 
+void intensity_network_stream::add_consumer(const string &name, int bufsize)
+{
+    for (const auto &a: assemblers)
+	a->add_consumer(name, bufsize);
+}
+
+void intensity_network_stream::remove_consumer(const string &name)
+{
+    for (const auto &a: assemblers)
+	a->remove_consumer(name);
+}
+
+shared_ptr<assembled_chunk> intensity_network_stream::get_consumer_chunk(int assembler_index, const string &consumer, bool wait)
+{
+    if ((assembler_index < 0) || (assembler_index >= (int)assemblers.size()))
+        throw runtime_error("ch_frb_io: bad assembler_ix " + std::to_string(assembler_index) + " passed to intensity_network_stream::get_consumer_chunk() -- allowable range [0, " + std::to_string(assemblers.size()) + ")");
+
+    return assemblers[assembler_index]->get_consumer_chunk(consumer, wait);
+}
+
+
+shared_ptr<assembled_subchunk> intensity_network_stream::get_assembled_subchunk(int assembler_index, bool wait)
+{
+    if ((assembler_index < 0) || (assembler_index >= (int)assemblers.size()))
+        throw runtime_error("ch_frb_io: bad assembler_ix " + std::to_string(assembler_index) + " passed to intensity_network_stream::get_assembled_subchunk() -- allowable range [0, " + std::to_string(assemblers.size()) + ")");
+    if (ini_params.subchunk_nt <= 0)
+	throw runtime_error("ch_frb_io: intensity_network_stream::get_assembled_subchunk() called, but initializer::subchunk_nt was not set");
+
+    return assemblers[assembler_index]->get_assembled_subchunk(wait);
+}
+
+
+// Called by the assemblers (on the assembler thread) whenever a chunk is queued, or the stream ends.
+void intensity_network_stream::_chunks_added()
+{
+    unique_lock<std::mutex> ul(this->chunks_added_lock);
+    this->chunks_added_seq++;
+    ul.unlock();
+
+    cond_chunks_added.notify_all();
+
+    // The eventfd is nonblocking, so this write only fails if the counter would overflow,
+    // in which case the fd is readable anyway.
+    uint64_t one = 1;
+    ssize_t n = write(chunk_eventfd, &one, sizeof(one));
+    (void) n;
+}
+
+
+int intensity_network_stream::wait_for_assembled_chunk(const vector<int> &assembler_indices, double timeout_sec)
+{
+    if (assembler_indices.size() == 0)
+	throw runtime_error("ch_frb_io: empty assembler_indices passed to intensity_network_stream::wait_for_assembled_chunk()");
+
+    for (int ix: assembler_indices) {
+	if ((ix < 0) || (ix >= (int)assemblers.size()))
+	    throw runtime_error("ch_frb_io: bad assembler_ix " + std::to_string(ix) + " passed to intensity_network_stream::wait_for_assembled_chunk() -- allowable range [0, " + std::to_string(assemblers.size()) + ")");
+    }
+
+    auto deadline = chrono::steady_clock::now() + chrono::duration_cast<chrono::steady_clock::duration> (chrono::duration<double> (max(timeout_sec, 0.0)));
+
+    for (;;) {
+	// Read the sequence number before checking the assemblers, so that a chunk which
+	// is added after the check is guaranteed to wake us up below.
+	unique_lock<std::mutex> ul(this->chunks_added_lock);
+	uint64_t seq = chunks_added_seq;
+	ul.unlock();
+
+	for (int ix: assembler_indices) {
+	    if (assemblers[ix]->assembled_chunk_ready())
+		return ix;
+	}
+
+	ul.lock();
+	auto pred = [this,seq]() { return chunks_added_seq != seq; };
+
+	if (timeout_sec < 0.0)
+	    cond_chunks_added.wait(ul, pred);
+	else if (!cond_chunks_added.wait_until(ul, deadline, pred))
+	    return -1;
+    }
+}
+
+
+vector<shared_ptr<assembled_chunk>> intensity_network_stream::get_assembled_chunk_batch(const vector<int> &assembler_indices, uint64_t ichunk, double timeout_sec)
+{
+    int n = assembler_indices.size();
+
+    for (int ix: assembler_indices) {
+	if ((ix < 0) || (ix >= (int)assemblers.size()))
+	    throw runtime_error("ch_frb_io: bad assembler_ix " + std::to_string(ix) + " passed to intensity_network_stream::get_assembled_chunk_batch() -- allowable range [0, " + std::to_string(assemblers.size()) + ")");
+    }
+
+    auto deadline = chrono::steady_clock::now() + chrono::duration_cast<chrono::steady_clock::duration> (chrono::duration<double> (max(timeout_sec, 0.0)));
+
+    vector<shared_ptr<assembled_chunk>> ret(n);
+    vector<bool> done(n, false);
+    int ndone = 0;
+
+    for (;;) {
+	// As in wait_for_assembled_chunk(), read the sequence number before polling the assemblers.
+	unique_lock<std::mutex> ul(this->chunks_added_lock);
+	uint64_t seq = chunks_added_seq;
+	ul.unlock();
+
+	for (int i = 0; i < n; i++) {
+	    if (done[i])
+		continue;
+
+	    bool missing = false;
+	    int nskipped = 0;
+	    ret[i] = assemblers[assembler_indices[i]]->get_assembled_chunk_at(ichunk, missing, nskipped);
+
+	    // Chunks older than 'ichunk' are never returned, so they are counted as dropped.
+	    if (nskipped > 0) {
+		pthread_mutex_lock(&this->event_lock);
+		this->cumulative_event_counts[event_type::assembled_chunk_dropped] += nskipped;
+		pthread_mutex_unlock(&this->event_lock);
+	    }
+
+	    if (ret[i] || missing) {
+		done[i] = true;
+		ndone++;
+	    }
+	}
+
+	if (ndone == n)
+	    break;
+
+	ul.lock();
+	auto pred = [this,seq]() { return chunks_added_seq != seq; };
+
+	if (timeout_sec < 0.0)
+	    cond_chunks_added.wait(ul, pred);
+	else if (!cond_chunks_added.wait_until(ul, deadline, pred))
+	    break;
+    }
+
+    if (ini_params.deliberately_crash)
+	throw runtime_error("dedispersion thread will deliberately crash now!");
+
+    return ret;
+}
+
+
 vector<int64_t> intensity_network_stream::get_event_counts()
 {
     vector<int64_t> ret(event_type::num_types, 0);
@@ -502,6 +672,61 @@ void intensity_network_stream::fake_packet_from(const struct sockaddr_in& sender
     pthread_mutex_unlock(&this->event_lock);
 }
 
+intensity_network_stream::memory_accounting
+intensity_network_stream::get_memory_accounting() {
+    memory_accounting ma;
+
+    vector<shared_ptr<memory_slab_pool>> pools = this->ini_params.small_memory_pools;
+    if (this->ini_params.memory_pool)
+        pools.insert(pools.begin(), this->ini_params.memory_pool);
+
+    for (size_t i=0; i<pools.size(); i++) {
+        if (std::find(pools.begin(), pools.begin()+i, pools[i]) != pools.begin()+i)
+            continue;
+        int64_t nb = pools[i]->nbytes_per_mapping;
+        ma.pool_nbytes += nb * pools[i]->get_num_slabs_allocated();
+        ma.pool_nbytes_free += nb * pools[i]->count_slabs_available();
+        ma.pool_nbytes_low_water += nb * pools[i]->get_low_water_mark();
+    }
+
+    int nbeams = this->ini_params.beam_ids.size();
+    ma.beam_ringbuf_nbytes.resize(nbeams, 0);
+
+    vector<int64_t> level_nchunks, level_nbytes;
+    for (int b=0; b<nbeams; b++) {
+        int64_t nslabs = 0;
+        this->assemblers[b]->get_memory_residency(level_nchunks, level_nbytes, nslabs);
+
+        if (ma.ringbuf_level_nbytes.size() < level_nbytes.size())
+            ma.ringbuf_level_nbytes.resize(level_nbytes.size(), 0);
+
+        for (size_t ids=0; ids<level_nbytes.size(); ids++) {
+            ma.ringbuf_nchunks += level_nchunks[ids];
+            ma.ringbuf_level_nbytes[ids] += level_nbytes[ids];
+            ma.beam_ringbuf_nbytes[b] += level_nbytes[ids];
+        }
+
+        ma.ringbuf_nbytes += ma.beam_ringbuf_nbytes[b];
+        ma.ringbuf_nslabs += nslabs;
+
+        int64_t nfallbacks = 0, nreclaimed = 0, ndropped = 0, nbytes_fallback = 0;
+        this->assemblers[b]->get_memory_pressure_counts(nfallbacks, nreclaimed, ndropped, nbytes_fallback);
+        ma.fallback_nbytes += nbytes_fallback;
+    }
+
+    for (const auto &dev: this->ini_params.output_devices) {
+        int64_t nqueued = 0, nawaiting = 0, nbuf = 0;
+        dev->get_memory_accounting(nqueued, nawaiting, nbuf);
+        ma.write_queue_nbytes += nqueued;
+        ma.awaiting_rfi_nbytes += nawaiting;
+        ma.output_buffer_nbytes += nbuf;
+    }
+
+    ma.compressed_nbytes = assembled_chunk::get_total_compressed_nbytes();
+    unassembled_ringbuf->get_memory_accounting(ma.udp_ringbuf_nbytes, ma.udp_ringbuf_nbytes_queued);
+    return ma;
+}
+
 vector<unordered_map<string, uint64_t> >
 intensity_network_stream::get_statistics() {
     vector<unordered_map<string, uint64_t> > R;
@@ -513,6 +738,8 @@ intensity_network_stream::get_statistics() {
     m["first_packet_received"]  = (counts[event_type::packet_received] > 0);
     m["nupfreq"]                = ini_params.nupfreq;
     m["nt_per_packet"]          = ini_params.nt_per_packet;
+    m["nt_per_chunk"]           = ini_params.nt_per_chunk;
+    m["nfreq_coarse"]           = ini_params.coarse_freq_ids.size() ? ini_params.coarse_freq_ids.size() : constants::nfreq_coarse_tot;
     m["fpga_counts_per_sample"] = ini_params.fpga_counts_per_sample;
     m["fpga_count"]             = 0;    // XXX FIXME XXX
     m["network_thread_waiting_usec"] = network_thread_waiting_usec;
@@ -561,12 +788,86 @@ intensity_network_stream::get_statistics() {
         m["memory_pool_slab_nbytes"] = this->ini_params.memory_pool->nbytes_per_slab;
         m["memory_pool_slab_size"] = this->ini_params.memory_pool->nslabs;
         m["memory_pool_slab_avail"] = this->ini_params.memory_pool->count_slabs_available();
+        m["memory_pool_page_size"] = this->ini_params.memory_pool->get_page_size();
+        m["memory_pool_remote_slabs"] = this->ini_params.memory_pool->get_num_remote_slabs();
+        m["memory_pool_slabs_allocated"] = this->ini_params.memory_pool->get_num_slabs_allocated();
+
+        memory_slab_pool::pressure_stats ps = this->ini_params.memory_pool->get_pressure_stats();
+        m["memory_pool_failed_gets"] = ps.num_failed_gets;
+        m["memory_pool_quota_refusals"] = ps.num_quota_refusals;
+        m["memory_pool_reclaims"] = ps.num_reclaims;
+        m["memory_pool_slabs_reclaimed"] = ps.num_slabs_reclaimed;
+
+        int64_t nzeroed_background = 0, nzeroed_on_get = 0;
+        this->ini_params.memory_pool->get_zeroing_counts(nzeroed_background, nzeroed_on_get);
+        m["memory_pool_zeroed_background"] = nzeroed_background;
+        m["memory_pool_zeroed_on_get"] = nzeroed_on_get;
+
+        // Per-node occupancy (NUMA-aware pools only).
+        if (this->ini_params.memory_pool->numa_aware) {
+            for (const auto &ns: this->ini_params.memory_pool->get_node_stats()) {
+                string prefix = "memory_pool_node" + to_string(ns.numa_node);
+                m[prefix + "_slab_size"] = ns.nslabs;
+                m[prefix + "_slab_avail"] = ns.navailable;
+            }
+        }
     } else {
         m["memory_pool_slab_nbytes"] = 0;
         m["memory_pool_slab_size"] = 0;
         m["memory_pool_slab_avail"] = 0;
+        m["memory_pool_page_size"] = 0;
+        m["memory_pool_remote_slabs"] = 0;
+        m["memory_pool_slabs_allocated"] = 0;
+        m["memory_pool_failed_gets"] = 0;
+        m["memory_pool_quota_refusals"] = 0;
+        m["memory_pool_reclaims"] = 0;
+        m["memory_pool_slabs_reclaimed"] = 0;
+        m["memory_pool_zeroed_background"] = 0;
+        m["memory_pool_zeroed_on_get"] = 0;
     }
-    
+
+    // Per-class usage (memory_pool is class 0, followed by small_memory_pools), in percent.
+    {
+        vector<shared_ptr<memory_slab_pool>> pools = this->ini_params.small_memory_pools;
+        if (this->ini_params.memory_pool)
+            pools.insert(pools.begin(), this->ini_params.memory_pool);
+
+        for (size_t i=0; i<pools.size(); i++) {
+            memory_slab_pool::usage_stats us = pools[i]->get_usage_stats();
+            string prefix = "memory_pool_class" + to_string(i);
+            m[prefix + "_slab_nbytes"] = us.nbytes_per_slab;
+            m[prefix + "_slabs_allocated"] = us.nslabs_allocated;
+            m[prefix + "_slabs_in_use"] = us.nslabs_in_use;
+            m[prefix + "_utilization_pct"] = lround(100 * us.utilization);
+            m[prefix + "_fragmentation_pct"] = lround(100 * us.fragmentation);
+        }
+
+        shared_ptr<memory_slab_budget> budget = pools.size() ? pools[0]->budget : shared_ptr<memory_slab_budget> ();
+        m["memory_budget_nbytes_max"] = budget ? budget->nbytes_max : 0;
+        m["memory_budget_nbytes_used"] = budget ? budget->get_nbytes_used() : 0;
+    }
+
+    // Memory accounting, by subsystem (see get_memory_accounting()).
+    memory_accounting ma = this->get_memory_accounting();
+    m["mem_pool_nbytes"] = ma.pool_nbytes;
+    m["mem_pool_nbytes_free"] = ma.pool_nbytes_free;
+    m["mem_pool_nbytes_low_water"] = ma.pool_nbytes_low_water;
+    m["mem_ringbuf_nchunks"] = ma.ringbuf_nchunks;
+    m["mem_ringbuf_nbytes"] = ma.ringbuf_nbytes;
+    m["mem_ringbuf_nslabs"] = ma.ringbuf_nslabs;
+    for (size_t ids=0; ids<ma.ringbuf_level_nbytes.size(); ids++)
+        m[stringprintf("mem_ringbuf_nbytes_level%i", int(ids+1))] = ma.ringbuf_level_nbytes[ids];
+    m["mem_write_queue_nbytes"] = ma.write_queue_nbytes;
+    m["mem_awaiting_rfi_nbytes"] = ma.awaiting_rfi_nbytes;
+    m["mem_output_buffer_nbytes"] = ma.output_buffer_nbytes;
+    m["mem_fallback_nbytes"] = ma.fallback_nbytes;
+    m["mem_compressed_nbytes"] = ma.compressed_nbytes;
+    m["mem_udp_ringbuf_nbytes"] = ma.udp_ringbuf_nbytes;
+    m["mem_udp_ringbuf_nbytes_queued"] = ma.udp_ringbuf_nbytes_queued;
+
+    if (ini_params.spill_file)
+        m["spill_chunks_dropped"] = ini_params.spill_file->get_num_dropped();
+
     // Streaming data to disk status
     {
         std::string streaming_filename_pattern;
@@ -600,6 +901,14 @@ intensity_network_stream::get_statistics() {
         this->assemblers[b]->get_streamed_chunks(streamed_chunks, streamed_bytes);
         m["streaming_chunks_written"] = streamed_chunks;
         m["streaming_bytes_written"] = streamed_bytes;
+
+        int64_t nfallbacks = 0, nreclaimed = 0, ndropped = 0, nbytes_fallback = 0;
+        this->assemblers[b]->get_memory_pressure_counts(nfallbacks, nreclaimed, ndropped, nbytes_fallback);
+        m["memory_pool_fallbacks"] = nfallbacks;
+        m["memory_pool_reclaimed"] = nreclaimed;
+        m["memory_pool_drops"] = ndropped;
+        m["mem_fallback_nbytes"] = nbytes_fallback;
+        m["mem_ringbuf_nbytes"] = ma.beam_ringbuf_nbytes[b];
         
 	// Grab the ring buffer to find the min & max chunk numbers and size.
 	uint64_t fpgacounts_next=0, n_ready=0, capacity=0, nelements=0, fpgacounts_min=0, fpgacounts_max=0;
@@ -648,6 +957,20 @@ intensity_network_stream::find_assembled_chunk(int beam, uint64_t fpga_counts, b
     throw runtime_error("ch_frb_io internal error: beam_id mismatch in intensity_network_stream::find_assembled_chunk()");
 }
 
+bool intensity_network_stream::visit_ringbuf(int beam, uint64_t min_fpga_counts, uint64_t max_fpga_counts,
+					     const std::function<void(const shared_ptr<assembled_chunk> &, uint64_t)> &visitor)
+{
+    // Which of my assemblers (if any) is handling the requested beam?
+    int nbeams = this->ini_params.beam_ids.size();
+    for (int i=0; i<nbeams; i++) {
+        if (this->ini_params.beam_ids[i] == beam) {
+	    this->assemblers[i]->visit_ringbuf(min_fpga_counts, max_fpga_counts, visitor);
+	    return true;
+	}
+    }
+    return false;
+}
+
 uint64_t intensity_network_stream::get_first_fpga_count(int beam) {
     // Which of my assemblers (if any) is handling the requested beam?
     int nbeams = this->ini_params.beam_ids.size();
@@ -1024,7 +1347,7 @@ void intensity_network_stream::_assembler_thread_body()
     int nbeams = this->ini_params.beam_ids.size();
     bool first_packet_received = false;
 
-    auto packet_list = make_unique<udp_packet_list> (ini_params.max_unassembled_packets_per_list, ini_params.max_unassembled_nbytes_per_list);
+    auto packet_list = make_unique<udp_packet_list> (ini_params.max_unassembled_packets_per_list, ini_params.max_unassembled_nbytes_per_list, ini_params.huge_page_size);
 
     int64_t *event_subcounts = &this->assembler_thread_event_subcounts[0];
 
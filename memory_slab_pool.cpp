@@ -1,3 +1,7 @@
+#include <unistd.h>
+#include <algorithm>
+#include <unordered_map>
+#include <immintrin.h>
 #include "ch_frb_io_internals.hpp"
 
 using namespace std;
@@ -8,13 +12,91 @@ namespace ch_frb_io {
 #endif
 
 
+// Per-thread magazines (see memory_slab_pool::initializer::magazine_size).
+
+struct memory_slab_pool::magazine {
+    std::mutex lock;
+    memory_slab_pool *pool = nullptr;   // null after the magazine is detached
+    int client = -1;
+    std::vector<memory_slab_t> slabs;
+    std::vector<bool> zeroed;           // parallel to 'slabs': true if the slab is known to be zero
+};
+
+
+// Owns the calling thread's magazines (one per pool and client).  When the thread exits,
+// the magazines are flushed back to their pools.
+struct memory_slab_pool::thread_magazines {
+    std::unordered_map<uint64_t, shared_ptr<magazine>> m;
+
+    static uint64_t key(uint64_t serial, int client) { return (serial << 24) + (client + 1); }
+
+    ~thread_magazines()
+    {
+	for (const auto &kv: m) {
+	    const shared_ptr<magazine> &mag = kv.second;
+	    lock_guard<std::mutex> lg(mag->lock);
+	    memory_slab_pool *pool = mag->pool;
+
+	    if (!pool)
+		continue;
+
+	    pool->_flush_magazine(*mag, mag->slabs.size());
+	    mag->pool = nullptr;
+
+	    lock_guard<std::mutex> lg2(pool->lock);
+	    vector<shared_ptr<magazine>> &v = pool->magazines;
+	    v.erase(std::remove(v.begin(), v.end(), mag), v.end());
+	}
+    }
+};
+
+
+
+static memory_slab_pool::initializer _make_initializer(ssize_t nbytes_per_slab, ssize_t nslabs, const vector<int> &allocation_cores, int verbosity)
+{
+    memory_slab_pool::initializer ini_params;
+    ini_params.nbytes_per_slab = nbytes_per_slab;
+    ini_params.nslabs = nslabs;
+    ini_params.allocation_cores = allocation_cores;
+    ini_params.verbosity = verbosity;
+    return ini_params;
+}
+
 
 memory_slab_pool::memory_slab_pool(ssize_t nbytes_per_slab_, ssize_t nslabs_, const vector<int> &allocation_cores, int verbosity_) :
-    nbytes_per_slab(nbytes_per_slab_),
-    nslabs(nslabs_),
-    verbosity(verbosity_)
+    memory_slab_pool(_make_initializer(nbytes_per_slab_, nslabs_, allocation_cores, verbosity_))
+{ }
+
+
+// Size of the mapping backing each slab (see huge_page_alloc()).
+static ssize_t _nbytes_per_mapping(ssize_t nbytes_per_slab, ssize_t huge_page_size)
 {
-    double gb = pow(2.,-30.) * double(nbytes_per_slab) * double(nslabs);
+    if (huge_page_size <= 0)
+	return nbytes_per_slab;
+    return ((nbytes_per_slab + huge_page_size - 1) / huge_page_size) * huge_page_size;
+}
+
+
+memory_slab_pool::memory_slab_pool(const initializer &ini_params) :
+    nbytes_per_slab(ini_params.nbytes_per_slab),
+    nbytes_per_mapping(_nbytes_per_mapping(ini_params.nbytes_per_slab, ini_params.huge_page_size)),
+    nslabs(ini_params.nslabs),
+    nslabs_max(ini_params.budget ? max(ini_params.nslabs_max, ini_params.nslabs) : ini_params.nslabs),
+    verbosity(ini_params.verbosity),
+    huge_page_size(ini_params.huge_page_size),
+    numa_aware(ini_params.numa_aware),
+    low_watermark(ini_params.low_watermark),
+    high_watermark(max(ini_params.high_watermark, ini_params.low_watermark)),
+    magazine_size(ini_params.magazine_size),
+    background_zeroing(ini_params.background_zeroing),
+    budget(ini_params.budget)
+{
+    static std::atomic<uint64_t> num_pools(0);
+    this->serial = ++num_pools;
+
+    const vector<int> &allocation_cores = ini_params.allocation_cores;
+
+    double gb = pow(2.,-30.) * double(nbytes_per_mapping) * double(nslabs);
 
     if (nbytes_per_slab <= 0)
 	throw runtime_error("ch_frb_io: memory_slab_pool constructor expects nbytes_per_slab > 0");
@@ -22,65 +104,369 @@ memory_slab_pool::memory_slab_pool(ssize_t nbytes_per_slab_, ssize_t nslabs_, co
 	throw runtime_error("ch_frb_io: memory_slab_pool constructor expects nslabs > 0");
     if (gb > 100.0)
 	throw runtime_error("ch_frb_io: memory_slab_pool constructor: attempt to allocate > 100 GB, this is assumed unintentional");
+    if ((huge_page_size < 0) || (huge_page_size & (huge_page_size-1)))
+	throw runtime_error("ch_frb_io: memory_slab_pool constructor: 'huge_page_size' must be zero or a power of two");
+    if ((low_watermark < 0) || (high_watermark > nslabs))
+	throw runtime_error("ch_frb_io: memory_slab_pool constructor: expected 0 <= low_watermark <= high_watermark <= nslabs");
+    if (magazine_size < 0)
+	throw runtime_error("ch_frb_io: memory_slab_pool constructor: expected magazine_size >= 0");
+    if (ini_params.nslabs_max < 0)
+	throw runtime_error("ch_frb_io: memory_slab_pool constructor: expected nslabs_max >= 0");
+
+    if (numa_aware)
+	this->nodes = get_numa_nodes();
+    else
+	this->nodes = { -1 };
+
+    int nnodes = nodes.size();
+    this->slabs.resize(nnodes);
+    this->zeroed_slabs.resize(nnodes);
+    this->node_nslabs.resize(nnodes, 0);
+    this->page_size = (huge_page_size > 0) ? huge_page_size : sysconf(_SC_PAGESIZE);
+
+    // Capacity for all slabs, so that put_slab() never reallocates.
+    for (int inode = 0; inode < nnodes; inode++) {
+	slabs[inode].reserve(nslabs_max);
+	zeroed_slabs[inode].reserve(nslabs_max);
+    }
+
+    ssize_t nslabs_initial = ini_params.nslabs_initial;
+
+    if ((nslabs_initial < 0) || (nslabs_initial > nslabs))
+	throw runtime_error("ch_frb_io: memory_slab_pool constructor: expected 0 <= nslabs_initial <= nslabs");
+    if (nslabs_initial == 0)
+	nslabs_initial = nslabs;
+
+    // The initial slabs are charged to the budget up front (possibly shrinking other pools).
+    if (budget) {
+	if (!budget->_try_charge(this, nslabs * nbytes_per_mapping))
+	    throw runtime_error("ch_frb_io: memory_slab_pool constructor: " + to_string(nslabs * nbytes_per_mapping)
+				+ " bytes exceeds remaining memory budget (" + to_string(budget->nbytes_max) + " bytes total)");
+	this->nbytes_charged = nslabs * nbytes_per_mapping;
+	budget->_register(this);
+    }
+
+    // Allocation threads: one per NUMA node (or one in total), or with parallel_allocation=true,
+    // one per core.  Each thread is pinned to its cores, so that it first-touches its slabs locally.
+    vector<int> thread_nodes;
+    vector<vector<int>> thread_cores;
+
+    for (int inode = 0; inode < nnodes; inode++) {
+	vector<int> cores = numa_aware ? get_numa_node_cores(nodes[inode]) : allocation_cores;
+
+	if (!ini_params.parallel_allocation) {
+	    thread_nodes.push_back(inode);
+	    thread_cores.push_back(cores);
+	}
+	else if (cores.size() > 0) {
+	    for (int c: cores) {
+		thread_nodes.push_back(inode);
+		thread_cores.push_back({ c });
+	    }
+	}
+	else {
+	    int nthreads = max(sysconf(_SC_NPROCESSORS_ONLN), 1L);
+	    for (int i = 0; i < nthreads; i++) {
+		thread_nodes.push_back(inode);
+		thread_cores.push_back(vector<int> ());
+	    }
+	}
+    }
 
     if (verbosity >= 1) {
 	cout << "ch_frb_io: allocating " << gb << " GB memory pool";
-	if (allocation_cores.size() > 0)
+	if (numa_aware)
+	    cout << ", NUMA nodes=" << vstr(nodes);
+	else if (allocation_cores.size() > 0)
 	    cout << ", cores=" << vstr(allocation_cores);
+	if (ini_params.parallel_allocation)
+	    cout << ", " << thread_nodes.size() << " threads";
 	cout << ", this may take a few seconds..." << endl;
     }
 
-    std::thread t(std::bind(&memory_slab_pool::allocate, this, allocation_cores));
-    t.join();
+    // Each node's slabs are split evenly between the node's threads.
+    unique_lock<std::mutex> ulock(this->lock);
+
+    for (int inode = 0; inode < nnodes; inode++) {
+	ssize_t n = (nslabs * (inode+1)) / nnodes - (nslabs * inode) / nnodes;
+	int nt = count(thread_nodes.begin(), thread_nodes.end(), inode);
 
-    if (curr_size != nslabs)
-	throw runtime_error("ch_frb_io::memory_slab_pool: something went wrong during allocation");
-    if (verbosity >= 1)
-	cout << "ch_frb_io: " << gb << " GB memory pool allocated" << endl;
+	for (unsigned int it = 0, jt = 0; it < thread_nodes.size(); it++) {
+	    if (thread_nodes[it] != inode)
+		continue;
+	    ssize_t m = (n * (jt+1)) / nt - (n * jt) / nt;
+	    this->allocation_threads.push_back(std::thread(std::bind(&memory_slab_pool::allocate, this, inode, m, thread_cores[it])));
+	    this->nthreads_running++;
+	    jt++;
+	}
+    }
+
+    while ((nslabs_allocated < nslabs_initial) && (nthreads_running > 0) && allocation_error.empty())
+	cv.wait(ulock);
+
+    string err = allocation_error;
+    bool background = (nslabs_allocated < nslabs);
+    this->allocating_in_background = background;
+    this->low_water_mark = curr_size;
+    ulock.unlock();
+
+    if (err.size() > 0) {
+	_join_allocation_threads();
+	_detach_budget();
+	throw runtime_error("ch_frb_io::memory_slab_pool: allocation failed: " + err);
+    }
+
+    if (!background)
+	_join_allocation_threads();
+
+    if (background_zeroing)
+	this->zeroing_thread = std::thread(std::bind(&memory_slab_pool::_zeroing_thread_main, this, ini_params.zeroing_cores));
+
+    if (verbosity >= 1) {
+	if (background)
+	    cout << "ch_frb_io: memory pool: " << nslabs_initial << "/" << nslabs << " slabs allocated, allocating remainder in background";
+	else
+	    cout << "ch_frb_io: " << gb << " GB memory pool allocated";
+	if (huge_page_size > 0) {
+	    ssize_t ps = get_page_size();
+	    cout << ", page size " << ps << ((ps < huge_page_size) ? " (explicit huge pages unavailable, using transparent huge pages)" : " (huge pages)");
+	}
+	cout << endl;
+    }
 }
 
 
 memory_slab_pool::~memory_slab_pool()
 {
+    unique_lock<std::mutex> ulock(this->lock);
+    this->allocation_cancelled = true;
+    this->zeroing_cancelled = true;
+    this->zeroing_cv.notify_all();
+    ulock.unlock();
+
+    _join_allocation_threads();
+
+    if (zeroing_thread.joinable())
+	zeroing_thread.join();
+
+    _detach_budget();
+
+    // Detach the per-thread magazines (their slabs are freed here).
+    ulock.lock();
+    vector<shared_ptr<magazine>> mags;
+    mags.swap(this->magazines);
+    ulock.unlock();
+
+    for (const auto &mag: mags) {
+	lock_guard<std::mutex> lg(mag->lock);
+	this->ncached -= mag->slabs.size();
+	mag->slabs.clear();
+	mag->zeroed.clear();
+	mag->pool = nullptr;
+    }
+
     if (verbosity >= 1) {
-	cout << "ch_frb_io: memory_slab_pool size_on_exit=" << curr_size << "/" << nslabs
-	     <<", low_water_mark=" << low_water_mark << "/" << nslabs << endl;
+	cout << "ch_frb_io: memory_slab_pool size_on_exit=" << curr_size << "/" << nslabs_allocated
+	     <<", low_water_mark=" << low_water_mark << "/" << nslabs_allocated << endl;
     }
 }
 
 
-memory_slab_t memory_slab_pool::get_slab(bool zero, bool wait)
+void memory_slab_pool::_join_allocation_threads()
+{
+    for (auto &t: allocation_threads)
+	if (t.joinable())
+	    t.join();
+}
+
+
+memory_slab_t memory_slab_pool::_pop_slab(int inode, bool zero, bool &is_zero)
+{
+    vector<memory_slab_t> &v1 = zero ? zeroed_slabs[inode] : slabs[inode];
+    vector<memory_slab_t> &v2 = zero ? slabs[inode] : zeroed_slabs[inode];
+    vector<memory_slab_t> &v = (v1.size() > 0) ? v1 : v2;
+
+    is_zero = (&v == &zeroed_slabs[inode]);
+
+    memory_slab_t ret = std::move(v.back());
+    v.pop_back();
+    return ret;
+}
+
+
+// Called with the lock held.  Wakes up the zeroing thread if this is the first dirty slab on the node.
+void memory_slab_pool::_push_dirty_slab(int inode, memory_slab_t &p)
+{
+    slabs[inode].push_back(std::move(p));
+
+    if (background_zeroing && (slabs[inode].size() == 1))
+	zeroing_cv.notify_one();
+}
+
+
+// Returns the index in 'nodes' of the given NUMA node (or 0, if the pool is not NUMA-aware, or the node is unknown).
+int memory_slab_pool::_node_index(int numa_node) const
+{
+    for (unsigned int i = 0; i < nodes.size(); i++)
+	if (nodes[i] == numa_node)
+	    return i;
+    return 0;
+}
+
+
+memory_slab_t memory_slab_pool::get_slab(bool zero, bool wait, int numa_node, int client, ssize_t nbytes_needed)
 {
     ssize_t loc_size = 0;
+    ssize_t nreclaim = 0;
     memory_slab_t ret;
+
+    if (numa_aware && (numa_node < 0))
+	numa_node = get_current_numa_node();
+
+    if ((client < -1) || (client >= nclients))
+	throw runtime_error("ch_frb_io: memory_slab_pool::get_slab(): invalid client id " + to_string(client));
+
+    // Fast path: per-thread magazine.
+    if ((magazine_size > 0) && !limits_active) {
+	bool is_zero = false;
+	ret = this->_magazine_get(numa_node, client, zero, is_zero);
+
+	if (ret) {
+	    if (zero && !is_zero) {
+		memset(ret.get(), 0, nbytes_per_slab);
+		this->num_zeroed_on_get++;
+	    }
+	    this->num_gets++;
+	    this->nbytes_requested += (nbytes_needed > 0) ? min(nbytes_needed, nbytes_per_slab) : nbytes_per_slab;
+	    return ret;
+	}
+    }
+
+    int inode = _node_index(numa_node);
+    int nnodes = nodes.size();
+    bool drained = false;
+    bool waiting = false;
+    bool is_zero = false;
+    bool grow_failed = false;
+
     unique_lock<std::mutex> ulock(this->lock);
 
     for (;;) {
+	// If the free list is empty, but other threads' magazines aren't, then drain the magazines (once,
+	// and again after registering as a waiter).
+	if ((curr_size == 0) && (ncached > 0) && !drained) {
+	    ulock.unlock();
+	    this->_drain_magazines();
+	    ulock.lock();
+	    drained = true;
+	    continue;
+	}
+
+	// If the only available slab is being zeroed, wait for it (this is short).
+	if ((curr_size == 0) && (nzeroing > 0)) {
+	    this->cv.wait(ulock);
+	    continue;
+	}
+
+	// If the free list is still empty, try to grow the pool (within the budget, see memory_slab_budget).
+	if ((curr_size == 0) && budget && !grow_failed && (nthreads_running == 0)
+	    && (nslabs_allocated + ngrowing < nslabs_max) && _client_within_quota(client)) {
+	    this->ngrowing++;
+	    ulock.unlock();
+	    memory_slab_t p = this->_grow(inode);
+	    ulock.lock();
+	    this->ngrowing--;
+
+	    if (!p) {
+		grow_failed = true;
+		continue;
+	    }
+
+	    this->nslabs_allocated++;
+	    this->node_nslabs[inode]++;
+	    this->nbytes_charged += nbytes_per_mapping;
+	    this->num_grown++;
+
+	    ret = std::move(p);
+	    ret.get_deleter().client = client;
+	    this->_charge(client, 1);
+	    is_zero = true;
+	    loc_size = curr_size;
+	    break;
+	}
+
 	if (curr_size > 0) {
-	    ret.swap(slabs[curr_size-1]);
+	    if (!_client_may_allocate(client)) {
+		pstats.num_quota_refusals++;
+		break;
+	    }
+
+	    // Prefer the requested node, falling back to the others in order.
+	    int i = inode;
+	    while (slabs[i].size() + zeroed_slabs[i].size() == 0)
+		i = (i+1) % nnodes;
+
+	    ret = this->_pop_slab(i, zero, is_zero);
+
+	    if (i != inode)
+		num_remote_slabs++;
+
+	    ret.get_deleter().client = client;
+	    this->_charge(client, 1);
+
 	    loc_size = --curr_size;
-	    low_water_mark = min(low_water_mark, loc_size);
+	    low_water_mark = min(low_water_mark, _navailable());
 	    break;
 	}
 
-	if (!wait) {
-	    ulock.unlock();
-	    if (verbosity >= 2)
-		cout << "ch_frb_io::memory_slab_pool::get_slab() FAILED" << endl;
-	    return ret;
+	if (!wait)
+	    break;
+
+	// While there are waiters, put_slab() bypasses the magazines (see _magazine_put()).
+	if (!waiting) {
+	    this->nwaiters++;
+	    waiting = true;
+	    drained = false;
+	    continue;
 	}
 
 	this->cv.wait(ulock);
     }
 
+    if (waiting)
+	this->nwaiters--;
+
+    if (!ret)
+	pstats.num_failed_gets++;
+
+    // Under memory pressure, ask clients to release slabs (unless another thread is already doing so).
+    // Slabs in per-thread magazines count as available, since they are idle (and can be drained).
+    if (!reclaiming && clients.size() && (!ret || (_navailable() < low_watermark))) {
+	nreclaim = max(high_watermark - _navailable(), ssize_t(1));
+	this->reclaiming = true;
+    }
+
     ulock.unlock();
 
+    if (nreclaim > 0)
+	this->_reclaim(nreclaim);
+
+    if (!ret) {
+	if (verbosity >= 2)
+	    cout << "ch_frb_io::memory_slab_pool::get_slab() FAILED" << endl;
+	return ret;
+    }
+
     if (verbosity >= 2)
        cout << "ch_frb_io::memory_slab_pool::get_slab(): " << loc_size << "/" << nslabs << endl;
-    if (!ret)
-	throw runtime_error("ch_frb_io: internal error: unexpected null pointer 'ret' in memory_slab_pool::get_slab()");
-    if (zero)
+
+    if (zero && !is_zero) {
 	memset(ret.get(), 0, nbytes_per_slab);
+	this->num_zeroed_on_get++;
+    }
+
+    this->num_gets++;
+    this->nbytes_requested += (nbytes_needed > 0) ? min(nbytes_needed, nbytes_per_slab) : nbytes_per_slab;
 
     return ret;
 }
@@ -91,45 +477,756 @@ void memory_slab_pool::put_slab(memory_slab_t &p)
     if (!p)
 	throw runtime_error("ch_frb_io: internal error: unexpected null pointer 'p' in memory_slab_pool::put_slab()");
 
+    int inode = _node_index(p.get_deleter().numa_node);
+    int client = p.get_deleter().client;
+
+    if ((client < -1) || (client >= nclients))
+	throw runtime_error("ch_frb_io: internal error: bad client id in memory_slab_pool::put_slab()");
+
+    // Fast path: per-thread magazine.
+    if ((magazine_size > 0) && this->_magazine_put(p))
+	return;
+
     unique_lock<std::mutex> ulock(this->lock);
 
-    if (curr_size >= (int)slabs.size())
+    if (curr_size + ncached + nzeroing >= nslabs_allocated)
 	throw runtime_error("ch_frb_io: internal error: buffer is full in memory_slab_pool::put_slab()");
-    if (slabs[curr_size])
-	throw runtime_error("ch_frb_io: internal error: unexpected null pointer 'slabs[curr_size]' in memory_slab_pool::put_slab()");
+
+    this->_charge(client, -1);
+    p.get_deleter().client = -1;
     
-    slabs[curr_size].swap(p);
+    this->_push_dirty_slab(inode, p);
     ssize_t loc_size = ++curr_size;
 
-    cv.notify_all();
+    // Blocked get_slab() callers only wait when the free list is empty.
+    if (loc_size == 1)
+	cv.notify_all();
+
     ulock.unlock();
 
     if (verbosity >= 2)
 	cout << "ch_frb_io::memory_slab_pool::put_slab(): " << loc_size << "/" << nslabs << endl;
 }
 
+
+// -------------------------------------------------------------------------------------------------
+//
+// Per-thread magazines
+
+
+memory_slab_pool::magazine &memory_slab_pool::_get_magazine(int client)
+{
+    static thread_local thread_magazines tm;
+
+    uint64_t k = thread_magazines::key(serial, client);
+    auto p = tm.m.find(k);
+
+    if (p != tm.m.end())
+	return *p->second;
+
+    shared_ptr<magazine> mag = make_shared<magazine> ();
+    mag->pool = this;
+    mag->client = client;
+    mag->slabs.reserve(magazine_size + 1);
+    mag->zeroed.reserve(magazine_size + 1);
+
+    unique_lock<std::mutex> ulock(this->lock);
+    this->magazines.push_back(mag);
+    ulock.unlock();
+
+    tm.m[k] = mag;
+    return *mag;
+}
+
+
+// Returns a slab from the calling thread's magazine (refilling it from the free list if necessary),
+// or a null pointer, in which case the caller falls back to the free list.  The magazine remembers
+// which of its slabs are zero, and prefers a zeroed slab if 'zero' is true (a dirty one otherwise).
+memory_slab_t memory_slab_pool::_magazine_get(int numa_node, int client, bool zero, bool &is_zero)
+{
+    magazine &mag = this->_get_magazine(client);
+    lock_guard<std::mutex> lg(mag.lock);
+
+    int inode = _node_index(numa_node);
+    ssize_t nreclaim = 0;
+
+    if ((mag.slabs.size() == 0) || (mag.slabs.back().get_deleter().numa_node != nodes[inode])) {
+	unique_lock<std::mutex> ulock(this->lock);
+
+	ssize_t n = min(ssize_t(max(magazine_size/2, 1)), ssize_t(slabs[inode].size() + zeroed_slabs[inode].size()));
+	for (ssize_t i = 0; i < n; i++) {
+	    bool z = false;
+	    mag.slabs.push_back(this->_pop_slab(inode, zero, z));
+	    mag.slabs.back().get_deleter().client = client;
+	    mag.zeroed.push_back(z);
+	}
+
+	this->_charge(client, n);
+	this->curr_size -= n;
+	this->ncached += n;
+
+	// Slabs in other threads' magazines are idle, and count as available, but the slabs in this
+	// magazine are about to be handed out.  (The low-water mark is only updated on refills.)
+	ssize_t navail = _navailable() - mag.slabs.size();
+	this->low_water_mark = min(low_water_mark, navail);
+
+	if (!reclaiming && clients.size() && (navail < low_watermark)) {
+	    nreclaim = max(high_watermark - navail, ssize_t(1));
+	    this->reclaiming = true;
+	}
+    }
+
+    if (nreclaim > 0)
+	this->_reclaim(nreclaim);
+
+    memory_slab_t ret;
+
+    if ((mag.slabs.size() == 0) || (mag.slabs.back().get_deleter().numa_node != nodes[inode]))
+	return ret;
+
+    // Most recently cached slab on the right node, preferring one whose zeroed state matches 'zero'.
+    ssize_t nmag = mag.slabs.size();
+    ssize_t j = nmag - 1;
+
+    for (ssize_t i = nmag-1; i >= 0; i--) {
+	if (mag.slabs[i].get_deleter().numa_node != nodes[inode])
+	    continue;
+	if (mag.zeroed[i] == zero) {
+	    j = i;
+	    break;
+	}
+    }
+
+    if (j != nmag-1) {
+	std::swap(mag.slabs[j], mag.slabs[nmag-1]);
+	bool z = mag.zeroed[j];
+	mag.zeroed[j] = mag.zeroed[nmag-1];
+	mag.zeroed[nmag-1] = z;
+    }
+
+    ret = std::move(mag.slabs.back());
+    is_zero = mag.zeroed.back();
+    mag.slabs.pop_back();
+    mag.zeroed.pop_back();
+    this->ncached--;
+    return ret;
+}
+
+
+// Puts a slab in the calling thread's magazine, flushing half of the magazine to the free list
+// if it is full.  Returns false if the slab should go directly to the free list instead (because it
+// belongs on another NUMA node, or a get_slab() caller is waiting).
+bool memory_slab_pool::_magazine_put(memory_slab_t &p)
+{
+    if (numa_aware && (p.get_deleter().numa_node != nodes[_node_index(get_current_numa_node())]))
+	return false;
+
+    magazine &mag = this->_get_magazine(p.get_deleter().client);
+    lock_guard<std::mutex> lg(mag.lock);
+
+    // Checked with the magazine's lock held, so that a waiter either drains this slab, or sees it in the free list.
+    if (nwaiters > 0)
+	return false;
+
+    if ((ssize_t)mag.slabs.size() >= magazine_size)
+	this->_flush_magazine(mag, max(magazine_size/2, 1));
+
+    mag.slabs.push_back(std::move(p));
+    mag.zeroed.push_back(false);
+    this->ncached++;
+    return true;
+}
+
+
+// Moves the 'n' least recently cached slabs from 'mag' to the free list.
+void memory_slab_pool::_flush_magazine(magazine &mag, ssize_t n)
+{
+    n = min(n, ssize_t(mag.slabs.size()));
+
+    if (n <= 0)
+	return;
+
+    lock_guard<std::mutex> lg(this->lock);
+
+    if (curr_size + ncached + nzeroing > nslabs_allocated)
+	throw runtime_error("ch_frb_io: internal error: buffer is full in memory_slab_pool::_flush_magazine()");
+
+    for (ssize_t i = 0; i < n; i++) {
+	memory_slab_t &p = mag.slabs[i];
+	int inode = _node_index(p.get_deleter().numa_node);
+	p.get_deleter().client = -1;
+
+	// Zeroed slabs which were never handed out go back to the zeroed list.
+	if (mag.zeroed[i])
+	    this->zeroed_slabs[inode].push_back(std::move(p));
+	else
+	    this->_push_dirty_slab(inode, p);
+    }
+
+    mag.slabs.erase(mag.slabs.begin(), mag.slabs.begin() + n);
+    mag.zeroed.erase(mag.zeroed.begin(), mag.zeroed.begin() + n);
+
+    ssize_t prev_size = curr_size;
+    this->_charge(mag.client, -n);
+    this->curr_size += n;
+    this->ncached -= n;
+
+    // Blocked get_slab() callers only wait when the free list is empty.
+    if (prev_size == 0)
+	cv.notify_all();
+}
+
+
+// Flushes all magazines (of all threads) to the free list.  Called without the lock held.
+void memory_slab_pool::_drain_magazines()
+{
+    unique_lock<std::mutex> ulock(this->lock);
+    vector<shared_ptr<magazine>> mags = this->magazines;
+    ulock.unlock();
+
+    for (const auto &mag: mags) {
+	lock_guard<std::mutex> lg(mag->lock);
+	if (mag->pool == this)
+	    this->_flush_magazine(*mag, mag->slabs.size());
+    }
+}
+
+
+int memory_slab_pool::add_client(int group, ssize_t nreserved, ssize_t quota, const reclaim_callback_t &reclaim_callback)
+{
+    if ((nreserved < 0) || (quota < 0))
+	throw runtime_error("ch_frb_io: memory_slab_pool::add_client(): expected nreserved >= 0 and quota >= 0");
+    if ((quota > 0) && (quota < nreserved))
+	throw runtime_error("ch_frb_io: memory_slab_pool::add_client(): quota is smaller than the reservation");
+
+    client_state c;
+    c.group = group;
+    c.nreserved = nreserved;
+    c.quota = quota;
+    c.reclaim_callback = reclaim_callback;
+
+    lock_guard<std::mutex> lg(this->lock);
+    this->clients.push_back(c);
+    this->groups[group];   // creates group with default limits, if it doesn't exist
+    this->nclients = clients.size();
+
+    if ((nreserved > 0) || (quota > 0))
+	this->limits_active = true;
+
+    return clients.size() - 1;
+}
+
+
+void memory_slab_pool::remove_client(int client)
+{
+    lock_guard<std::mutex> lg(this->lock);
+
+    if ((client < 0) || (client >= (int)clients.size()))
+	throw runtime_error("ch_frb_io: memory_slab_pool::remove_client(): invalid client id " + to_string(client));
+
+    // Slabs which are still charged to the client are uncharged when they're returned (see put_slab()).
+    clients[client].active = false;
+    clients[client].reclaim_callback = reclaim_callback_t();
+}
+
+
+void memory_slab_pool::set_group_limits(int group, ssize_t nreserved, ssize_t quota)
+{
+    if ((nreserved < 0) || (quota < 0))
+	throw runtime_error("ch_frb_io: memory_slab_pool::set_group_limits(): expected nreserved >= 0 and quota >= 0");
+
+    lock_guard<std::mutex> lg(this->lock);
+    this->groups[group].nreserved = nreserved;
+    this->groups[group].quota = quota;
+
+    if ((nreserved > 0) || (quota > 0))
+	this->limits_active = true;
+}
+
+
+memory_slab_pool::pressure_stats memory_slab_pool::get_pressure_stats()
+{
+    lock_guard<std::mutex> lg(this->lock);
+    return pstats;
+}
+
+void memory_slab_pool::get_zeroing_counts(int64_t &nzeroed_background, int64_t &nzeroed_on_get)
+{
+    lock_guard<std::mutex> lg(this->lock);
+    nzeroed_background = num_zeroed_background;
+    nzeroed_on_get = num_zeroed_on_get;
+}
+
+
+// Number of available slabs which 'client' may not take, because they are needed to honor the
+// unused reservations of other clients (and of other groups).  Called with the lock held.
+ssize_t memory_slab_pool::_nprotected(int client)
+{
+    ssize_t ret = 0;
+
+    for (const auto &kv: groups) {
+	bool own_group = (client >= 0) && (kv.first == clients[client].group);
+	ssize_t n = 0;
+
+	for (unsigned int i = 0; i < clients.size(); i++) {
+	    const client_state &c = clients[i];
+	    if (c.active && (c.group == kv.first) && ((int)i != client))
+		n += max(c.nreserved - c.nused, ssize_t(0));
+	}
+
+	// A group's reservation covers its clients' reservations, but doesn't protect the group from itself.
+	if (!own_group)
+	    n = max(n, kv.second.nreserved - kv.second.nused);
+
+	ret += n;
+    }
+
+    return ret;
+}
+
+
+bool memory_slab_pool::_client_may_allocate(int client)
+{
+    if (clients.size() == 0)
+	return true;
+    if (curr_size <= _nprotected(client))
+	return false;
+
+    return _client_within_quota(client);
+}
+
+
+bool memory_slab_pool::_client_within_quota(int client)
+{
+    if (client < 0)
+	return true;
+
+    const client_state &c = clients[client];
+    const group_state &g = groups[c.group];
+
+    if ((c.quota > 0) && (c.nused >= c.quota))
+	return false;
+    if ((g.quota > 0) && (g.nused >= g.quota))
+	return false;
+
+    return true;
+}
+
+
+void memory_slab_pool::_charge(int client, ssize_t n)
+{
+    if (client < 0)
+	return;
+
+    clients[client].nused += n;
+    groups[clients[client].group].nused += n;
+}
+
+
+// Asks clients which are over their reservations to release slabs, largest excess first.
+// Called without the lock held, by the thread which set 'reclaiming'.
+void memory_slab_pool::_reclaim(ssize_t nwanted)
+{
+    vector<pair<ssize_t, reclaim_callback_t>> v;
+
+    unique_lock<std::mutex> ulock(this->lock);
+
+    for (const auto &c: clients) {
+	if (c.active && c.reclaim_callback && (c.nused > c.nreserved))
+	    v.push_back({ c.nused - c.nreserved, c.reclaim_callback });
+    }
+
+    ulock.unlock();
+
+    std::stable_sort(v.begin(), v.end(),
+		     [](const pair<ssize_t, reclaim_callback_t> &a, const pair<ssize_t, reclaim_callback_t> &b) { return a.first > b.first; });
+
+    ssize_t n = 0;
+    for (const auto &p: v) {
+	if (n >= nwanted)
+	    break;
+	n += max(p.second(min(p.first, nwanted - n)), ssize_t(0));
+    }
+
+    ulock.lock();
+    this->reclaiming = false;
+    this->pstats.num_reclaims++;
+    this->pstats.num_slabs_reclaimed += n;
+    ulock.unlock();
+
+    if (verbosity >= 2)
+	cout << "ch_frb_io::memory_slab_pool: reclaim requested " << nwanted << " slabs, clients expect to release " << n << endl;
+}
+
+
+// Number of idle slabs: free lists, per-thread magazines, and slabs being zeroed.  Called with the lock held.
+ssize_t memory_slab_pool::_navailable() const
+{
+    return curr_size + ncached + nzeroing;
+}
+
+
 int memory_slab_pool::count_slabs_available() {
     unique_lock<std::mutex> ulock(this->lock);
-    int rtn = curr_size;
+    int rtn = curr_size + ncached + nzeroing;
     ulock.unlock();
     return rtn;
 }
 
+ssize_t memory_slab_pool::get_page_size()
+{
+    lock_guard<std::mutex> lg(this->lock);
+    return page_size;
+}
 
-// Called as separate thread!
-void memory_slab_pool::allocate(const vector<int> &allocation_cores)
+ssize_t memory_slab_pool::get_low_water_mark()
 {
-    pin_thread_to_cores(allocation_cores);
+    lock_guard<std::mutex> lg(this->lock);
+    return low_water_mark;
+}
 
-    this->slabs.reserve(nslabs);
+vector<memory_slab_pool::node_stats> memory_slab_pool::get_node_stats()
+{
+    vector<node_stats> ret(nodes.size());
+    unique_lock<std::mutex> ulock(this->lock);
 
-    for (ssize_t i = 0; i < nslabs; i++) {
-	uint8_t *p = aligned_alloc<uint8_t> (nbytes_per_slab);
-	this->slabs.push_back(memory_slab_t(p));
+    for (unsigned int i = 0; i < nodes.size(); i++) {
+	ret[i].numa_node = nodes[i];
+	ret[i].nslabs = node_nslabs[i];
+	ret[i].navailable = slabs[i].size() + zeroed_slabs[i].size();
     }
 
-    this->curr_size = nslabs;
-    this->low_water_mark = nslabs;
+    return ret;
+}
+
+int64_t memory_slab_pool::get_num_remote_slabs()
+{
+    unique_lock<std::mutex> ulock(this->lock);
+    return num_remote_slabs;
+}
+
+
+ssize_t memory_slab_pool::get_num_slabs_allocated()
+{
+    unique_lock<std::mutex> ulock(this->lock);
+    return nslabs_allocated;
+}
+
+bool memory_slab_pool::allocation_complete()
+{
+    unique_lock<std::mutex> ulock(this->lock);
+    return (nthreads_running == 0);
+}
+
+void memory_slab_pool::wait_for_allocation()
+{
+    unique_lock<std::mutex> ulock(this->lock);
+
+    while (nthreads_running > 0)
+	cv.wait(ulock);
+
+    if (allocation_error.size() > 0)
+	throw runtime_error("ch_frb_io::memory_slab_pool: allocation failed: " + allocation_error);
+}
+
+
+memory_slab_pool::usage_stats memory_slab_pool::get_usage_stats()
+{
+    usage_stats ret;
+    unique_lock<std::mutex> ulock(this->lock);
+
+    ret.nbytes_per_slab = nbytes_per_slab;
+    ret.nslabs_allocated = nslabs_allocated;
+    ret.nslabs_max = nslabs_max;
+    ret.nslabs_in_use = nslabs_allocated - curr_size - ncached - nzeroing;
+    ret.num_grown = num_grown;
+    ret.num_shrunk = num_shrunk;
+    ulock.unlock();
+
+    ret.nbytes_requested = nbytes_requested;
+    ret.nbytes_handed_out = num_gets * nbytes_per_slab;
+
+    if (ret.nslabs_allocated > 0)
+	ret.utilization = double(ret.nslabs_in_use) / double(ret.nslabs_allocated);
+    if (ret.nbytes_handed_out > 0)
+	ret.fragmentation = 1.0 - double(ret.nbytes_requested) / double(ret.nbytes_handed_out);
+
+    return ret;
+}
+
+
+// -------------------------------------------------------------------------------------------------
+//
+// Size classes
+
+
+// Allocates one slab on demand, or returns a null pointer if the budget is exhausted.
+memory_slab_t memory_slab_pool::_grow(int inode)
+{
+    memory_slab_t p;
+
+    if (!budget->_try_charge(this, nbytes_per_mapping))
+	return p;
+
+    try {
+	ssize_t ps = 0;
+
+	if (huge_page_size > 0)
+	    p = huge_page_alloc(nbytes_per_slab, huge_page_size, ps);
+	else
+	    p = memory_slab_t(aligned_alloc<uint8_t> (nbytes_per_slab));
+
+	p.get_deleter().numa_node = nodes[inode];
+
+	if (ps > 0) {
+	    lock_guard<std::mutex> lg(this->lock);
+	    this->page_size = min(page_size, ps);
+	}
+    } catch (exception &e) {
+	budget->_release(nbytes_per_mapping);
+	if (verbosity >= 1)
+	    cout << "ch_frb_io: memory_slab_pool: on-demand slab allocation failed: " << e.what() << endl;
+	return memory_slab_t();
+    }
+
+    if (verbosity >= 2)
+	cout << "ch_frb_io::memory_slab_pool: grew by one slab (" << nbytes_per_mapping << " bytes)" << endl;
+
+    return p;
+}
+
+
+// Frees idle slabs above 'nslabs' (at least 'nbytes', if possible).  Called by the budget, with its lock held.
+ssize_t memory_slab_pool::_shrink(ssize_t nbytes)
+{
+    vector<memory_slab_t> freed;   // freed when this function returns, without the lock held
+    unique_lock<std::mutex> ulock(this->lock);
+
+    if (nthreads_running > 0)
+	return 0;
+
+    ssize_t n = (nbytes + nbytes_per_mapping - 1) / nbytes_per_mapping;
+    n = min(n, nslabs_allocated - nslabs);
+    n = min(n, curr_size);
+
+    for (unsigned int inode = 0; (inode < nodes.size()) && ((ssize_t)freed.size() < n); inode++) {
+	while (((ssize_t)freed.size() < n) && (slabs[inode].size() + zeroed_slabs[inode].size() > 0)) {
+	    bool is_zero = false;
+	    freed.push_back(this->_pop_slab(inode, false, is_zero));
+	    this->node_nslabs[inode]--;
+	}
+    }
+
+    ssize_t ret = freed.size() * nbytes_per_mapping;
+
+    this->curr_size -= freed.size();
+    this->nslabs_allocated -= freed.size();
+    this->nbytes_charged -= ret;
+    this->num_shrunk += freed.size();
+    this->low_water_mark = min(low_water_mark, _navailable());
+    ulock.unlock();
+
+    if ((verbosity >= 2) && (freed.size() > 0))
+	cout << "ch_frb_io::memory_slab_pool: shrunk by " << freed.size() << " slabs (" << ret << " bytes)" << endl;
+
+    return ret;
+}
+
+
+// Unregisters the pool from its budget, and releases its bytes.  Called by the destructor.
+void memory_slab_pool::_detach_budget()
+{
+    if (!budget)
+	return;
+
+    budget->_unregister(this);
+
+    unique_lock<std::mutex> ulock(this->lock);
+    ssize_t n = this->nbytes_charged;
+    this->nbytes_charged = 0;
+    ulock.unlock();
+
+    budget->_release(n);
+}
+
+
+memory_slab_budget::memory_slab_budget(ssize_t nbytes_max_) :
+    nbytes_max(nbytes_max_)
+{
+    if (nbytes_max <= 0)
+	throw runtime_error("ch_frb_io: memory_slab_budget constructor expects nbytes_max > 0");
+}
+
+
+bool memory_slab_budget::_try_charge(memory_slab_pool *requester, ssize_t nbytes)
+{
+    lock_guard<std::mutex> lg(this->lock);
+
+    for (memory_slab_pool *p: pools) {
+	if (nbytes_used + nbytes <= nbytes_max)
+	    break;
+	if (p != requester)
+	    this->nbytes_used -= p->_shrink(nbytes_used + nbytes - nbytes_max);
+    }
+
+    if (nbytes_used + nbytes > nbytes_max) {
+	this->num_failed_charges++;
+	return false;
+    }
+
+    this->nbytes_used += nbytes;
+    return true;
+}
+
+void memory_slab_budget::_release(ssize_t nbytes)
+{
+    lock_guard<std::mutex> lg(this->lock);
+    this->nbytes_used -= nbytes;
+}
+
+void memory_slab_budget::_register(memory_slab_pool *pool)
+{
+    lock_guard<std::mutex> lg(this->lock);
+    this->pools.push_back(pool);
+}
+
+void memory_slab_budget::_unregister(memory_slab_pool *pool)
+{
+    lock_guard<std::mutex> lg(this->lock);
+    pools.erase(std::remove(pools.begin(), pools.end(), pool), pools.end());
+}
+
+ssize_t memory_slab_budget::get_nbytes_used()
+{
+    lock_guard<std::mutex> lg(this->lock);
+    return nbytes_used;
+}
+
+int64_t memory_slab_budget::get_num_failed_charges()
+{
+    lock_guard<std::mutex> lg(this->lock);
+    return num_failed_charges;
+}
+
+vector<memory_slab_pool::usage_stats> memory_slab_budget::get_class_stats()
+{
+    lock_guard<std::mutex> lg(this->lock);
+    vector<memory_slab_pool::usage_stats> ret;
+
+    for (memory_slab_pool *p: pools)
+	ret.push_back(p->get_usage_stats());
+
+    return ret;
+}
+
+
+// Zeroes a slab with non-temporal stores, so that the zeroing thread doesn't evict the working set
+// of the assembler and processing threads from the shared caches.  Slabs are (at least) 64-byte aligned.
+static void _zero_slab_nontemporal(uint8_t *p, ssize_t nbytes)
+{
+#ifdef __AVX2__
+    __m256i z = _mm256_setzero_si256();
+    ssize_t n = nbytes & ~ssize_t(31);
+
+    for (ssize_t i = 0; i < n; i += 32)
+	_mm256_stream_si256(reinterpret_cast<__m256i *> (p+i), z);
+
+    _mm_sfence();
+    memset(p+n, 0, nbytes-n);
+#else
+    memset(p, 0, nbytes);
+#endif
+}
+
+
+// Called as separate thread!  Moves slabs from the dirty lists to the zeroed lists.
+void memory_slab_pool::_zeroing_thread_main(const vector<int> &cores)
+{
+    pin_thread_to_cores(cores);
+
+    int nnodes = nodes.size();
+    unique_lock<std::mutex> ulock(this->lock);
+
+    for (;;) {
+	if (zeroing_cancelled)
+	    return;
+
+	int inode = 0;
+	while ((inode < nnodes) && (slabs[inode].size() == 0))
+	    inode++;
+
+	if (inode == nnodes) {
+	    zeroing_cv.wait(ulock);
+	    continue;
+	}
+
+	memory_slab_t p = std::move(slabs[inode].back());
+	slabs[inode].pop_back();
+	this->curr_size--;
+	this->nzeroing++;
+	ulock.unlock();
+
+	_zero_slab_nontemporal(p.get(), nbytes_per_slab);
+
+	ulock.lock();
+	this->zeroed_slabs[inode].push_back(std::move(p));
+	this->nzeroing--;
+	this->num_zeroed_background++;
+
+	// Blocked get_slab() callers only wait when the free list is empty.
+	if (++curr_size == 1)
+	    cv.notify_all();
+    }
+}
+
+
+// Called as separate thread (one or more per node)!
+// Slabs are added to the pool one at a time, so that they can be used while allocation continues.
+void memory_slab_pool::allocate(int inode, ssize_t n, const vector<int> &allocation_cores)
+{
+    string err;
+
+    try {
+	pin_thread_to_cores(allocation_cores);
+
+	for (ssize_t i = 0; i < n; i++) {
+	    memory_slab_t p;
+	    ssize_t ps = 0;
+
+	    if (huge_page_size > 0)
+		p = huge_page_alloc(nbytes_per_slab, huge_page_size, ps);
+	    else
+		p = memory_slab_t(aligned_alloc<uint8_t> (nbytes_per_slab));
+
+	    p.get_deleter().numa_node = nodes[inode];
+
+	    lock_guard<std::mutex> lg(this->lock);
+
+	    if (allocation_cancelled)
+		break;
+
+	    this->zeroed_slabs[inode].push_back(std::move(p));   // new slabs are zero
+	    this->node_nslabs[inode]++;
+	    this->nslabs_allocated++;
+	    this->curr_size++;
+	    if (ps > 0)
+		this->page_size = min(page_size, ps);
+	    this->cv.notify_all();
+	}
+    } catch (exception &e) {
+	err = e.what();
+    }
+
+    lock_guard<std::mutex> lg(this->lock);
+
+    if ((err.size() > 0) && allocation_error.empty())
+	this->allocation_error = err;
+
+    this->nthreads_running--;
+    this->cv.notify_all();
+
+    if ((nthreads_running == 0) && allocating_in_background && (verbosity >= 1) && !allocation_cancelled && allocation_error.empty())
+	cout << "ch_frb_io: memory pool: all " << nslabs_allocated << " slabs allocated" << endl;
 }
 
 
@@ -1,5 +1,11 @@
 #include <thread>
-#include "ch_frb_io.hpp"
+#include <fstream>
+#include <algorithm>
+#include <sched.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "ch_frb_io_internals.hpp"
 
 using namespace std;
 
@@ -36,4 +42,183 @@ void pin_thread_to_cores(const vector<int> &core_list)
 }
 
 
+// -------------------------------------------------------------------------------------------------
+//
+// Huge page allocation.
+
+
+void memory_slab_deleter::operator()(uint8_t *p) const
+{
+    if (!p)
+	return;
+    if (mmap_nbytes > 0)
+	munmap(p, mmap_nbytes);
+    else
+	free(p);
+}
+
+
+memory_slab_t huge_page_alloc(ssize_t nbytes, ssize_t huge_page_size, ssize_t &page_size)
+{
+    ssize_t base_page_size = sysconf(_SC_PAGESIZE);
+
+    if (nbytes <= 0)
+	throw runtime_error("ch_frb_io: huge_page_alloc(): expected nbytes > 0");
+    if ((huge_page_size < base_page_size) || (huge_page_size & (huge_page_size-1)))
+	throw runtime_error("ch_frb_io: huge_page_alloc(): 'huge_page_size' must be a power of two, and at least the base page size");
+
+    ssize_t n = ((nbytes + huge_page_size - 1) / huge_page_size) * huge_page_size;
+
+#ifdef MAP_HUGETLB
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE;
+#ifdef MAP_HUGE_SHIFT
+    int log2_size = __builtin_ctzll(huge_page_size);
+    flags |= (log2_size << MAP_HUGE_SHIFT);
+#endif
+
+    void *p = mmap(NULL, n, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (p != MAP_FAILED) {
+	page_size = huge_page_size;
+	return memory_slab_t(reinterpret_cast<uint8_t *> (p), memory_slab_deleter(n));
+    }
+#endif
+
+    // Fallback: ordinary mapping, aligned to huge_page_size so that the kernel can use transparent
+    // huge pages.  We over-allocate, then unmap the unaligned head and tail.
+    ssize_t m = n + huge_page_size;
+    void *q = mmap(NULL, m, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (q == MAP_FAILED)
+	throw runtime_error("ch_frb_io: huge_page_alloc(): mmap() failed: " + string(strerror(errno)));
+
+    uintptr_t q0 = reinterpret_cast<uintptr_t> (q);
+    uintptr_t p0 = ((q0 + huge_page_size - 1) / huge_page_size) * huge_page_size;
+
+    if (p0 > q0)
+	munmap(q, p0 - q0);
+    if (p0 + n < q0 + m)
+	munmap(reinterpret_cast<void *> (p0 + n), (q0 + m) - (p0 + n));
+
+    uint8_t *ret = reinterpret_cast<uint8_t *> (p0);
+
+#ifdef MADV_HUGEPAGE
+    madvise(ret, n, MADV_HUGEPAGE);
+#endif
+
+    // Prefault (after madvise(), so that the kernel can use huge pages).
+    memset(ret, 0, n);
+
+    page_size = base_page_size;
+    return memory_slab_t(ret, memory_slab_deleter(n));
+}
+
+
+memory_slab_t alloc_memory_slab(ssize_t nbytes, ssize_t huge_page_size)
+{
+    if (huge_page_size > 0) {
+	ssize_t page_size = 0;
+	return huge_page_alloc(nbytes, huge_page_size, page_size);
+    }
+
+    return memory_slab_t(aligned_alloc<uint8_t> (nbytes));
+}
+
+
+// -------------------------------------------------------------------------------------------------
+//
+// NUMA topology
+
+
+// Parses a sysfs cpulist such as "0-3,8-11".
+static vector<int> parse_cpulist(const string &s)
+{
+    vector<int> ret;
+    stringstream ss(s);
+    string tok;
+
+    while (getline(ss, tok, ',')) {
+	if (tok.size() == 0 || tok == "\n")
+	    continue;
+	int lo = 0, hi = 0;
+	if (sscanf(tok.c_str(), "%d-%d", &lo, &hi) == 2) {
+	    for (int i = lo; i <= hi; i++)
+		ret.push_back(i);
+	}
+	else if (sscanf(tok.c_str(), "%d", &lo) == 1)
+	    ret.push_back(lo);
+    }
+
+    return ret;
+}
+
+
+vector<int> get_numa_nodes()
+{
+    vector<int> ret;
+
+#ifndef __APPLE__
+    DIR *dir = opendir("/sys/devices/system/node");
+
+    if (dir) {
+	struct dirent *d;
+	while ((d = readdir(dir)) != NULL) {
+	    int node = 0;
+	    if ((strncmp(d->d_name, "node", 4) == 0) && (sscanf(d->d_name + 4, "%d", &node) == 1))
+		ret.push_back(node);
+	}
+	closedir(dir);
+    }
+#endif
+
+    if (ret.size() == 0)
+	ret.push_back(0);
+
+    std::sort(ret.begin(), ret.end());
+    return ret;
+}
+
+
+vector<int> get_numa_node_cores(int node)
+{
+    vector<int> ret;
+
+#ifndef __APPLE__
+    ifstream f("/sys/devices/system/node/node" + to_string(node) + "/cpulist");
+    string s;
+    if (f.good() && getline(f, s))
+	ret = parse_cpulist(s);
+#endif
+
+    if ((ret.size() == 0) && (node == 0)) {
+	for (unsigned int i = 0; i < std::thread::hardware_concurrency(); i++)
+	    ret.push_back(i);
+    }
+
+    return ret;
+}
+
+
+int get_current_numa_node()
+{
+#ifdef __APPLE__
+    return 0;
+#else
+    // Table (cpu -> node), computed on first call.
+    static const vector<int> cpu_to_node = []() {
+	vector<int> t;
+	for (int node: get_numa_nodes()) {
+	    for (int cpu: get_numa_node_cores(node)) {
+		if (cpu >= (int)t.size())
+		    t.resize(cpu+1, 0);
+		t[cpu] = node;
+	    }
+	}
+	return t;
+    }();
+
+    int cpu = sched_getcpu();
+    return ((cpu >= 0) && (cpu < (int)cpu_to_node.size())) ? cpu_to_node[cpu] : 0;
+#endif
+}
+
+
 }  // namespace ch_frb_io
@@ -25,7 +25,8 @@ output_device::output_device(const output_device::initializer &ini_params_) :
 {
     // Note: no sanity-checking of ini_params needed here!
     // XXX 32M is overkill!  How much space should I use here?
-    this->_buffer = unique_ptr<uint8_t[]> (new uint8_t[32 * 1024 * 1024]);
+    this->_buffer_nbytes = 32 * 1024 * 1024;
+    this->_buffer = alloc_memory_slab(_buffer_nbytes, ini_params.huge_page_size);
 }
 
 
@@ -146,9 +147,11 @@ bool output_device::enqueue_write_request(const shared_ptr<write_chunk_request>
 
     if (req->need_rfi_mask && !req->chunk->has_rfi_mask) {
         _awaiting_rfi.push_back(req);
+        _nbytes_awaiting_rfi += req->chunk->get_memory_nbytes();
         req->status_changed(false, true, "AWAITING_RFI", "Waiting for RFI mask to be computed");
     } else {
         _write_reqs.push(req);
+        _nbytes_queued += req->chunk->get_memory_nbytes();
         req->status_changed(false, true, "QUEUED", "Queued for writing");
         _cond.notify_all();
     }
@@ -176,6 +179,12 @@ int output_device::count_queued_write_requests() {
     return rtn;
 }
 
+void output_device::get_memory_accounting(int64_t &nbytes_queued, int64_t &nbytes_awaiting_rfi, int64_t &nbytes_buffer) {
+    nbytes_queued = _nbytes_queued;
+    nbytes_awaiting_rfi = _nbytes_awaiting_rfi;
+    nbytes_buffer = _buffer_nbytes;
+}
+
 // This gets called by the chime_mask_counter class in rf_pipelines
 // to tell us that a chunk's RFI mask has been filled in.
 void output_device::filled_rfi_mask(const std::shared_ptr<assembled_chunk> &chunk) {
@@ -198,6 +207,8 @@ shared_ptr<write_chunk_request> output_device::pop_write_request()
             if ((*req)->chunk->has_rfi_mask) {
                 cout << "Chunk " << (*req)->filename << " got its RFI mask!" << endl;
                 _write_reqs.push((*req));
+                _nbytes_queued += (*req)->chunk->get_memory_nbytes();
+                _nbytes_awaiting_rfi -= (*req)->chunk->get_memory_nbytes();
                 (*req)->status_changed(false, true, "QUEUED", "RFI mask received; queued for writing");
                 auto toerase = req;
                 req--;
@@ -213,6 +224,7 @@ shared_ptr<write_chunk_request> output_device::pop_write_request()
 
     shared_ptr<write_chunk_request> ret = _write_reqs.top();
     _write_reqs.pop();
+    _nbytes_queued -= ret->chunk->get_memory_nbytes();
     _cond.notify_all();
 
     int n = _write_reqs.size();
@@ -242,6 +254,8 @@ void output_device::end_stream(bool wait)
 	while (!_write_reqs.empty())
 	    _write_reqs.pop();
 	_awaiting_rfi.clear();
+	_nbytes_queued = 0;
+	_nbytes_awaiting_rfi = 0;
 	_cond.notify_all();
 	return;
     }
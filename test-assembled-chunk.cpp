@@ -10,6 +10,175 @@
 using namespace std;
 using namespace ch_frb_io;
 
+
+// In-memory compression round trip with low-entropy data, which bitshuffle/LZ4 should compress.
+// Within each (coarse freq, packet) block, all samples are equal, so 4-bit requantization is exact.
+static void test_compressible_round_trip(const assembled_chunk::initializer &ini_params, int nbits)
+{
+    unique_ptr<assembled_chunk> chunk = assembled_chunk::make(ini_params);
+    unique_ptr<assembled_chunk> cchunk = assembled_chunk::make(ini_params);
+    unique_ptr<assembled_chunk> dchunk = assembled_chunk::make(ini_params);
+
+    for (int i = 0; i < chunk->nscales; i++) {
+        chunk->scales[i] = 1.0 + 0.001 * (i % 100);
+        chunk->offsets[i] = 10.0 * (i % 7);
+    }
+
+    for (int i = 0; i < chunk->ndata; i++) {
+        int it = i % chunk->nt_per_chunk;
+        chunk->data[i] = ((it / (4 * chunk->nt_per_packet)) % 2) ? 100 : 113;
+    }
+
+    memcpy(cchunk->data, chunk->data, chunk->ndata);
+    memcpy(cchunk->scales, chunk->scales, chunk->nscales * sizeof(float));
+    memcpy(cchunk->offsets, chunk->offsets, chunk->nscales * sizeof(float));
+    cchunk->compress(nbits, true);
+
+    ssize_t nd = (nbits == 8) ? chunk->ndata : (chunk->ndata / 2);
+    cout << "Compressed low-entropy chunk in memory (nbits=" << nbits << "): " << nd << " -> " << cchunk->get_compressed_nbytes() << " bytes" << endl;
+
+    if (cchunk->get_compressed_nbytes() >= nd)
+        throw runtime_error("test-assembled-chunk: low-entropy chunk didn't compress (nbits=" + to_string(nbits) + ")");
+
+    cchunk->decompress(dchunk.get());
+
+    // Compare decoded intensities (the 8-bit values and scales differ after 4-bit requantization).
+    int nt = chunk->nt_per_chunk;
+    int nrows = chunk->nfreq_coarse * chunk->nupfreq;
+    vector<float> int1(nrows * nt), wt1(nrows * nt), int2(nrows * nt), wt2(nrows * nt);
+    chunk->decode(&int1[0], &wt1[0], nt, nt);
+    dchunk->decode(&int2[0], &wt2[0], nt, nt);
+
+    for (int i = 0; i < nrows * nt; i++) {
+        if ((wt1[i] != wt2[i]) || (fabs(int1[i] - int2[i]) > 1.0e-3 * (1.0 + fabs(int1[i]))))
+            throw runtime_error("test-assembled-chunk: MISMATCH in compressed low-entropy chunk (nbits=" + to_string(nbits) + ")");
+    }
+}
+
+
+// Ring buffer snapshots can return compressed chunks.  Check that they can still be decoded and
+// packed with msgpack (both go through a decompressed temporary).
+static void test_pack_compressed_chunk(const assembled_chunk::initializer &ini_params, std::mt19937 &rng)
+{
+    shared_ptr<assembled_chunk> chunk = assembled_chunk::make(ini_params);
+    shared_ptr<assembled_chunk> cchunk = assembled_chunk::make(ini_params);
+    chunk->randomize(rng);
+    cchunk->fill_with_copy(chunk);
+    cchunk->compress();
+
+    if (!cchunk->is_compressed() || cchunk->data)
+        throw runtime_error("test-assembled-chunk: expected compress() to release the chunk's arrays");
+
+    int nt = chunk->nt_per_chunk;
+    int nrows = chunk->nfreq_coarse * chunk->nupfreq;
+    vector<float> int1(nrows * nt), wt1(nrows * nt), int2(nrows * nt), wt2(nrows * nt);
+    chunk->decode(&int1[0], &wt1[0], nt, nt);
+    cchunk->decode(&int2[0], &wt2[0], nt, nt);
+
+    if ((int1 != int2) || (wt1 != wt2))
+        throw runtime_error("test-assembled-chunk: MISMATCH in decode() of compressed chunk");
+
+    msgpack::sbuffer sbuf;
+    msgpack::pack(sbuf, cchunk);
+
+    msgpack::object_handle oh = msgpack::unpack(sbuf.data(), sbuf.size());
+    shared_ptr<assembled_chunk> inchunk;
+    oh.get().convert(inchunk);
+
+    if (inchunk->is_compressed() ||
+        memcmp(inchunk->data, chunk->data, chunk->ndata) ||
+        memcmp(inchunk->scales, chunk->scales, chunk->nscales * sizeof(float)) ||
+        memcmp(inchunk->offsets, chunk->offsets, chunk->nscales * sizeof(float)))
+        throw runtime_error("test-assembled-chunk: MISMATCH in msgpack round trip of compressed chunk");
+}
+
+
+// Msgpack round trip, and reference vs fast decode(), for chunks with non-default 'nt_per_chunk' or
+// a subset of coarse frequency channels (msgpack format version 4).
+static void test_chunk_variant(int nt_per_chunk, const vector<int> &coarse_freq_ids, std::mt19937 &rng, const string &fn)
+{
+    // (assembled_chunk::initializer isn't copyable.)
+    auto set_params = [&](assembled_chunk::initializer &p) {
+        p.beam_id = 42;
+        p.nupfreq = 16;
+        p.nt_per_packet = 16;
+        p.nt_per_chunk = nt_per_chunk;
+        p.fpga_counts_per_sample = 400;
+        p.ichunk = 1000;
+        p.freq_map = coarse_freq_map::make(coarse_freq_ids);
+    };
+
+    assembled_chunk::initializer ref_params;
+    set_params(ref_params);
+    ref_params.force_reference = true;
+
+    shared_ptr<assembled_chunk> chunk = assembled_chunk::make(ref_params);
+    chunk->randomize(rng);
+
+    int nt = chunk->nt_per_chunk;
+    int nrows = chunk->nfreq_coarse * chunk->nupfreq;
+    vector<float> int0(nrows * nt), wt0(nrows * nt);
+    chunk->decode(&int0[0], &wt0[0], nt, nt);
+
+    // Compares decode() and decode_subset() of 'c' with the reference decode() of 'chunk'.
+    auto check_decode = [&](const shared_ptr<assembled_chunk> &c, const string &what) {
+        vector<float> int1(nrows * nt), wt1(nrows * nt);
+        c->decode(&int1[0], &wt1[0], nt, nt);
+
+        int t0 = nt / 4;
+        int NT = nt / 2;
+        vector<float> int2(nrows * NT), wt2(nrows * NT);
+        c->decode_subset(&int2[0], &wt2[0], t0, NT, NT, NT);
+
+        for (int i = 0; i < nrows; i++) {
+            for (int it = 0; it < nt; it++) {
+                int j = i*nt + it;
+                if ((wt0[j] != wt1[j]) || ((wt0[j] != 0.0) && (fabs(int0[j] - int1[j]) > 1.0e-5 * (1.0 + fabs(int0[j])))))
+                    throw runtime_error("test-assembled-chunk: decode() mismatch (" + what + ")");
+            }
+            for (int it = 0; it < NT; it++) {
+                int j = i*nt + t0 + it;
+                int k = i*NT + it;
+                if ((wt0[j] != wt2[k]) || ((wt0[j] != 0.0) && (fabs(int0[j] - int2[k]) > 1.0e-5 * (1.0 + fabs(int0[j])))))
+                    throw runtime_error("test-assembled-chunk: decode_subset() mismatch (" + what + ")");
+            }
+        }
+    };
+
+    check_decode(chunk, "reference");
+
+#ifdef __AVX2__
+    // Fast kernels exist for these parameters (nt_per_packet=16, nupfreq even, nt_per_chunk a multiple of 256).
+    assembled_chunk::initializer fast_params;
+    set_params(fast_params);
+    fast_params.force_fast = true;
+
+    shared_ptr<assembled_chunk> fchunk = assembled_chunk::make(fast_params);
+    fchunk->fill_with_copy(chunk);
+    check_decode(fchunk, "fast kernels");
+#endif
+
+    chunk->write_msgpack_file(fn, true);
+    shared_ptr<assembled_chunk> inchunk = assembled_chunk::read_msgpack_file(fn);
+
+    if ((inchunk->nt_per_chunk != chunk->nt_per_chunk) || (inchunk->nfreq_coarse != chunk->nfreq_coarse) || (inchunk->nupfreq != chunk->nupfreq))
+        throw runtime_error("test-assembled-chunk: msgpack round trip changed chunk parameters (" + fn + ")");
+
+    for (int i = 0; i < chunk->nfreq_coarse; i++) {
+        if (inchunk->get_coarse_freq_id(i) != chunk->get_coarse_freq_id(i))
+            throw runtime_error("test-assembled-chunk: msgpack round trip changed coarse frequency ids (" + fn + ")");
+    }
+
+    if (memcmp(inchunk->data, chunk->data, chunk->ndata) ||
+        memcmp(inchunk->scales, chunk->scales, chunk->nscales * sizeof(float)) ||
+        memcmp(inchunk->offsets, chunk->offsets, chunk->nscales * sizeof(float)))
+        throw runtime_error("test-assembled-chunk: MISMATCH in msgpack round trip (" + fn + ")");
+
+    // The chunk read from msgpack may use either kernel.
+    check_decode(inchunk, "msgpack");
+}
+
+
 int main(int argc, char **argv)
 {
     /*
@@ -40,6 +209,41 @@ int main(int argc, char **argv)
     unique_ptr<assembled_chunk> chunk = assembled_chunk::make(ini_params);
     chunk->randomize(rng);
 
+    // In-memory compression round trip (as used in the deep levels of the telescoping ring buffer).
+    unique_ptr<assembled_chunk> cchunk = assembled_chunk::make(ini_params);
+    unique_ptr<assembled_chunk> dchunk = assembled_chunk::make(ini_params);
+    memcpy(cchunk->data, chunk->data, chunk->ndata);
+    memcpy(cchunk->scales, chunk->scales, chunk->nscales * sizeof(float));
+    memcpy(cchunk->offsets, chunk->offsets, chunk->nscales * sizeof(float));
+    cchunk->compress();
+    cout << "Compressed chunk in memory: " << chunk->ndata << " -> " << cchunk->get_compressed_nbytes() << " bytes" << endl;
+    cchunk->decompress(dchunk.get());
+    if (memcmp(dchunk->data, chunk->data, chunk->ndata) ||
+        memcmp(dchunk->scales, chunk->scales, chunk->nscales * sizeof(float)) ||
+        memcmp(dchunk->offsets, chunk->offsets, chunk->nscales * sizeof(float))) {
+        cout << "MISMATCH in compressed chunk" << endl;
+    }
+
+    // The random data above is incompressible (it is stored uncompressed), so we also check that
+    // the LZ4 path is taken for compressible data, with and without 4-bit requantization.
+    assembled_chunk::initializer small_params;
+    small_params.beam_id = beam_id;
+    small_params.nupfreq = 2;
+    small_params.nt_per_packet = nt_per_packet;
+    small_params.fpga_counts_per_sample = fpga_counts_per_sample;
+    small_params.ichunk = ichunk;
+    test_compressible_round_trip(small_params, 8);
+    test_compressible_round_trip(small_params, 4);
+    test_pack_compressed_chunk(small_params, rng);
+
+    // Non-default nt_per_chunk, and a subset of coarse frequency channels.
+    vector<int> coarse_freq_ids;
+    for (int i = 0; i < constants::nfreq_coarse_tot; i += randint(rng, 1, 20))
+        coarse_freq_ids.push_back(i);
+
+    test_chunk_variant(256, vector<int> (), rng, "test_assembled_chunk_nt256.msgpack");
+    test_chunk_variant(constants::nt_per_assembled_chunk, coarse_freq_ids, rng, "test_assembled_chunk_subset.msgpack");
+
     /*
      const char *filename = "test_assembled_chunk.hdf5";
      chunk->write_hdf5_file(string(filename));
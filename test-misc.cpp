@@ -1,5 +1,7 @@
 #include <cassert>
 #include <algorithm>
+#include <future>
+#include <unistd.h>
 #include "ch_frb_io_internals.hpp"
 
 using namespace std;
@@ -166,6 +168,528 @@ static void test_encode_decode(std::mt19937 &rng)
 // -------------------------------------------------------------------------------------------------
 
 
+// Bounds the error from 4-bit requantization (used in deep levels of the telescoping ring buffer),
+// applied to chunks produced by the reference downsampling path (ds_slow_kernel*).
+static void test_requantize_4bit(std::mt19937 &rng)
+{
+    cerr << "test_requantize_4bit()";
+
+    int nt_f = constants::nt_per_assembled_chunk;
+
+    for (int iouter = 0; iouter < 10; iouter++) {
+	cerr << ".";
+
+	assembled_chunk::initializer ini_params;
+	ini_params.beam_id = randint(rng, 0, 1000);
+	ini_params.nupfreq = randint(rng, 1, 5);
+	ini_params.nt_per_packet = 1 << randint(rng, 1, 5);
+	ini_params.fpga_counts_per_sample = randint(rng, 1, 1024);
+	ini_params.force_reference = true;
+	ini_params.ichunk = 2 * randint(rng, 0, 1000);
+
+	unique_ptr<assembled_chunk> src1 = assembled_chunk::make(ini_params);
+	ini_params.ichunk++;
+	unique_ptr<assembled_chunk> src2 = assembled_chunk::make(ini_params);
+	ini_params.ichunk--;
+	ini_params.binning = 2;
+	unique_ptr<assembled_chunk> ref = assembled_chunk::make(ini_params);
+	unique_ptr<assembled_chunk> rq = assembled_chunk::make(ini_params);
+	unique_ptr<assembled_chunk> dst = assembled_chunk::make(ini_params);
+
+	src1->randomize(rng);
+	src2->randomize(rng);
+	ref->downsample(src1.get(), src2.get());
+
+	memcpy(rq->data, ref->data, ref->ndata);
+	memcpy(rq->scales, ref->scales, ref->nscales * sizeof(float));
+	memcpy(rq->offsets, ref->offsets, ref->nscales * sizeof(float));
+	rq->compress(4, (iouter % 2) == 1);
+	rq->decompress(dst.get());
+
+	int nfreq_f = constants::nfreq_coarse_tot * ref->nupfreq;
+	vector<float> ref_intensity(nfreq_f * nt_f), ref_weights(nfreq_f * nt_f);
+	vector<float> dst_intensity(nfreq_f * nt_f), dst_weights(nfreq_f * nt_f);
+
+	ref->decode(&ref_intensity[0], &ref_weights[0], nt_f, nt_f);
+	dst->decode(&dst_intensity[0], &dst_weights[0], nt_f, nt_f);
+
+	for (int ifreq = 0; ifreq < nfreq_f; ifreq++) {
+	    for (int it = 0; it < nt_f; it++) {
+		int i = ifreq*nt_f + it;
+		int s = (ifreq / ref->nupfreq) * ref->nt_coarse + (it / ref->nt_per_packet);
+
+		if (ref_weights[i] != dst_weights[i]) {
+		    cerr << "test_requantize_4bit: mask mismatch at (ifreq,it)=(" << ifreq << "," << it << ")\n";
+		    throw runtime_error("test_requantize_4bit() failed");
+		}
+
+		if (ref_weights[i] == 0.0)
+		    continue;
+
+		// Requantization maps the range of 8-bit values in each block onto 14 levels, so the
+		// error is at most half a step, i.e. (253/13)/2 in units of the original scale.
+		float bound = 0.5f * (253.0f/13.0f) * ref->scales[s] + 1.0e-4f * (fabs(ref_intensity[i]) + 1.0f);
+
+		if (fabs(ref_intensity[i] - dst_intensity[i]) > bound) {
+		    cerr << "test_requantize_4bit: (ifreq,it)=(" << ifreq << "," << it << "), (ref,dst)=(" 
+			 << ref_intensity[i] << "," << dst_intensity[i] << "), bound=" << bound << "\n";
+		    throw runtime_error("test_requantize_4bit() failed");
+		}
+	    }
+	}
+    }
+
+    cerr << "success\n";
+}
+
+
+// -------------------------------------------------------------------------------------------------
+
+
+static bool same_chunk_data(const assembled_chunk *a, const assembled_chunk *b)
+{
+    return !memcmp(a->data, b->data, a->ndata) &&
+	!memcmp(a->scales, b->scales, a->nscales * sizeof(float)) &&
+	!memcmp(a->offsets, b->offsets, a->nscales * sizeof(float));
+}
+
+
+// Tests chunk_spill_file: wrap-around eviction in a small file, read_chunk() round trips, and
+// visibility of chunks in the writer queue (see enqueue_chunk()).
+static void test_chunk_spill_file(std::mt19937 &rng)
+{
+    cerr << "test_chunk_spill_file()";
+
+    const string filename = "test-chunk-spill-file.dat";
+    const int nchunks = 12;
+
+    assembled_chunk::initializer ini_params;
+    ini_params.beam_id = randint(rng, 0, 1000);
+    ini_params.nupfreq = 1;
+    ini_params.nt_per_packet = 16;
+    ini_params.nt_per_chunk = 256;
+    ini_params.fpga_counts_per_sample = randint(rng, 1, 1024);
+
+    vector<shared_ptr<assembled_chunk>> chunks(nchunks);
+    for (int i = 0; i < nchunks; i++) {
+	ini_params.ichunk = 100 + i;
+	chunks[i] = assembled_chunk::make(ini_params);
+	chunks[i]->randomize(rng);
+    }
+
+    // Size of one record in the spill file (including alignment padding, see chunk_spill_file::_record_nbytes()).
+    const assembled_chunk *c0 = chunks[0].get();
+    ssize_t rec_nbytes = ((2 * c0->nscales * sizeof(float) + c0->ndata + 4095) / 4096) * 4096;
+
+    // Part 1: synchronous writes to a file with room for 3 records (plus a tail which is too small for
+    // a record), so that every write after the third evicts the oldest record.
+    {
+	chunk_spill_file sf(filename, 3 * rec_nbytes + 4096, 0);
+
+	for (int i = 0; i < nchunks; i++) {
+	    cerr << ".";
+	    sf.write_chunk(chunks[i].get());
+
+	    for (int j = 0; j < nchunks; j++) {
+		chunk_spill_file::record rec;
+		shared_ptr<assembled_chunk> queued;
+		bool found = sf.find_chunk(ini_params.beam_id, chunks[j]->fpga_begin, rec, queued);
+
+		if (found != ((j <= i) && (j > i-3)))
+		    throw runtime_error("test_chunk_spill_file: chunk " + to_string(j) + " should " + (found ? "not " : "") + "be in the spill file after write " + to_string(i));
+		if (!found)
+		    continue;
+		if (queued)
+		    throw runtime_error("test_chunk_spill_file: write_chunk() should not leave chunks in the queue");
+
+		ini_params.ichunk = rec.ichunk;
+		unique_ptr<assembled_chunk> dst = assembled_chunk::make(ini_params);
+
+		if (!sf.read_chunk(rec, dst.get()) || !same_chunk_data(dst.get(), chunks[j].get()))
+		    throw runtime_error("test_chunk_spill_file: read_chunk() round trip failed");
+	    }
+
+	    vector<chunk_spill_file::record> recs;
+	    vector<shared_ptr<assembled_chunk>> queued;
+	    sf.find_chunks(ini_params.beam_id, 0, 0, UINT64_MAX, recs, queued);
+
+	    if ((recs.size() != size_t(min(i+1,3))) || (recs.back().ichunk != chunks[i]->ichunk) || queued.size())
+		throw runtime_error("test_chunk_spill_file: find_chunks() returned wrong records after wrap-around");
+	}
+    }
+
+    // Part 2: a burst of enqueue_chunk() calls.  Every accepted chunk must be visible, either in the
+    // queue (before it is written) or in the file, and every rejected chunk must be counted.
+    {
+	chunk_spill_file sf(filename, nchunks * rec_nbytes, 0, 4);
+	vector<bool> accepted(nchunks);
+	int nqueued = 0;
+	int nrejected = 0;
+
+	for (int i = 0; i < nchunks; i++) {
+	    accepted[i] = sf.enqueue_chunk(chunks[i]);
+	    nrejected += accepted[i] ? 0 : 1;
+
+	    chunk_spill_file::record rec;
+	    shared_ptr<assembled_chunk> queued;
+	    bool found = sf.find_chunk(ini_params.beam_id, chunks[i]->fpga_begin, rec, queued);
+
+	    if (found != accepted[i])
+		throw runtime_error("test_chunk_spill_file: enqueued chunk " + to_string(i) + (found ? " found, but was rejected" : " not found"));
+	    if (queued && (queued != chunks[i]))
+		throw runtime_error("test_chunk_spill_file: find_chunk() returned wrong queued chunk");
+	    if (queued)
+		nqueued++;
+	}
+
+	// The writer can't keep up with back-to-back enqueue_chunk() calls.
+	if (nqueued == 0)
+	    throw runtime_error("test_chunk_spill_file: expected find_chunk() to return a queued chunk");
+	if (sf.get_num_dropped() != nrejected)
+	    throw runtime_error("test_chunk_spill_file: get_num_dropped() doesn't match rejected chunks");
+
+	// Wait for the writer thread to drain the queue.
+	vector<chunk_spill_file::record> recs;
+	vector<shared_ptr<assembled_chunk>> queued;
+
+	for (int iter = 0; ; iter++) {
+	    recs.clear();
+	    queued.clear();
+	    sf.find_chunks(ini_params.beam_id, 0, 0, UINT64_MAX, recs, queued);
+	    if (queued.size() == 0)
+		break;
+	    if (iter >= 1000)
+		throw runtime_error("test_chunk_spill_file: timed out waiting for spill file writer");
+	    usleep(1000);
+	}
+
+	if (recs.size() != size_t(nchunks - nrejected))
+	    throw runtime_error("test_chunk_spill_file: wrong number of records after writer drained its queue");
+
+	for (const auto &rec: recs) {
+	    int i = rec.ichunk - 100;
+	    ini_params.ichunk = rec.ichunk;
+	    unique_ptr<assembled_chunk> dst = assembled_chunk::make(ini_params);
+
+	    if ((i < 0) || (i >= nchunks) || !accepted[i] || !sf.read_chunk(rec, dst.get()) || !same_chunk_data(dst.get(), chunks[i].get()))
+		throw runtime_error("test_chunk_spill_file: read_chunk() round trip failed after enqueue_chunk()");
+	}
+    }
+
+    unlink(filename.c_str());
+    cerr << "success\n";
+}
+
+
+// -------------------------------------------------------------------------------------------------
+
+
+static void pool_check(bool cond, const string &what)
+{
+    if (!cond)
+	throw runtime_error("test_memory_slab_pool: " + what);
+}
+
+
+// Exposes the free list and magazine counters, to check that slabs are conserved.
+struct memory_slab_pool_tester : public memory_slab_pool {
+    memory_slab_pool_tester(const initializer &ini_params) : memory_slab_pool(ini_params) { }
+
+    // Checks curr_size + ncached + nzeroing + nheld == nslabs_allocated, where 'nheld' is the number of
+    // slabs handed out to the caller.  Returns ncached.
+    ssize_t check_conservation(ssize_t nheld, const string &where)
+    {
+	lock_guard<std::mutex> lg(this->lock);
+	pool_check(curr_size + ncached + nzeroing + nheld == nslabs_allocated, "slabs not conserved " + where);
+	return ncached;
+    }
+};
+
+
+// Quotas, reservations, and reclaim callbacks (see memory_slab_pool::add_client()).
+static void test_memory_slab_pool_limits()
+{
+    cerr << "test_memory_slab_pool_limits()";
+
+    memory_slab_pool::initializer ini_params;
+    ini_params.nbytes_per_slab = 4096;
+    ini_params.nslabs = 10;
+    ini_params.verbosity = 0;
+
+    // A quota refusal.
+    {
+	auto pool = make_shared<memory_slab_pool> (ini_params);
+	int c = pool->add_client(0, 0, 3, nullptr);
+	vector<memory_slab_t> v;
+
+	for (int i = 0; i < 3; i++) {
+	    v.push_back(pool->get_slab(false, false, -1, c));
+	    pool_check(bool(v.back()), "get_slab() failed within quota");
+	}
+
+	pool_check(!pool->get_slab(false, false, -1, c), "get_slab() succeeded beyond quota");
+	pool_check(pool->get_pressure_stats().num_quota_refusals == 1, "quota refusal not counted");
+	pool_check(bool(pool->get_slab(false, false, -1, -1)), "quota applied to a different client");
+
+	pool->put_slab(v.back());
+	v.pop_back();
+	v.push_back(pool->get_slab(false, false, -1, c));
+	pool_check(bool(v.back()), "get_slab() failed after returning a slab below quota");
+
+	for (auto &p: v)
+	    pool->put_slab(p);
+    }
+    cerr << ".";
+
+    // A reservation protecting another client.
+    {
+	auto pool = make_shared<memory_slab_pool> (ini_params);
+	int a = pool->add_client(0, 4, 0, nullptr);
+	int b = pool->add_client(1, 0, 0, nullptr);
+	vector<memory_slab_t> v;
+
+	for (int i = 0; i < 6; i++) {
+	    v.push_back(pool->get_slab(false, false, -1, b));
+	    pool_check(bool(v.back()), "get_slab() failed outside reservation");
+	}
+
+	pool_check(!pool->get_slab(false, false, -1, b), "get_slab() ate into another client's reservation");
+	pool_check(pool->get_pressure_stats().num_quota_refusals == 1, "reservation refusal not counted");
+
+	for (int i = 0; i < 4; i++) {
+	    v.push_back(pool->get_slab(false, false, -1, a));
+	    pool_check(bool(v.back()), "get_slab() failed within own reservation");
+	}
+
+	for (auto &p: v)
+	    pool->put_slab(p);
+    }
+    cerr << ".";
+
+    // A reclaim callback firing when the number of available slabs drops below the low watermark.
+    {
+	ini_params.low_watermark = 3;
+	ini_params.high_watermark = 6;
+
+	auto pool = make_shared<memory_slab_pool> (ini_params);
+	vector<ssize_t> requests;
+	int c = pool->add_client(0, 0, 0, [&requests](ssize_t n) { requests.push_back(n); return n; });
+	vector<memory_slab_t> v;
+
+	for (int i = 0; i < 7; i++)
+	    v.push_back(pool->get_slab(false, false, -1, c));
+
+	pool_check(requests.size() == 0, "reclaim callback called above low watermark");
+
+	// 2 slabs are left, so the callback is asked for (high_watermark - 2) slabs.
+	v.push_back(pool->get_slab(false, false, -1, c));
+	pool_check((requests.size() == 1) && (requests[0] == 4), "reclaim callback not called below low watermark");
+
+	memory_slab_pool::pressure_stats ps = pool->get_pressure_stats();
+	pool_check((ps.num_reclaims == 1) && (ps.num_slabs_reclaimed == 4), "reclaim not counted");
+
+	for (auto &p: v)
+	    pool->put_slab(p);
+    }
+
+    cerr << "success\n";
+}
+
+
+// Per-thread magazines: when the free list is empty, get_slab() drains the other threads' magazines.
+static void test_memory_slab_pool_magazines()
+{
+    cerr << "test_memory_slab_pool_magazines()";
+
+    const int nslabs = 8;
+
+    memory_slab_pool::initializer ini_params;
+    ini_params.nbytes_per_slab = 4096;
+    ini_params.nslabs = nslabs;
+    ini_params.verbosity = 0;
+    ini_params.magazine_size = 4;
+
+    auto pool = make_shared<memory_slab_pool_tester> (ini_params);
+    pool->check_conservation(0, "after construction");
+
+    // The holder thread fills its magazine, and stays alive (so that the magazine isn't flushed on exit).
+    std::promise<void> filled, release;
+
+    std::thread holder([&]() {
+	vector<memory_slab_t> v;
+	for (int i = 0; i < 3; i++)
+	    v.push_back(pool->get_slab(false));
+	for (auto &p: v)
+	    pool->put_slab(p);
+	filled.set_value();
+	release.get_future().wait();
+    });
+
+    filled.get_future().wait();
+    pool_check(pool->check_conservation(0, "after holder thread") > 0, "expected slabs cached in the holder thread's magazine");
+
+    vector<memory_slab_t> v;
+    for (int i = 0; i < nslabs; i++) {
+	v.push_back(pool->get_slab(false));
+	pool_check(bool(v.back()), "get_slab() didn't drain the other thread's magazine");
+	pool->check_conservation(v.size(), "while draining");
+    }
+
+    pool_check(!pool->get_slab(false), "get_slab() returned more slabs than allocated");
+    pool_check(pool->check_conservation(nslabs, "after draining") == 0, "magazines not empty after draining");
+
+    for (int i = 0; i < nslabs; i++) {
+	pool->put_slab(v[i]);
+	pool->check_conservation(nslabs-i-1, "while returning slabs");
+    }
+
+    pool_check(pool->count_slabs_available() == nslabs, "slabs lost after returning them");
+    pool_check(pool->get_usage_stats().nslabs_in_use == 0, "slabs in use after returning them");
+
+    release.set_value();
+    holder.join();
+    cerr << "success\n";
+}
+
+
+// Size classes: two pools with different slab sizes grow and shrink within a shared memory_slab_budget.
+static void test_memory_slab_budget()
+{
+    cerr << "test_memory_slab_budget()";
+
+    auto budget = make_shared<memory_slab_budget> (10 * 4096);
+
+    memory_slab_pool::initializer ini_small;
+    ini_small.nbytes_per_slab = 4096;
+    ini_small.nslabs = 2;
+    ini_small.nslabs_max = 8;
+    ini_small.budget = budget;
+    ini_small.verbosity = 0;
+
+    memory_slab_pool::initializer ini_large;
+    ini_large.nbytes_per_slab = 8192;
+    ini_large.nslabs = 1;
+    ini_large.nslabs_max = 4;
+    ini_large.budget = budget;
+    ini_large.verbosity = 0;
+
+    auto small = make_shared<memory_slab_pool> (ini_small);
+    auto large = make_shared<memory_slab_pool> (ini_large);
+    pool_check(budget->get_nbytes_used() == 4 * 4096, "initial slabs not charged to budget");
+
+    // The small pool grows to its maximum, which uses the whole budget.
+    vector<memory_slab_t> vs;
+    for (int i = 0; i < 8; i++) {
+	vs.push_back(small->get_slab(true, false, -1, -1, 3000));
+	pool_check(bool(vs.back()), "small pool didn't grow");
+    }
+
+    pool_check(!small->get_slab(), "small pool grew beyond nslabs_max");
+    pool_check(budget->get_nbytes_used() == 10 * 4096, "grown slabs not charged to budget");
+    pool_check(small->get_usage_stats().num_grown == 6, "grown slabs not counted");
+
+    // The large pool can't grow while the small pool's grown slabs are in use.
+    vector<memory_slab_t> vl;
+    vl.push_back(large->get_slab());
+    pool_check(bool(vl.back()), "large pool's initial slab unavailable");
+    pool_check(!large->get_slab(), "large pool grew beyond budget");
+    pool_check(budget->get_num_failed_charges() > 0, "failed charge not counted");
+
+    // Once they're idle, the small pool shrinks to make room.
+    for (auto &p: vs)
+	small->put_slab(p);
+
+    for (int i = 0; i < 2; i++) {
+	vl.push_back(large->get_slab());
+	pool_check(bool(vl.back()), "large pool didn't grow after small pool became idle");
+    }
+
+    memory_slab_pool::usage_stats us = small->get_usage_stats();
+    pool_check((us.nslabs_allocated == 4) && (us.num_shrunk == 4), "small pool didn't shrink as expected");
+    pool_check(budget->get_nbytes_used() <= budget->nbytes_max, "budget exceeded");
+
+    vector<memory_slab_pool::usage_stats> cs = budget->get_class_stats();
+    pool_check((cs.size() == 2) && (cs[1].nslabs_allocated == 3) && (cs[1].nslabs_in_use == 3), "wrong class stats");
+
+    // Destroying a pool releases its bytes.
+    for (auto &p: vl)
+	large->put_slab(p);
+
+    large.reset();
+    pool_check(budget->get_nbytes_used() == 4 * 4096, "destroyed pool's bytes not released");
+    small.reset();
+    pool_check(budget->get_nbytes_used() == 0, "budget not empty after destroying pools");
+
+    cerr << "success\n";
+}
+
+
+// assembled_chunk::compress() charges the compressed bytes to the pool's budget, and leaves the chunk
+// uncompressed if the budget is exhausted.
+static void test_compressed_chunk_budget(std::mt19937 &rng)
+{
+    cerr << "test_compressed_chunk_budget()";
+
+    const int nupfreq = 1;
+    const int nt_per_packet = 16;
+    ssize_t slab_size = assembled_chunk::get_memory_slab_size(nupfreq, nt_per_packet, 0);
+
+    for (int ipass = 0; ipass < 2; ipass++) {
+	// On the first pass, the pool's initial slabs use the whole budget.
+	auto budget = make_shared<memory_slab_budget> ((ipass + 2) * slab_size);
+
+	memory_slab_pool::initializer pool_ini;
+	pool_ini.nbytes_per_slab = slab_size;
+	pool_ini.nslabs = 2;
+	pool_ini.budget = budget;
+	pool_ini.verbosity = 0;
+
+	auto pool = make_shared<memory_slab_pool> (pool_ini);
+
+	assembled_chunk::initializer ini_params;
+	ini_params.nupfreq = nupfreq;
+	ini_params.nt_per_packet = nt_per_packet;
+	ini_params.fpga_counts_per_sample = 384;
+	ini_params.pool = pool;
+	ini_params.slab = pool->get_slab();
+
+	unique_ptr<assembled_chunk> chunk = assembled_chunk::make(ini_params);
+	chunk->randomize(rng);
+
+	int nt_f = chunk->nt_per_chunk;
+	int nfreq_f = constants::nfreq_coarse_tot * nupfreq;
+	vector<float> ref_intensity(nfreq_f * nt_f), ref_weights(nfreq_f * nt_f);
+	chunk->decode(&ref_intensity[0], &ref_weights[0], nt_f, nt_f);
+
+	bool compressed = chunk->compress(8, true);
+
+	if (ipass == 0) {
+	    pool_check(!compressed && !chunk->is_compressed(), "compress() succeeded with exhausted budget");
+	    pool_check(budget->get_num_failed_charges() == 1, "refused charge not counted");
+	    pool_check(pool->get_usage_stats().nslabs_in_use == 1, "refused chunk lost its slab");
+	}
+	else {
+	    pool_check(compressed && chunk->is_compressed(), "compress() failed with room in budget");
+	    pool_check(budget->get_nbytes_used() == 2 * slab_size + chunk->get_memory_nbytes(), "compressed bytes not charged");
+	    pool_check(pool->get_usage_stats().nslabs_in_use == 0, "compressed chunk kept its slab");
+	}
+
+	// Either way, the chunk's data is unchanged.
+	vector<float> intensity(nfreq_f * nt_f), weights(nfreq_f * nt_f);
+	chunk->decode(&intensity[0], &weights[0], nt_f, nt_f);
+	pool_check((intensity == ref_intensity) && (weights == ref_weights), "chunk data changed by compress()");
+
+	chunk.reset();
+	pool_check(budget->get_nbytes_used() == 2 * slab_size, "compressed bytes not released");
+    }
+
+    cerr << "success\n";
+}
+
+
+// -------------------------------------------------------------------------------------------------
+
+
 int main(int argc, char **argv)
 {
     std::random_device rd;
@@ -173,6 +697,12 @@ int main(int argc, char **argv)
 
     test_lexical_cast();       // defined in lexical_cast.cpp
     test_packet_offsets(rng);  // defined in intensity_packet.cpp
+    test_requantize_4bit(rng); // defined above (runs before the AVX2 tests, so it doesn't depend on them passing)
+    test_chunk_spill_file(rng); // defined above
+    test_memory_slab_pool_limits();
+    test_memory_slab_pool_magazines();
+    test_memory_slab_budget();
+    test_compressed_chunk_budget(rng);
     test_avx2_kernels(rng);    // defined in avx2_kernels.cpp
     test_encode_decode(rng);   // defined above
 
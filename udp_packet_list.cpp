@@ -13,7 +13,7 @@ static_assert(constants::max_input_udp_packet_size >= constants::max_output_udp_
 	      "udp_packet_list.cpp assumes constants::max_input_udp_packet_size >= constants::max_output_udp_packet_size");
 
 
-udp_packet_list::udp_packet_list(int max_npackets_, int max_nbytes_) :
+udp_packet_list::udp_packet_list(int max_npackets_, int max_nbytes_, ssize_t huge_page_size) :
     max_npackets(max_npackets_), max_nbytes(max_nbytes_)
 {
     if (max_npackets <= 0)
@@ -22,7 +22,7 @@ udp_packet_list::udp_packet_list(int max_npackets_, int max_nbytes_) :
 	throw runtime_error("udp_packet_list constructor: expected max_nbytes > 0");
 
     // Note: this->curr_npackets and this->curr_nbytes are initialized to zero automatically.
-    this->buf = unique_ptr<uint8_t[]> (new uint8_t[max_nbytes + constants::max_input_udp_packet_size]);
+    this->buf = alloc_memory_slab(max_nbytes + constants::max_input_udp_packet_size, huge_page_size);
     this->off_buf = unique_ptr<int[]> (new int[max_npackets + 1]);
     this->data_start = buf.get();
     this->data_end = data_start;
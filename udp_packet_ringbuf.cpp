@@ -9,17 +9,18 @@ namespace ch_frb_io {
 #endif
 
 
-udp_packet_ringbuf::udp_packet_ringbuf(int ringbuf_capacity_, int max_npackets_per_list_, int max_nbytes_per_list_)
+udp_packet_ringbuf::udp_packet_ringbuf(int ringbuf_capacity_, int max_npackets_per_list_, int max_nbytes_per_list_, ssize_t huge_page_size_)
     : ringbuf_capacity(ringbuf_capacity_), 
       max_npackets_per_list(max_npackets_per_list_),
-      max_nbytes_per_list(max_nbytes_per_list_)
+      max_nbytes_per_list(max_nbytes_per_list_),
+      huge_page_size(huge_page_size_)
 {
     if (ringbuf_capacity <= 0)
 	throw runtime_error("udp_packet_ringbuf constructor: expected ringbuf_capacity > 0");
 
     this->ringbuf.resize(ringbuf_capacity);
     for (int i = 0; i < ringbuf_capacity; i++)
-	ringbuf[i] = make_unique<udp_packet_list> (this->max_npackets_per_list, this->max_nbytes_per_list);
+	ringbuf[i] = make_unique<udp_packet_list> (this->max_npackets_per_list, this->max_nbytes_per_list, this->huge_page_size);
 
     pthread_mutex_init(&this->lock, NULL);
     pthread_cond_init(&this->cond_packets_added, NULL);
@@ -43,6 +44,16 @@ void udp_packet_ringbuf::get_size(int* currsize, int* maxsize) {
     pthread_mutex_unlock(&this->lock);
 }
 
+void udp_packet_ringbuf::get_memory_accounting(int64_t &nbytes_allocated, int64_t &nbytes_queued) {
+    nbytes_allocated = int64_t(ringbuf_capacity) * int64_t(max_nbytes_per_list + constants::max_input_udp_packet_size);
+    nbytes_queued = 0;
+
+    pthread_mutex_lock(&this->lock);
+    for (int i = 0; i < ringbuf_size; i++)
+        nbytes_queued += ringbuf[(ringbuf_pos + i) % ringbuf_capacity]->curr_nbytes;
+    pthread_mutex_unlock(&this->lock);
+}
+
 bool udp_packet_ringbuf::put_packet_list(unique_ptr<udp_packet_list> &p, bool is_blocking)
 {    
     if (!p)